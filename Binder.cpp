@@ -16,14 +16,24 @@
 
 #include <hwbinder/Binder.h>
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
 #include <utils/misc.h>
+#include <utils/Timers.h>
 #include <hwbinder/BpHwBinder.h>
 #include <hwbinder/IInterface.h>
+#include <hwbinder/IPCThreadState.h>
 #include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+#include <hwbinder/binder_kernel.h>
 
 #include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <vector>
 
 namespace android {
 namespace hardware {
@@ -58,15 +68,274 @@ bool IBinder::checkSubclass(const void* /*subclassID*/) const
 
 // ---------------------------------------------------------------------------
 
+// Most pieces of a chunked reply, see onChunkTransact().
+static const size_t kChunkSize = 64 * 1024;
+// Most chunked transfers kept per object, and per calling uid, so that no
+// client can take all of them. Beyond that new transfers are refused.
+static const size_t kMaxChunkSessions = 8;
+static const size_t kMaxChunkSessionsPerUid = kMaxChunkSessions / 2;
+// A transfer that made no progress for this long was given up by its client
+// (which stops waiting after 5s) and may be dropped to make room.
+static const nsecs_t kChunkSessionIdleTimeout = seconds_to_nanoseconds(10);
+
+// One chunked transfer: the request while it is received, then the reply
+// while it is read back.
+struct ChunkSession
+{
+    uid_t uid = 0;
+    uint32_t code = 0;
+    uint32_t flags = 0;
+    size_t total = 0;
+    status_t error = NO_ERROR;
+    nsecs_t lastActive = 0;
+    Parcel data;
+    Parcel reply;
+};
+
+// A reply kept by the reply cache: the call it answers, in the form of
+// ReplyCache::canonicalize(), and the reply with a copy of every buffer
+// its objects point to.
+struct CachedReply : public LightRefBase<CachedReply>
+{
+    uint32_t code = 0;
+    std::vector<uint8_t> request;
+    std::vector<uint8_t> data;
+    std::vector<binder_size_t> objects;
+    std::vector<std::vector<uint8_t>> buffers;
+    uint64_t lastUse = 0;
+
+    size_t bytes() const {
+        size_t n = request.size() + data.size() + objects.size() * sizeof(binder_size_t);
+        for (const auto& buffer : buffers) n += buffer.size();
+        return n;
+    }
+};
+
+// See setReplyCacheSize(). Guarded by the mLock of Extras.
+class BHwBinder::ReplyCache
+{
+public:
+    size_t mMaxBytes = 0;
+    // Every set of cacheable codes published to Extras::mReplyCacheCodes.
+    // They are read without the lock, so none is freed before the cache.
+    std::vector<std::unique_ptr<const SortedVector<uint32_t>>> mCodeSets;
+    // Keyed by hash(), equal hashes of different calls replace each other.
+    KeyedVector<uint64_t, sp<CachedReply>> mReplies;
+    size_t mBytes = 0;
+    uint64_t mClock = 0;
+    // bumped by invalidation, so that replies computed before it are dropped
+    uint64_t mGeneration = 0;
+    ReplyCacheStats mStats = {};
+
+    static uint64_t hash(uint32_t code, const std::vector<uint8_t>& request) {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ull;
+        auto mix = [&h](const uint8_t* p, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                h ^= p[i];
+                h *= 0x100000001b3ull;
+            }
+        };
+        mix(reinterpret_cast<const uint8_t*>(&code), sizeof(code));
+        mix(request.data(), request.size());
+        return h;
+    }
+
+    // Turns a call into bytes that are the same for the same call: the
+    // data, interface token included, with the buffer pointers cleared,
+    // followed by the contents of the buffers with the pointers to their
+    // children cleared. A hit skips onTransact() and with it the stub's
+    // check of the token, so the token is part of the key, and a call
+    // without one isn't cached. Fails for anything but buffers as well.
+    static bool canonicalize(const Parcel& data, std::vector<uint8_t>* out) {
+        data.setDataPosition(0);
+        const char* token = data.readCString();
+        const size_t start = data.dataPosition();
+        data.setDataPosition(0);
+        if (token == nullptr || token[0] == '\0') return false;
+
+        const uint8_t* bytes = data.data();
+        const binder_size_t* objects = data.objects();
+        const size_t count = data.objectsCount();
+        out->assign(bytes, bytes + data.dataSize());
+        std::vector<size_t> copies(count);
+        for (size_t i = 0; i < count; i++) {
+            if (objects[i] < start) return false;
+            const binder_buffer_object* obj =
+                reinterpret_cast<const binder_buffer_object*>(bytes + objects[i]);
+            if (obj->hdr.type != BINDER_TYPE_PTR || (obj->flags & BINDER_BUFFER_FLAG_REF)) {
+                return false;
+            }
+            memset(out->data() + objects[i] + offsetof(binder_buffer_object, buffer), 0,
+                   sizeof(obj->buffer));
+            copies[i] = out->size();
+            const uint8_t* contents = reinterpret_cast<const uint8_t*>(obj->buffer);
+            out->insert(out->end(), contents, contents + obj->length);
+            if (obj->flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+                if (obj->parent >= i) return false;
+                const binder_buffer_object* parent =
+                    reinterpret_cast<const binder_buffer_object*>(bytes + objects[obj->parent]);
+                if (obj->parent_offset + sizeof(binder_uintptr_t) > parent->length) return false;
+                memset(out->data() + copies[obj->parent] + obj->parent_offset, 0,
+                       sizeof(binder_uintptr_t));
+            }
+        }
+        return true;
+    }
+
+    // A copy of |reply| that owns its buffers, or nullptr if it has objects
+    // other than buffers.
+    static sp<CachedReply> snapshot(const Parcel& reply) {
+        sp<CachedReply> cached = new CachedReply;
+        const uint8_t* bytes = reply.data();
+        const binder_size_t* objects = reply.objects();
+        cached->data.assign(bytes, bytes + reply.dataSize());
+        for (size_t i = 0; i < reply.objectsCount(); i++) {
+            const binder_buffer_object* obj =
+                reinterpret_cast<const binder_buffer_object*>(bytes + objects[i]);
+            if (obj->hdr.type != BINDER_TYPE_PTR || (obj->flags & BINDER_BUFFER_FLAG_REF)) {
+                return nullptr;
+            }
+            const uint8_t* contents = reinterpret_cast<const uint8_t*>(obj->buffer);
+            cached->objects.push_back(objects[i]);
+            cached->buffers.emplace_back(contents, contents + obj->length);
+        }
+        return cached;
+    }
+
+    // Writes |cached| into |reply|, its buffers pointing to the copies.
+    static status_t replay(const CachedReply& cached, Parcel* reply) {
+        // a null buffer isn't an object, so empty ones need an address
+        static const uint8_t kEmpty = 0;
+        const uint8_t* bytes = cached.data.data();
+        size_t pos = 0;
+        status_t err = NO_ERROR;
+        for (size_t i = 0; err == NO_ERROR && i < cached.objects.size(); i++) {
+            const size_t at = cached.objects[i];
+            if (at > pos) err = reply->write(bytes + pos, at - pos);
+            if (err != NO_ERROR) break;
+
+            binder_buffer_object obj;
+            memcpy(&obj, bytes + at, sizeof(obj));
+            const void* buffer = cached.buffers[i].empty() ? &kEmpty : cached.buffers[i].data();
+            size_t handle;
+            if (obj.flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+                err = reply->writeEmbeddedBuffer(buffer, obj.length, &handle, obj.parent,
+                                                 obj.parent_offset);
+            } else {
+                err = reply->writeBuffer(buffer, obj.length, &handle);
+            }
+            pos = at + sizeof(obj);
+        }
+        if (err == NO_ERROR && pos < cached.data.size()) {
+            err = reply->write(bytes + pos, cached.data.size() - pos);
+        }
+        return err;
+    }
+
+    sp<CachedReply> findLocked(uint32_t code, const std::vector<uint8_t>& request) {
+        ssize_t index = mReplies.indexOfKey(hash(code, request));
+        if (index >= 0) {
+            const sp<CachedReply>& cached = mReplies.valueAt(index);
+            if (cached->code == code && cached->request == request) {
+                cached->lastUse = ++mClock;
+                mStats.hits++;
+                return cached;
+            }
+        }
+        mStats.misses++;
+        return nullptr;
+    }
+
+    void addLocked(const sp<CachedReply>& cached, uint64_t generation) {
+        const size_t bytes = cached->bytes();
+        if (generation != mGeneration || bytes > mMaxBytes) {
+            mStats.uncacheable++;
+            return;
+        }
+        const uint64_t key = hash(cached->code, cached->request);
+        ssize_t index = mReplies.indexOfKey(key);
+        if (index >= 0) {
+            mBytes -= mReplies.valueAt(index)->bytes();
+            mReplies.removeItemsAt(index);
+        }
+        while (mBytes + bytes > mMaxBytes) {
+            size_t oldest = 0;
+            for (size_t i = 1; i < mReplies.size(); i++) {
+                if (mReplies.valueAt(i)->lastUse < mReplies.valueAt(oldest)->lastUse) {
+                    oldest = i;
+                }
+            }
+            mBytes -= mReplies.valueAt(oldest)->bytes();
+            mReplies.removeItemsAt(oldest);
+            mStats.evictions++;
+        }
+        cached->lastUse = ++mClock;
+        mReplies.add(key, cached);
+        mBytes += bytes;
+    }
+
+    void clearLocked() {
+        mReplies.clear();
+        mBytes = 0;
+        mGeneration++;
+    }
+};
+
 class BHwBinder::Extras
 {
 public:
+    ~Extras() {
+        for (size_t i = 0; i < mChunkSessions.size(); i++) {
+            delete mChunkSessions.valueAt(i);
+        }
+        delete mReplyCache;
+    }
+
     // unlocked objects
     bool mRequestingSid = false;
+    // set by setMinSchedulerPolicy() and setInheritRt(); until then the
+    // defaults of the process apply when the node is flattened
+    bool mHasSchedPolicy = false;
+    bool mHasInheritRt = false;
+    bool mInheritRt = true;
+    size_t mMaxChunkedSize = 0;
+    // set while the reply cache is on, for a check without mLock
+    std::atomic<bool> mReplyCacheOn{false};
+    // the codes marked with setReplyCacheable(), never changed once
+    // published, so that a call checks its code without mLock
+    std::atomic<const SortedVector<uint32_t>*> mReplyCacheCodes{nullptr};
 
     // for below objects
     Mutex mLock;
     BpHwBinder::ObjectManager mObjects;
+    ReplyCache* mReplyCache = nullptr;
+    // Keyed by the token the client puts in every piece.
+    KeyedVector<uint64_t, ChunkSession*> mChunkSessions;
+
+    // Returns WOULD_BLOCK if the table, or the caller's share of it, is
+    // full. Only transfers their clients gave up are dropped to make room,
+    // so one client can't cut off another's.
+    status_t addChunkSessionLocked(uint64_t key, ChunkSession* session) {
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        size_t ownSessions = 0;
+        for (size_t i = mChunkSessions.size(); i-- > 0;) {
+            ChunkSession* s = mChunkSessions.valueAt(i);
+            if (now - s->lastActive > kChunkSessionIdleTimeout) {
+                delete s;
+                mChunkSessions.removeItemsAt(i);
+            } else if (s->uid == session->uid) {
+                ownSessions++;
+            }
+        }
+        if (mChunkSessions.size() >= kMaxChunkSessions ||
+                ownSessions >= kMaxChunkSessionsPerUid) {
+            return WOULD_BLOCK;
+        }
+        session->lastActive = now;
+        mChunkSessions.add(key, session);
+        return NO_ERROR;
+    }
 };
 
 // ---------------------------------------------------------------------------
@@ -83,6 +352,56 @@ int BHwBinder::getMinSchedulingPriority() {
     return mSchedPriority;
 }
 
+bool BHwBinder::isValidSchedulerPolicy(int policy, int priority) {
+    switch (policy) {
+        case SCHED_NORMAL:
+            return priority >= -20 && priority <= 19;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return priority >= 1 && priority <= 99;
+        default:
+            return false;
+    }
+}
+
+status_t BHwBinder::setMinSchedulerPolicy(int policy, int priority) {
+    if (!isValidSchedulerPolicy(policy, priority)) return BAD_VALUE;
+    Extras* e = getOrCreateExtras();
+    if (e == nullptr) return NO_MEMORY;
+    mSchedPolicy = policy;
+    mSchedPriority = priority;
+    e->mHasSchedPolicy = true;
+    return NO_ERROR;
+}
+
+void BHwBinder::setInheritRt(bool inheritRt) {
+    Extras* e = getOrCreateExtras();
+    if (e == nullptr) return;
+    e->mInheritRt = inheritRt;
+    e->mHasInheritRt = true;
+}
+
+void BHwBinder::getSchedulerPolicy(const sp<ProcessState>& proc,
+                                   int* policy, int* priority, bool* inheritRt) {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+
+    *policy = mSchedPolicy;
+    *priority = mSchedPriority;
+    *inheritRt = true;
+    // A policy written to the fields directly, as generated stubs do, is
+    // kept as well.
+    const bool hasSchedPolicy = (e && e->mHasSchedPolicy) ||
+            mSchedPolicy != SCHED_NORMAL || mSchedPriority != 0;
+    if (!hasSchedPolicy && proc != nullptr) {
+        proc->getDefaultSchedulerPolicy(policy, priority);
+    }
+    if (e && e->mHasInheritRt) {
+        *inheritRt = e->mInheritRt;
+    } else if (proc != nullptr) {
+        *inheritRt = proc->getDefaultInheritRt();
+    }
+}
+
 bool BHwBinder::isRequestingSid() {
     Extras* e = mExtras.load(std::memory_order_acquire);
 
@@ -105,6 +424,21 @@ void BHwBinder::setRequestingSid(bool requestingSid) {
     e->mRequestingSid = requestingSid;
 }
 
+void BHwBinder::setMaxChunkedSize(size_t bytes) {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+
+    if (!e) {
+        if (bytes == 0) {
+            return;
+        }
+
+        e = getOrCreateExtras();
+        if (!e) return; // out of memory
+    }
+
+    e->mMaxChunkedSize = bytes;
+}
+
 status_t BHwBinder::transact(
     uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags, TransactCallback callback)
 {
@@ -112,7 +446,17 @@ status_t BHwBinder::transact(
 
     status_t err = NO_ERROR;
     switch (code) {
+        case CHUNK_DATA_TRANSACTION:
+        case CHUNK_PROGRESS_TRANSACTION:
+        case CHUNK_COMMIT_TRANSACTION:
+        case CHUNK_READ_TRANSACTION:
+            err = onChunkTransact(code, data, reply);
+            break;
         default:
+            if ((flags & TF_ONE_WAY) == 0 && callback != nullptr && isReplyCacheable(code)) {
+                err = cachedTransact(code, data, reply, flags, callback);
+                break;
+            }
             err = onTransact(code, data, reply, flags,
                     [&](auto &replyParcel) {
                         replyParcel.setDataPosition(0);
@@ -126,6 +470,133 @@ status_t BHwBinder::transact(
     return err;
 }
 
+void BHwBinder::setReplyCacheSize(size_t maxBytes) {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+
+    if (!e) {
+        if (maxBytes == 0) {
+            return;
+        }
+
+        e = getOrCreateExtras();
+        if (!e) return; // out of memory
+    }
+
+    AutoMutex _l(e->mLock);
+    if (!e->mReplyCache) e->mReplyCache = new ReplyCache;
+    ReplyCache* cache = e->mReplyCache;
+    cache->mMaxBytes = maxBytes;
+    if (cache->mBytes > maxBytes) cache->clearLocked();
+    e->mReplyCacheOn = maxBytes > 0;
+}
+
+void BHwBinder::setReplyCacheable(uint32_t code, bool cacheable) {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+
+    if (!e) {
+        if (!cacheable) {
+            return;
+        }
+
+        e = getOrCreateExtras();
+        if (!e) return; // out of memory
+    }
+
+    AutoMutex _l(e->mLock);
+    if (!e->mReplyCache) e->mReplyCache = new ReplyCache;
+    const SortedVector<uint32_t>* codes = e->mReplyCacheCodes.load(std::memory_order_relaxed);
+    if ((codes != nullptr && codes->indexOf(code) >= 0) == cacheable) return;
+    SortedVector<uint32_t>* next =
+            codes != nullptr ? new SortedVector<uint32_t>(*codes) : new SortedVector<uint32_t>;
+    if (cacheable) {
+        next->add(code);
+    } else {
+        next->remove(code);
+    }
+    e->mReplyCache->mCodeSets.emplace_back(next);
+    e->mReplyCacheCodes.store(next, std::memory_order_release);
+}
+
+void BHwBinder::invalidateReplyCache() {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+    if (!e) return;
+
+    AutoMutex _l(e->mLock);
+    if (e->mReplyCache) e->mReplyCache->clearLocked();
+}
+
+BHwBinder::ReplyCacheStats BHwBinder::getReplyCacheStats() {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+    if (!e) return ReplyCacheStats();
+
+    AutoMutex _l(e->mLock);
+    if (!e->mReplyCache) return ReplyCacheStats();
+    ReplyCacheStats stats = e->mReplyCache->mStats;
+    stats.entries = e->mReplyCache->mReplies.size();
+    stats.bytes = e->mReplyCache->mBytes;
+    return stats;
+}
+
+// Called for every incoming call, so it doesn't take mLock.
+bool BHwBinder::isReplyCacheable(uint32_t code) {
+    Extras* e = mExtras.load(std::memory_order_acquire);
+    if (!e || !e->mReplyCacheOn.load(std::memory_order_relaxed)) return false;
+
+    const SortedVector<uint32_t>* codes = e->mReplyCacheCodes.load(std::memory_order_acquire);
+    return codes != nullptr && codes->indexOf(code) >= 0;
+}
+
+// A call to a cacheable code: the reply comes from the cache if it has
+// one for these arguments, else from onTransact(), and is then kept.
+status_t BHwBinder::cachedTransact(
+    uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags, TransactCallback callback)
+{
+    Extras* e = mExtras.load(std::memory_order_acquire);
+    std::vector<uint8_t> request;
+    bool canonical = ReplyCache::canonicalize(data, &request);
+    uint64_t generation = 0;
+    sp<CachedReply> cached;
+    {
+        AutoMutex _l(e->mLock);
+        ReplyCache* cache = e->mReplyCache;
+        if (!cache) {
+            canonical = false;
+        } else if (!canonical) {
+            cache->mStats.uncacheable++;
+        } else {
+            cached = cache->findLocked(code, request);
+            generation = cache->mGeneration;
+        }
+    }
+
+    if (cached != nullptr) {
+        Parcel cachedReply;
+        if (ReplyCache::replay(*cached, &cachedReply) == NO_ERROR) {
+            cachedReply.setDataPosition(0);
+            callback(cachedReply);
+            return NO_ERROR;
+        }
+        // fall back to the method
+    }
+
+    return onTransact(code, data, reply, flags,
+            [&](auto &replyParcel) {
+                if (canonical) {
+                    sp<CachedReply> kept = ReplyCache::snapshot(replyParcel);
+                    AutoMutex _l(e->mLock);
+                    if (e->mReplyCache && kept != nullptr) {
+                        kept->code = code;
+                        kept->request = std::move(request);
+                        e->mReplyCache->addLocked(kept, generation);
+                    } else if (e->mReplyCache) {
+                        e->mReplyCache->mStats.uncacheable++;
+                    }
+                }
+                replyParcel.setDataPosition(0);
+                callback(replyParcel);
+            });
+}
+
 status_t BHwBinder::linkToDeath(
     const sp<DeathRecipient>& /*recipient*/, void* /*cookie*/,
     uint32_t /*flags*/)
@@ -188,6 +659,177 @@ status_t BHwBinder::onTransact(
     return UNKNOWN_TRANSACTION;
 }
 
+// Server side of BpHwBinder::transactChunked(). Pieces of a request arrive
+// in order and are appended to the session named by the token the client
+// put in each of them. The commit carries the last piece; the whole
+// request is then handed to onTransact(), and the reply is returned with
+// the commit if it fits in one piece or read back with
+// CHUNK_READ_TRANSACTION otherwise.
+//
+// Oneway pieces come with no calling pid, only the uid, so sessions are
+// keyed on the token alone and only answer the uid that opened them.
+status_t BHwBinder::onChunkTransact(uint32_t code, const Parcel& data, Parcel* reply)
+{
+    Extras* e = mExtras.load(std::memory_order_acquire);
+    if (!e || e->mMaxChunkedSize == 0) return UNKNOWN_TRANSACTION;
+
+    uint64_t key;
+    status_t err = data.readUint64(&key);
+    if (err != NO_ERROR) return err;
+    const uid_t uid = IPCThreadState::self()->getCallingUid();
+
+    if (code == CHUNK_PROGRESS_TRANSACTION) {
+        AutoMutex _l(e->mLock);
+        ssize_t index = e->mChunkSessions.indexOfKey(key);
+        if (index < 0 || e->mChunkSessions.valueAt(index)->uid != uid) return NAME_NOT_FOUND;
+        const ChunkSession* session = e->mChunkSessions.valueAt(index);
+        if (session->error != NO_ERROR) return session->error;
+        return reply->writeUint64(session->data.dataSize());
+    }
+
+    if (code == CHUNK_READ_TRANSACTION) {
+        uint64_t offset;
+        err = data.readUint64(&offset);
+        if (err != NO_ERROR) return err;
+
+        AutoMutex _l(e->mLock);
+        ssize_t index = e->mChunkSessions.indexOfKey(key);
+        if (index < 0 || e->mChunkSessions.valueAt(index)->uid != uid) return NAME_NOT_FOUND;
+        ChunkSession* session = e->mChunkSessions.valueAt(index);
+        const size_t size = session->reply.dataSize();
+        if (offset >= size) return BAD_VALUE;
+        const size_t len = std::min(size - (size_t)offset, kChunkSize);
+        err = reply->writeUint32(len);
+        if (err == NO_ERROR) err = reply->write(session->reply.data() + offset, len);
+        session->lastActive = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (offset + len == size) {
+            delete session;
+            e->mChunkSessions.removeItemsAt(index);
+        }
+        return err;
+    }
+
+    uint32_t txCode, txFlags, len;
+    uint64_t total, offset;
+    if ((err = data.readUint32(&txCode)) != NO_ERROR ||
+            (err = data.readUint32(&txFlags)) != NO_ERROR ||
+            (err = data.readUint64(&total)) != NO_ERROR ||
+            (err = data.readUint64(&offset)) != NO_ERROR ||
+            (err = data.readUint32(&len)) != NO_ERROR) {
+        return err;
+    }
+    const void* bytes = data.readInplace(len);
+    if (bytes == nullptr) return BAD_VALUE;
+
+    ChunkSession* session;
+    {
+        AutoMutex _l(e->mLock);
+        ssize_t index = e->mChunkSessions.indexOfKey(key);
+        if (index >= 0 && e->mChunkSessions.valueAt(index)->uid != uid) {
+            // Another client's token.
+            return offset == 0 ? PERMISSION_DENIED : NAME_NOT_FOUND;
+        }
+        if (offset == 0) {
+            // A new transfer replaces anything left over under the same key.
+            if (index >= 0) {
+                delete e->mChunkSessions.valueAt(index);
+                e->mChunkSessions.removeItemsAt(index);
+            }
+            session = new ChunkSession;
+            session->uid = uid;
+            session->code = txCode;
+            session->flags = txFlags;
+            session->total = total;
+            // A transfer that fits in its commit never waits in the table.
+            if (code == CHUNK_DATA_TRANSACTION) {
+                err = e->addChunkSessionLocked(key, session);
+                if (err != NO_ERROR) {
+                    delete session;
+                    return err;
+                }
+            }
+            if (total > e->mMaxChunkedSize) {
+                session->error = BAD_VALUE;
+            } else {
+                session->error = session->data.setDataCapacity(total);
+            }
+        } else if (index >= 0) {
+            session = e->mChunkSessions.valueAt(index);
+            session->lastActive = systemTime(SYSTEM_TIME_MONOTONIC);
+        } else {
+            return NAME_NOT_FOUND;
+        }
+
+        if (session->error == NO_ERROR) {
+            if (txCode != session->code || txFlags != session->flags ||
+                    total != session->total || offset != session->data.dataSize() ||
+                    len > total - offset) {
+                session->error = BAD_VALUE;
+            } else {
+                session->error = session->data.writeUnpadded(bytes, len);
+            }
+        }
+
+        // Data pieces after the first are oneway; the client finds errors
+        // through progress queries or the commit.
+        if (code == CHUNK_DATA_TRANSACTION) return session->error;
+
+        e->mChunkSessions.removeItem(key);
+    }
+
+    err = session->error;
+    if (err == NO_ERROR && session->data.dataSize() != session->total) {
+        err = BAD_VALUE;
+    }
+    if (err != NO_ERROR) {
+        delete session;
+        return err;
+    }
+
+    Parcel out;
+    Parcel& request = session->data;
+    Parcel& response = session->reply;
+    status_t replyErr = NO_ERROR;
+    bool replied = false;
+    auto keepReply = [&](Parcel& replyParcel) {
+        if (replied) return;
+        replied = true;
+        if (replyParcel.objectsCount() != 0) {
+            replyErr = BAD_TYPE;
+            return;
+        }
+        replyErr = response.writeUnpadded(replyParcel.data(), replyParcel.dataSize());
+    };
+
+    request.setDataPosition(0);
+    err = onTransact(session->code, request, &out, session->flags, keepReply);
+    request.freeData();
+    if (err == NO_ERROR && !replied) keepReply(out);
+    if (err == NO_ERROR) err = replyErr;
+    if (err != NO_ERROR || (session->flags & FLAG_ONEWAY) != 0) {
+        delete session;
+        return err;
+    }
+
+    const size_t size = response.dataSize();
+    const size_t len0 = std::min(size, kChunkSize);
+    if ((err = reply->writeUint64(size)) != NO_ERROR ||
+            (err = reply->writeUint32(len0)) != NO_ERROR ||
+            (err = reply->write(response.data(), len0)) != NO_ERROR ||
+            len0 == size) {
+        delete session;
+        return err;
+    }
+
+    // The rest of the reply is read back piece by piece. The session held a
+    // place in the table until the commit, so it goes back without the
+    // limits; otherwise the call would have run with its reply lost.
+    AutoMutex _l(e->mLock);
+    session->lastActive = systemTime(SYSTEM_TIME_MONOTONIC);
+    e->mChunkSessions.add(key, session);
+    return NO_ERROR;
+}
+
 BHwBinder::Extras* BHwBinder::getOrCreateExtras()
 {
     Extras* e = mExtras.load(std::memory_order_acquire);
@@ -20,9 +20,15 @@
 #include <hwbinder/BpHwBinder.h>
 
 #include <hwbinder/IPCThreadState.h>
+#include <hwbinder/Static.h>
 #include <utils/Log.h>
+#include <utils/Timers.h>
 
 #include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 
 //#undef ALOGV
 //#define ALOGV(...) fprintf(stderr, __VA_ARGS__)
@@ -95,6 +101,13 @@ BpHwBinder::BpHwBinder(int32_t handle)
 {
     ALOGV("Creating BpHwBinder %p handle %d\n", this, mHandle);
 
+    // The generation is kept with the attached objects, so the layout of
+    // the proxy stays as it was; generation 0 is the absence of an entry.
+    const uint32_t generation = gProcessGeneration.load(std::memory_order_acquire);
+    if (generation != 0) {
+        mObjects.attach(&gProcessGeneration, (void*)(uintptr_t)generation, nullptr, nullptr);
+    }
+
     extendObjectLifetime(OBJECT_LIFETIME_WEAK);
     IPCThreadState::self()->incWeakHandle(handle, this);
 }
@@ -103,6 +116,7 @@ status_t BpHwBinder::transact(
     uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags, TransactCallback /*callback*/)
 {
     // Once a binder has died, it will never come back to life.
+    if (mAlive && isStale()) mAlive = 0;
     if (mAlive) {
         status_t status = IPCThreadState::self()->transact(
             mHandle, code, data, reply, flags);
@@ -113,6 +127,169 @@ status_t BpHwBinder::transact(
     return DEAD_OBJECT;
 }
 
+// Pieces of a chunked request. All but the first and the last are sent
+// oneway, so writing the next one overlaps with the driver delivering the
+// previous one. At most kChunkWindow of them are left unacknowledged, which keeps
+// them well within the receiver's asynchronous buffer space.
+static const size_t kChunkSize = 64 * 1024;
+static const size_t kChunkWindow = 4;
+// Bounds the wait between progress queries while the receiver catches up.
+static const useconds_t kChunkMaxPollUs = 1000;
+// How long the receiver may make no progress before the transfer fails.
+static const nsecs_t kChunkStallTimeout = seconds_to_nanoseconds(5);
+
+static std::atomic<uint32_t> gNextChunkSession(0);
+
+// Names a transfer in every piece. The driver doesn't report the pid of
+// oneway callers, so the receiver can't tell clients apart by that; this
+// process's pid in the top half keeps tokens of different clients apart.
+static uint64_t newChunkToken()
+{
+    return ((uint64_t)(uint32_t)getpid() << 32) |
+            gNextChunkSession.fetch_add(1, std::memory_order_relaxed);
+}
+
+static status_t writeChunk(Parcel* chunk, uint64_t token, uint32_t code, uint32_t flags,
+        size_t total, size_t offset, const uint8_t* bytes, size_t len)
+{
+    status_t err;
+    if ((err = chunk->writeUint64(token)) != NO_ERROR ||
+            (err = chunk->writeUint32(code)) != NO_ERROR ||
+            (err = chunk->writeUint32(flags)) != NO_ERROR ||
+            (err = chunk->writeUint64(total)) != NO_ERROR ||
+            (err = chunk->writeUint64(offset)) != NO_ERROR ||
+            (err = chunk->writeUint32(len)) != NO_ERROR) {
+        return err;
+    }
+    return chunk->write(bytes, len);
+}
+
+status_t BpHwBinder::transactChunked(
+    uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags)
+{
+    if (data.objectsCount() != 0) return BAD_TYPE;
+
+    const uint64_t token = newChunkToken();
+    const uint8_t* bytes = data.data();
+    const size_t total = data.dataSize();
+    size_t offset = 0;
+    size_t acked = 0;
+    status_t err;
+
+    while (total - offset > kChunkSize) {
+        Parcel chunk;
+        err = writeChunk(&chunk, token, code, flags, total, offset, bytes + offset, kChunkSize);
+        if (err != NO_ERROR) return err;
+        if (offset == 0) {
+            // Synchronous, so the session exists before progress is asked for.
+            Parcel ignored;
+            err = transact(CHUNK_DATA_TRANSACTION, chunk, &ignored, 0);
+            acked = kChunkSize;
+        } else {
+            err = transact(CHUNK_DATA_TRANSACTION, chunk, nullptr, FLAG_ONEWAY);
+        }
+        if (err != NO_ERROR) return err;
+        offset += kChunkSize;
+
+        if (offset - acked >= kChunkWindow * kChunkSize) {
+            // Keep half the window in flight while waiting.
+            err = waitForChunks(token, offset - kChunkWindow / 2 * kChunkSize, &acked);
+            if (err != NO_ERROR) return err;
+        }
+    }
+
+    // The commit is a separate transaction, which the driver may deliver
+    // before queued oneway pieces, so wait until they have all arrived.
+    if (offset > acked) {
+        err = waitForChunks(token, offset, &acked);
+        if (err != NO_ERROR) return err;
+    }
+
+    Parcel commit;
+    err = writeChunk(&commit, token, code, flags, total, offset, bytes + offset, total - offset);
+    if (err != NO_ERROR) return err;
+    if ((flags & FLAG_ONEWAY) != 0) {
+        return transact(CHUNK_COMMIT_TRANSACTION, commit, nullptr, FLAG_ONEWAY);
+    }
+
+    Parcel first;
+    err = transact(CHUNK_COMMIT_TRANSACTION, commit, &first, 0);
+    if (err != NO_ERROR) return err;
+    return readChunkedReply(token, first, reply);
+}
+
+status_t BpHwBinder::waitForChunks(uint64_t token, size_t target, size_t* received)
+{
+    useconds_t delayUs = 0;
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + kChunkStallTimeout;
+    for (;;) {
+        Parcel query, progress;
+        status_t err = query.writeUint64(token);
+        if (err == NO_ERROR) err = transact(CHUNK_PROGRESS_TRANSACTION, query, &progress, 0);
+        uint64_t count;
+        if (err == NO_ERROR) err = progress.readUint64(&count);
+        if (err != NO_ERROR) return err;
+
+        if (count >= target) {
+            *received = count;
+            return NO_ERROR;
+        }
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (count > *received) {
+            *received = count;
+            deadline = now + kChunkStallTimeout;
+        } else if (now >= deadline) {
+            ALOGE("Chunked transfer stalled at %zu of %zu bytes", (size_t)count, target);
+            return TIMED_OUT;
+        }
+
+        // The receiver is still working through the queued pieces.
+        delayUs = delayUs == 0 ? 50 : std::min(delayUs * 2, kChunkMaxPollUs);
+        usleep(delayUs);
+    }
+}
+
+status_t BpHwBinder::readChunkedReply(uint64_t token, const Parcel& first, Parcel* reply)
+{
+    uint64_t total;
+    uint32_t len;
+    status_t err;
+    if ((err = first.readUint64(&total)) != NO_ERROR ||
+            (err = first.readUint32(&len)) != NO_ERROR) {
+        return err;
+    }
+    const void* bytes = first.readInplace(len);
+    if (bytes == nullptr || len > total) return BAD_VALUE;
+
+    if (reply != nullptr) {
+        reply->freeData();
+        err = reply->setDataCapacity(total);
+        if (err == NO_ERROR) err = reply->writeUnpadded(bytes, len);
+        if (err != NO_ERROR) return err;
+    }
+
+    // Read the rest even without a reply parcel, which lets the remote side
+    // release it.
+    for (size_t offset = len; offset < total; offset += len) {
+        Parcel query, piece;
+        if ((err = query.writeUint64(token)) != NO_ERROR ||
+                (err = query.writeUint64(offset)) != NO_ERROR ||
+                (err = transact(CHUNK_READ_TRANSACTION, query, &piece, 0)) != NO_ERROR ||
+                (err = piece.readUint32(&len)) != NO_ERROR) {
+            return err;
+        }
+        bytes = piece.readInplace(len);
+        if (bytes == nullptr || len == 0 || len > total - offset) return BAD_VALUE;
+        if (reply != nullptr) {
+            err = reply->writeUnpadded(bytes, len);
+            if (err != NO_ERROR) return err;
+        }
+    }
+
+    if (reply != nullptr) reply->setDataPosition(0);
+    return NO_ERROR;
+}
+
 status_t BpHwBinder::linkToDeath(
     const sp<DeathRecipient>& recipient, void* cookie, uint32_t flags)
 {
@@ -127,7 +304,7 @@ status_t BpHwBinder::linkToDeath(
     {
         AutoMutex _l(mLock);
 
-        if (!mObitsSent) {
+        if (!mObitsSent && !isStaleLocked()) {
             if (!mObituaries) {
                 mObituaries = new Vector<Obituary>;
                 if (!mObituaries) {
@@ -153,7 +330,7 @@ status_t BpHwBinder::unlinkToDeath(
 {
     AutoMutex _l(mLock);
 
-    if (mObitsSent) {
+    if (mObitsSent || isStaleLocked()) {
         return DEAD_OBJECT;
     }
 
@@ -219,9 +396,26 @@ void BpHwBinder::sendObituary()
 // -1 in case of failure.
 ssize_t BpHwBinder::getNodeStrongRefCount()
 {
+    if (isStale()) return -1;
     return ProcessState::self()->getStrongRefCountForNodeByHandle(mHandle);
 }
 
+// Until the first reinitAfterFork() no proxy can be stale, so only a
+// forked child pays for taking the lock.
+bool BpHwBinder::isStale() const
+{
+    if (gProcessGeneration.load(std::memory_order_acquire) == 0) return false;
+    AutoMutex _l(mLock);
+    return isStaleLocked();
+}
+
+bool BpHwBinder::isStaleLocked() const
+{
+    const uint32_t current = gProcessGeneration.load(std::memory_order_acquire);
+    if (current == 0) return false;
+    return (uintptr_t)mObjects.find(&gProcessGeneration) != current;
+}
+
 void BpHwBinder::reportOneDeath(const Obituary& obit)
 {
     sp<DeathRecipient> recipient = obit.recipient.promote();
@@ -262,7 +456,9 @@ BpHwBinder::~BpHwBinder()
 {
     ALOGV("Destroying BpHwBinder %p handle %d\n", this, mHandle);
 
-    IPCThreadState* ipc = IPCThreadState::self();
+    // A stale handle may have been reused by the new connection, so its
+    // references must not be released there.
+    IPCThreadState* ipc = isStale() ? nullptr : IPCThreadState::self();
 
     mLock.lock();
     Vector<Obituary>* obits = mObituaries;
@@ -288,7 +484,7 @@ BpHwBinder::~BpHwBinder()
 void BpHwBinder::onFirstRef()
 {
     ALOGV("onFirstRef BpHwBinder %p handle %d\n", this, mHandle);
-    IPCThreadState* ipc = IPCThreadState::self();
+    IPCThreadState* ipc = isStale() ? nullptr : IPCThreadState::self();
     if (ipc) ipc->incStrongHandle(mHandle, this);
 }
 
@@ -298,7 +494,7 @@ void BpHwBinder::onLastStrongRef(const void* /*id*/)
     IF_ALOGV() {
         printRefs();
     }
-    IPCThreadState* ipc = IPCThreadState::self();
+    IPCThreadState* ipc = isStale() ? nullptr : IPCThreadState::self();
     if (ipc) {
         ipc->decStrongHandle(mHandle);
         ipc->flushCommands();
@@ -308,7 +504,7 @@ void BpHwBinder::onLastStrongRef(const void* /*id*/)
 bool BpHwBinder::onIncStrongAttempted(uint32_t /*flags*/, const void* /*id*/)
 {
     ALOGV("onIncStrongAttempted BpHwBinder %p handle %d\n", this, mHandle);
-    IPCThreadState* ipc = IPCThreadState::self();
+    IPCThreadState* ipc = isStale() ? nullptr : IPCThreadState::self();
     return ipc ? ipc->attemptIncStrongHandle(mHandle) == NO_ERROR : false;
 }
 
@@ -19,24 +19,23 @@
 #include <hwbinder/BufferedTextOutput.h>
 #include <hwbinder/Debug.h>
 
-#include <cutils/atomic.h>
 #include <cutils/threads.h>
 #include <utils/Log.h>
-#include <utils/RefBase.h>
-#include <utils/Vector.h>
-
-#include <hwbinder/Static.h>
 
+#include <atomic>
+#include <new>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 // ---------------------------------------------------------------------------
 
 namespace android {
 namespace hardware {
 
-struct BufferedTextOutput::BufferState : public RefBase
+struct BufferedTextOutput::BufferState
 {
     explicit BufferState(int32_t _seq)
         : seq(_seq)
@@ -87,12 +86,22 @@ struct BufferedTextOutput::BufferState : public RefBase
     int32_t bundle;
 };
 
+// Every MULTITHREADED output claims one slot, which indexes its buffer in
+// each thread's ThreadState. Slots hold the owner's sequence number, or 0
+// when free, and are claimed with a CAS so no lock is needed. Outputs that
+// don't get a slot fall back to the shared, locked buffer.
+static constexpr int32_t kMaxBufferSlots = 32;
+
+static std::atomic<int32_t> gBufferSlots[kMaxBufferSlots];
+
 struct BufferedTextOutput::ThreadState
 {
-    Vector<sp<BufferedTextOutput::BufferState> > states;
-};
+    ~ThreadState() {
+        for (BufferState* bs : states) delete bs;
+    }
 
-static pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+    BufferState* states[kMaxBufferSlots] = {};
+};
 
 static thread_store_t   tls;
 
@@ -110,60 +119,418 @@ void BufferedTextOutput::threadDestructor(void *st)
     delete ((ThreadState*)st);
 }
 
-static volatile int32_t gSequence = 0;
+// Sequence numbers start at 1, since 0 marks a free slot.
+static std::atomic<int32_t> gSequence(0);
+
+static int32_t allocBufferIndex(int32_t seq)
+{
+    for (int32_t i = 0; i < kMaxBufferSlots; i++) {
+        int32_t expected = 0;
+        if (gBufferSlots[i].compare_exchange_strong(expected, seq)) {
+            return i;
+        }
+    }
+    ALOGW("Out of per-thread text buffer slots; output %d will be serialized", seq);
+    return -1;
+}
+
+static void freeBufferIndex(int32_t idx)
+{
+    if (idx >= 0) gBufferSlots[idx].store(0);
+}
 
-static volatile int32_t gFreeBufferIndex = -1;
+// ---------------------------------------------------------------------------
 
-static int32_t allocBufferIndex()
+// Completed lines of an ASYNC output. Printing threads push copies of their
+// lines into a bounded lock-free ring (Vyukov's MPMC design, used here with
+// a single consumer); a background thread pops them and hands them to
+// writeLines() in batches. The lock and condition are only used to park the
+// background thread while the ring is empty.
+//
+// A forked child has no background thread, so every live state is reset in
+// the child: lines queued before the fork are left to the parent, and the
+// thread is started again on the next print.
+struct BufferedTextOutput::AsyncState
 {
-    int32_t res = -1;
+    static constexpr size_t kCapacity = 1024;       // must be a power of two
+    static constexpr size_t kMaxBatch = 64;         // iovecs per writeLines()
+    static constexpr long kIdleWaitNs = 100000000;  // bounds a missed wakeup
+
+    enum {
+        NOT_STARTED,
+        RUNNING,
+        STOPPING,   // stop() is waiting for the thread to exit
+        STOPPED
+    };
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        char* data;
+        size_t len;
+    };
+
+    AsyncState(BufferedTextOutput* _owner, bool _block)
+        : owner(_owner)
+        , block(_block)
+        , enqueuePos(0)
+        , dequeuePos(0)
+        , dropped(0)
+        , sleeping(false)
+        , state(NOT_STARTED) {
+        for (size_t i = 0; i < kCapacity; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&cond, nullptr);
+        link();
+    }
 
-    pthread_mutex_lock(&gMutex);
+    ~AsyncState() {
+        LOG_ALWAYS_FATAL_IF(state.load() == RUNNING,
+            "BufferedTextOutput destroyed without calling stopAsync()");
+        unlink();
+        char* data;
+        size_t len;
+        while (pop(&data, &len)) free(data);
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
 
-    if (gFreeBufferIndex >= 0) {
-        res = gFreeBufferIndex;
-        gFreeBufferIndex = gTextBuffers[res];
-        gTextBuffers.editItemAt(res) = -1;
+    void link() {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, [] {
+            pthread_atfork(lockList, unlockList, afterForkChild);
+        });
+        pthread_mutex_lock(&sListLock);
+        prev = nullptr;
+        next = sList;
+        if (next != nullptr) next->prev = this;
+        sList = this;
+        pthread_mutex_unlock(&sListLock);
+    }
 
-    } else {
-        res = gTextBuffers.size();
-        gTextBuffers.add(-1);
+    void unlink() {
+        pthread_mutex_lock(&sListLock);
+        if (prev != nullptr) prev->next = next;
+        else sList = next;
+        if (next != nullptr) next->prev = prev;
+        pthread_mutex_unlock(&sListLock);
     }
 
-    pthread_mutex_unlock(&gMutex);
+    static void lockList() { pthread_mutex_lock(&sListLock); }
+    static void unlockList() { pthread_mutex_unlock(&sListLock); }
 
-    return res;
-}
+    static void afterForkChild() {
+        for (AsyncState* s = sList; s != nullptr; s = s->next) s->resetInChild();
+        unlockList();
+    }
 
-static void freeBufferIndex(int32_t idx)
-{
-    pthread_mutex_lock(&gMutex);
-    gTextBuffers.editItemAt(idx) = gFreeBufferIndex;
-    gFreeBufferIndex = idx;
-    pthread_mutex_unlock(&gMutex);
-}
+    // The only thread left is the one that forked, so nothing else touches
+    // the ring. The lock may have been held by a thread that is gone.
+    void resetInChild() {
+        const size_t end = enqueuePos.load(std::memory_order_relaxed);
+        for (size_t pos = dequeuePos; pos != end; pos++) {
+            Cell* cell = &cells[pos & (kCapacity - 1)];
+            // A push that was still in progress never completes here.
+            if (cell->seq.load(std::memory_order_relaxed) == pos + 1) free(cell->data);
+        }
+        for (size_t i = 0; i < kCapacity; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos.store(0, std::memory_order_relaxed);
+        dequeuePos = 0;
+        dropped.store(0, std::memory_order_relaxed);
+        sleeping.store(false, std::memory_order_relaxed);
+        if (state.load() == RUNNING) state.store(NOT_STARTED);
+        if (state.load() == STOPPING) state.store(STOPPED);
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&cond, nullptr);
+        // The background thread may have been in writeLines().
+        if (owner->mWriteLock.tryLock() == NO_ERROR) {
+            owner->mWriteLock.unlock();
+        } else {
+            new (&owner->mWriteLock) Mutex;
+        }
+    }
+
+    bool push(char* data, size_t len) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell* cell = &cells[pos & (kCapacity - 1)];
+            const size_t seq = cell->seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed)) {
+                    cell->data = data;
+                    cell->len = len;
+                    // seq_cst, paired with sleeping in wake() and run().
+                    cell->seq.store(pos + 1, std::memory_order_seq_cst);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Only called from the background thread, or once it has stopped.
+    bool pop(char** data, size_t* len) {
+        if (empty()) return false;
+        Cell* cell = &cells[dequeuePos & (kCapacity - 1)];
+        *data = cell->data;
+        *len = cell->len;
+        cell->seq.store(dequeuePos + kCapacity, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    bool empty() const {
+        const Cell* cell = &cells[dequeuePos & (kCapacity - 1)];
+        const size_t seq = cell->seq.load(std::memory_order_seq_cst);
+        return (intptr_t)seq - (intptr_t)(dequeuePos + 1) < 0;
+    }
+
+    void wake() {
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            pthread_mutex_lock(&lock);
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    bool ensureStarted() {
+        if (state.load(std::memory_order_acquire) == RUNNING) return true;
+
+        pthread_mutex_lock(&lock);
+        if (state.load() == NOT_STARTED) {
+            if (pthread_create(&thread, nullptr, threadMain, this) == 0) {
+                pthread_setname_np(thread, "hwbinder:text");
+                state.store(RUNNING, std::memory_order_release);
+            } else {
+                ALOGW("Unable to start text output thread, writing synchronously");
+                state.store(STOPPED);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+        return state.load(std::memory_order_acquire) == RUNNING;
+    }
+
+    status_t enqueue(const struct iovec& vec) {
+        if (!ensureStarted()) return owner->doWriteLines(vec, 1);
+
+        char* data = (char*)malloc(vec.iov_len);
+        if (data == nullptr) return NO_MEMORY;
+        memcpy(data, vec.iov_base, vec.iov_len);
+
+        while (!push(data, vec.iov_len)) {
+            if (!block || state.load() != RUNNING) {
+                free(data);
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return NO_ERROR;
+            }
+            wake();
+            sched_yield();
+        }
+        // stop() may have done its final drain between ensureStarted() and
+        // the push; the line is then written here. Both the push and the
+        // load are seq_cst, so either this sees STOPPED or the final drain
+        // sees the line.
+        const int s = state.load();
+        if (s == STOPPED) {
+            pthread_mutex_lock(&lock);
+            drainLocked();
+            pthread_mutex_unlock(&lock);
+        } else if (s == RUNNING) {
+            wake();
+        }
+        return NO_ERROR;
+    }
+
+    void run() {
+        struct iovec vecs[kMaxBatch];
+        for (;;) {
+            size_t n = 0;
+            char* data;
+            size_t len;
+            while (n < kMaxBatch && pop(&data, &len)) {
+                vecs[n].iov_base = data;
+                vecs[n].iov_len = len;
+                n++;
+            }
+
+            const uint32_t lost = dropped.exchange(0, std::memory_order_relaxed);
+            if (lost > 0) {
+                char note[64];
+                struct iovec vec;
+                vec.iov_base = note;
+                vec.iov_len = snprintf(note, sizeof(note),
+                        "<%u lines dropped, text output queue full>\n", lost);
+                owner->doWriteLines(vec, 1);
+            }
+
+            if (n > 0) {
+                owner->doWriteLines(vecs[0], n);
+                for (size_t i = 0; i < n; i++) free(vecs[i].iov_base);
+                continue;
+            }
+
+            pthread_mutex_lock(&lock);
+            if (state.load() != RUNNING) {
+                pthread_mutex_unlock(&lock);
+                return;
+            }
+            sleeping.store(true, std::memory_order_seq_cst);
+            if (empty()) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += kIdleWaitNs;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&cond, &lock, &ts);
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    void stop() {
+        pthread_mutex_lock(&lock);
+        const bool running = state.load() == RUNNING;
+        if (running) {
+            state.store(STOPPING);
+        } else if (state.load() == NOT_STARTED) {
+            state.store(STOPPED);
+        }
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        if (!running) return;
+
+        pthread_join(thread, nullptr);
+
+        // Anything pushed while the thread was exiting.
+        pthread_mutex_lock(&lock);
+        state.store(STOPPED);
+        drainLocked();
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Writes out what is left in the ring once the thread is gone. Called
+    // with the lock held, which keeps to one consumer between stop() and
+    // pushes that land after it.
+    void drainLocked() {
+        char* data;
+        size_t len;
+        while (pop(&data, &len)) {
+            struct iovec vec;
+            vec.iov_base = data;
+            vec.iov_len = len;
+            owner->doWriteLines(vec, 1);
+            free(data);
+        }
+    }
+
+    static void* threadMain(void* cookie) {
+        static_cast<AsyncState*>(cookie)->run();
+        return nullptr;
+    }
+
+    BufferedTextOutput* const owner;
+    const bool block;
+    Cell cells[kCapacity];
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos;
+    std::atomic<uint32_t> dropped;
+    std::atomic<bool> sleeping;
+    std::atomic<int> state;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    AsyncState* prev;
+    AsyncState* next;
+
+    static pthread_mutex_t sListLock;
+    static AsyncState* sList;
+};
+
+pthread_mutex_t BufferedTextOutput::AsyncState::sListLock = PTHREAD_MUTEX_INITIALIZER;
+BufferedTextOutput::AsyncState* BufferedTextOutput::AsyncState::sList = nullptr;
 
 // ---------------------------------------------------------------------------
 
 BufferedTextOutput::BufferedTextOutput(uint32_t flags)
     : mFlags(flags)
-    , mSeq(android_atomic_inc(&gSequence))
-    , mIndex(allocBufferIndex())
+    , mSeq(gSequence.fetch_add(1) + 1)
+    , mIndex((flags&MULTITHREADED) != 0 ? allocBufferIndex(mSeq) : -1)
+    , mGlobalState(new BufferState(mSeq))
+    , mAsync((flags&ASYNC) != 0
+            ? new AsyncState(this, (flags&ASYNC_BLOCK_WHEN_FULL) != 0) : nullptr)
 {
-    mGlobalState = new BufferState(mSeq);
-    if (mGlobalState) mGlobalState->incStrong(this);
 }
 
 BufferedTextOutput::~BufferedTextOutput()
 {
-    if (mGlobalState) mGlobalState->decStrong(this);
+    delete mAsync;
+    delete mGlobalState;
     freeBufferIndex(mIndex);
 }
 
+void BufferedTextOutput::stopAsync()
+{
+    if (mAsync != nullptr) mAsync->stop();
+}
+
 status_t BufferedTextOutput::print(const char* txt, size_t len)
 {
+    BufferState* b = getThreadBuffer();
+    if (b != nullptr) return appendLines(b, txt, len);
+
+    AutoMutex _l(mLock);
+    return appendLines(mGlobalState, txt, len);
+}
+
+void BufferedTextOutput::moveIndent(int delta)
+{
+    BufferState* b = getThreadBuffer();
+    if (b != nullptr) {
+        doMoveIndent(b, delta);
+        return;
+    }
+
+    AutoMutex _l(mLock);
+    doMoveIndent(mGlobalState, delta);
+}
+
+void BufferedTextOutput::pushBundle()
+{
+    BufferState* b = getThreadBuffer();
+    if (b != nullptr) {
+        b->bundle++;
+        return;
+    }
+
+    AutoMutex _l(mLock);
+    mGlobalState->bundle++;
+}
+
+void BufferedTextOutput::popBundle()
+{
+    BufferState* b = getThreadBuffer();
+    if (b != nullptr) {
+        doPopBundle(b);
+        return;
+    }
+
     AutoMutex _l(mLock);
-    BufferState* b = getBuffer();
+    doPopBundle(mGlobalState);
+}
+
+status_t BufferedTextOutput::appendLines(BufferState* b, const char* txt, size_t len)
+{
     const char* const end = txt+len;
     status_t err;
 
@@ -188,7 +555,7 @@ status_t BufferedTextOutput::print(const char* txt, size_t len)
                 // them out without going through the buffer.
 
                 // Slurp up all of the lines.
-                const char* lastLine = txt+1;
+                const char* lastLine = txt;
                 while (txt < end) {
                     if (*txt++ == '\n') lastLine = txt;
                 }
@@ -196,7 +563,7 @@ status_t BufferedTextOutput::print(const char* txt, size_t len)
                 vec.iov_base = (void*)first;
                 vec.iov_len = lastLine-first;
                 //printf("Writing %d bytes of data!\n", vec.iov_len);
-                writeLines(vec, 1);
+                emitLines(vec);
                 txt = lastLine;
                 continue;
             }
@@ -215,7 +582,7 @@ status_t BufferedTextOutput::print(const char* txt, size_t len)
             vec.iov_base = b->buffer;
             vec.iov_len = b->bufferPos;
             //printf("Writing %d bytes of data!\n", vec.iov_len);
-            writeLines(vec, 1);
+            emitLines(vec);
             b->restart();
         }
     }
@@ -223,25 +590,14 @@ status_t BufferedTextOutput::print(const char* txt, size_t len)
     return NO_ERROR;
 }
 
-void BufferedTextOutput::moveIndent(int delta)
+void BufferedTextOutput::doMoveIndent(BufferState* b, int delta)
 {
-    AutoMutex _l(mLock);
-    BufferState* b = getBuffer();
     b->indent += delta;
     if (b->indent < 0) b->indent = 0;
 }
 
-void BufferedTextOutput::pushBundle()
-{
-    AutoMutex _l(mLock);
-    BufferState* b = getBuffer();
-    b->bundle++;
-}
-
-void BufferedTextOutput::popBundle()
+void BufferedTextOutput::doPopBundle(BufferState* b)
 {
-    AutoMutex _l(mLock);
-    BufferState* b = getBuffer();
     b->bundle--;
     LOG_FATAL_IF(b->bundle < 0,
         "TextOutput::popBundle() called more times than pushBundle()");
@@ -255,28 +611,43 @@ void BufferedTextOutput::popBundle()
             struct iovec vec;
             vec.iov_base = b->buffer;
             vec.iov_len = b->bufferPos;
-            writeLines(vec, 1);
+            emitLines(vec);
             b->restart();
         }
     }
 }
 
-BufferedTextOutput::BufferState* BufferedTextOutput::getBuffer() const
+status_t BufferedTextOutput::emitLines(const struct iovec& vec)
 {
-    if ((mFlags&MULTITHREADED) != 0) {
-        ThreadState* ts = getThreadState();
-        if (ts) {
-            while (ts->states.size() <= (size_t)mIndex) ts->states.add(nullptr);
-            BufferState* bs = ts->states[mIndex].get();
-            if (bs != nullptr && bs->seq == mSeq) return bs;
-
-            ts->states.editItemAt(mIndex) = new BufferState(mIndex);
-            bs = ts->states[mIndex].get();
-            if (bs != nullptr) return bs;
-        }
-    }
+    if (mAsync != nullptr) return mAsync->enqueue(vec);
+    return doWriteLines(vec, 1);
+}
+
+// Printing threads no longer share a lock, so this keeps the subclass's
+// writeLines() calls apart, as they were before.
+status_t BufferedTextOutput::doWriteLines(const struct iovec& vec, size_t N)
+{
+    AutoMutex _l(mWriteLock);
+    return writeLines(vec, N);
+}
 
-    return mGlobalState;
+// Returns this thread's buffer, or nullptr if the shared buffer must be
+// used under mLock instead.
+BufferedTextOutput::BufferState* BufferedTextOutput::getThreadBuffer() const
+{
+    if (mIndex < 0) return nullptr;
+
+    ThreadState* ts = getThreadState();
+    if (ts == nullptr) return nullptr;
+
+    BufferState*& bs = ts->states[mIndex];
+    if (bs == nullptr || bs->seq != mSeq) {
+        // Either first use on this thread, or left over from a destroyed
+        // output that had the same slot.
+        delete bs;
+        bs = new BufferState(mSeq);
+    }
+    return bs;
 }
 
 }; // namespace hardware
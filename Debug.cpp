@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 
 namespace android {
@@ -63,10 +64,53 @@ static inline char makehexdigit(uint32_t val)
     return "0123456789abcdef"[val&0xF];
 }
 
+// Hex digit pairs and printable characters for every byte value, so lines
+// are rendered with table lookups rather than per-nibble arithmetic.
+struct HexTables {
+    constexpr HexTables() : pairs(), ascii() {
+        for (int i = 0; i < 256; i++) {
+            pairs[i][0] = "0123456789abcdef"[i >> 4];
+            pairs[i][1] = "0123456789abcdef"[i & 0xF];
+            ascii[i] = (i >= ' ' && i < 127) ? (char)i : '.';
+        }
+    }
+
+    char pairs[256][2];
+    char ascii[256];
+};
+
+static constexpr HexTables kHexTables;
+
+static inline char* appendhexbyte(uint8_t val, char* out)
+{
+    memcpy(out, kHexTables.pairs[val], 2);
+    return out + 2;
+}
+
+// Same as sprintf(out, "0x%08x: ", (int)offset).
+static inline char* appendhexoffset(size_t offset, char* out)
+{
+    *out++ = '0';
+    *out++ = 'x';
+    for (int32_t shift = 24; shift >= 0; shift -= 8) {
+        out = appendhexbyte((uint8_t)(offset >> shift), out);
+    }
+    *out++ = ':';
+    *out++ = ' ';
+    return out;
+}
+
+static inline char* appendstring(const char* str, char* out)
+{
+    const size_t len = strlen(str);
+    memcpy(out, str, len);
+    return out + len;
+}
+
 static char* appendhexnum(uint32_t val, char* out)
 {
-    for( int32_t i=28; i>=0; i-=4 ) {
-        *out++ = makehexdigit( val>>i );
+    for( int32_t i=24; i>=0; i-=8 ) {
+        out = appendhexbyte( (uint8_t)(val>>i), out );
     }
     *out = 0;
     return out;
@@ -170,7 +214,7 @@ void printHexData(int32_t indent, const void *buf, size_t length,
 
     size_t offset;
 
-    unsigned char *pos = (unsigned char *)buf;
+    const unsigned char *pos = (const unsigned char *)buf;
 
     if (pos == nullptr) {
         if (singleLineBytesCutoff < 0) func(cookie, "\n");
@@ -192,90 +236,106 @@ void printHexData(int32_t indent, const void *buf, size_t length,
         return;
     }
 
-    char buffer[256];
-    static const size_t maxBytesPerLine = (sizeof(buffer)-1-11-4)/(3+1);
+    // Lines are rendered back to back into this buffer, which is handed to
+    // func whenever it may not have room for another line.
+    char batch[4096];
+    // The limit from when each line had to fit in a 256 byte buffer.
+    static const size_t maxBytesPerLine = 60;
+    static const size_t maxAlignment = 256;
 
     if (bytesPerLine > maxBytesPerLine) bytesPerLine = maxBytesPerLine;
+    if (alignment > maxAlignment) alignment = maxAlignment;
+
+    // Every byte takes at most 6 characters (", 0xNN"), and a line may show
+    // up to alignment-1 bytes past bytesPerLine. Leave room for the indent.
+    const size_t maxLineLength = 16 + (bytesPerLine + alignment) * 6
+            + bytesPerLine + strlen(stringForIndent(indent + 1));
+
+    char* out = batch;
+    auto flush = [&]() {
+        if (out == batch) return;
+        *out = 0;
+        func(cookie, batch);
+        out = batch;
+    };
 
     const bool oneLine = (int32_t)length <= singleLineBytesCutoff;
     bool newLine = false;
     if (cStyle) {
         indent++;
-        func(cookie, "{\n");
+        out = appendstring("{\n", out);
         newLine = true;
     } else if (!oneLine) {
-        func(cookie, "\n");
+        out = appendstring("\n", out);
         newLine = true;
     }
 
     for (offset = 0; ; offset += bytesPerLine, pos += bytesPerLine) {
+        if ((size_t)(batch + sizeof(batch) - out) <= maxLineLength) flush();
+
+        if (newLine && indent) out = appendstring(stringForIndent(indent), out);
+
         long remain = length;
 
-        char* c = buffer;
+        char* c = out;
         if (!oneLine && !cStyle) {
-            sprintf(c, "0x%08x: ", (int)offset);
-            c += 12;
+            c = appendhexoffset(offset, c);
         }
 
-        size_t index;
-        size_t word;
+        // Bytes are shown in groups of alignment, each group in reverse
+        // order. The last group may run past bytesPerLine.
+        for (size_t word = 0; word < bytesPerLine; word += alignment) {
 
-        for (word = 0; word < bytesPerLine; ) {
-
-            size_t align_offset = alignment-(alignment?1:0);
+            size_t align_offset = alignment-1;
             if (remain > 0 && (size_t)remain <= align_offset) {
                 align_offset = remain - 1;
             }
-            const size_t startIndex = word+align_offset;
+            const unsigned char* group = pos+word+align_offset;
 
-            for (index = 0; index < alignment || (alignment == 0 && index < bytesPerLine); index++) {
+            if (!cStyle) {
+                if (word > 0) *c++ = ' ';
 
-                if (!cStyle) {
-                    if (index == 0 && word > 0 && alignment > 0) {
-                        *c++ = ' ';
+                if (remain >= (long)alignment) {
+                    for (size_t index = 0; index < alignment; index++) {
+                        c = appendhexbyte(*(group-index), c);
                     }
+                    remain -= alignment;
+                    continue;
+                }
 
+                for (size_t index = 0; index < alignment; index++) {
                     if (remain-- > 0) {
-                        const unsigned char val = *(pos+startIndex-index);
-                        *c++ = makehexdigit(val>>4);
-                        *c++ = makehexdigit(val);
+                        c = appendhexbyte(*(group-index), c);
                     } else if (!oneLine) {
                         *c++ = ' ';
                         *c++ = ' ';
                     }
-                } else {
-                    if (remain > 0) {
-                        if (index == 0 && word > 0) {
-                            *c++ = ',';
-                            *c++ = ' ';
-                        }
-                        if (index == 0) {
-                            *c++ = '0';
-                            *c++ = 'x';
-                        }
-                        const unsigned char val = *(pos+startIndex-index);
-                        *c++ = makehexdigit(val>>4);
-                        *c++ = makehexdigit(val);
-                        remain--;
-                    }
+                }
+            } else if (remain > 0) {
+                if (word > 0) {
+                    *c++ = ',';
+                    *c++ = ' ';
+                }
+                *c++ = '0';
+                *c++ = 'x';
+                for (size_t index = 0; index < alignment && remain > 0; index++) {
+                    c = appendhexbyte(*(group-index), c);
+                    remain--;
                 }
             }
-
-            word += index;
         }
 
         if (!cStyle) {
-            remain = length;
+            const size_t count = length < bytesPerLine ? length : bytesPerLine;
             *c++ = ' ';
             *c++ = '\'';
-            for (index = 0; index < bytesPerLine; index++) {
-
-                if (remain-- > 0) {
-                    const unsigned char val = pos[index];
-                    *c++ = (val >= ' ' && val < 127) ? val : '.';
-                } else if (!oneLine) {
-                    *c++ = ' ';
-                }
+            for (size_t index = 0; index < count; index++) {
+                c[index] = kHexTables.ascii[pos[index]];
+            }
+            c += count;
+            if (!oneLine) {
+                memset(c, ' ', bytesPerLine - count);
+                c += bytesPerLine - count;
             }
 
             *c++ = '\'';
@@ -285,9 +345,7 @@ void printHexData(int32_t indent, const void *buf, size_t length,
             *c++ = '\n';
         }
 
-        if (newLine && indent) func(cookie, stringForIndent(indent));
-        *c = 0;
-        func(cookie, buffer);
+        out = c;
         newLine = true;
 
         if (length <= bytesPerLine) break;
@@ -295,9 +353,11 @@ void printHexData(int32_t indent, const void *buf, size_t length,
     }
 
     if (cStyle) {
-        if (indent > 0) func(cookie, stringForIndent(indent-1));
-        func(cookie, "};");
+        if ((size_t)(batch + sizeof(batch) - out) <= maxLineLength) flush();
+        if (indent > 0) out = appendstring(stringForIndent(indent-1), out);
+        out = appendstring("};", out);
     }
+    flush();
 }
 
 ssize_t getHWBinderKernelReferences(size_t count, uintptr_t* buf) {
@@ -278,6 +278,29 @@ static pthread_mutex_t gTLSMutex = PTHREAD_MUTEX_INITIALIZER;
 static bool gHaveTLS = false;
 static pthread_key_t gTLS = 0;
 static bool gShutdown = false;
+static IPCThreadState::PhaseHook gPhaseHook = nullptr;
+// how long stopProcess(false) waits for the calls in progress
+static const nsecs_t kStopProcessDrainTimeout = seconds_to_nanoseconds(5);
+
+// An atomic increment, so that a resetDriverStats() from another thread is
+// not overwritten by a count that was loaded before it.
+static inline void countDriverStat(std::atomic<uint64_t>& counter)
+{
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Puts the thread in a phase for the life of the scope, then back in the
+// one it was in.
+class IPCThreadState::PhaseScope {
+public:
+    PhaseScope(IPCThreadState* state, Phase phase)
+        : mState(state), mPrevious(state->enterPhase(phase)) {}
+    ~PhaseScope() { mState->enterPhase(mPrevious); }
+
+private:
+    IPCThreadState* const mState;
+    const Phase mPrevious;
+};
 
 IPCThreadState* IPCThreadState::self()
 {
@@ -324,7 +347,8 @@ void IPCThreadState::shutdown()
     gShutdown = true;
 
     if (gHaveTLS) {
-        // XXX Need to wait for all thread pool threads to exit!
+        // Pool threads still running keep their state; call
+        // ProcessState::drainThreadPool() first to have them exit.
         IPCThreadState* st = (IPCThreadState*)pthread_getspecific(gTLS);
         if (st) {
             delete st;
@@ -335,6 +359,19 @@ void IPCThreadState::shutdown()
     }
 }
 
+void IPCThreadState::resetAfterFork()
+{
+    if (gHaveTLS) {
+        // Queued commands and received data were for the parent's
+        // connection, so they are discarded rather than flushed.
+        IPCThreadState* st = (IPCThreadState*)pthread_getspecific(gTLS);
+        if (st) {
+            pthread_setspecific(gTLS, nullptr);
+            delete st;
+        }
+    }
+}
+
 // TODO(b/66905301): remove symbol
 void IPCThreadState::disableBackgroundScheduling(bool /* disable */) {}
 
@@ -458,7 +495,12 @@ status_t IPCThreadState::getAndExecuteCommand()
         }
         pthread_mutex_unlock(&mProcess->mThreadCountLock);
 
+        // Calls this thread makes from a transaction it accepted get
+        // callbacks through executeCommand() directly, so only new
+        // transactions are turned away.
+        mRejectTransactions = mProcess->mDraining;
         result = executeCommand(cmd);
+        mRejectTransactions = false;
 
         pthread_mutex_lock(&mProcess->mThreadCountLock);
         mProcess->mExecutingThreadsCount--;
@@ -495,6 +537,10 @@ status_t IPCThreadState::getAndExecuteCommand()
 void IPCThreadState::processPendingDerefs()
 {
     if (mIn.dataPosition() >= mIn.dataSize()) {
+        size_t pending = mPendingWeakDerefs.size() + mPendingStrongDerefs.size();
+        if (pending > mDriverStats.maxPendingDerefs.load(std::memory_order_relaxed)) {
+            mDriverStats.maxPendingDerefs.store(pending, std::memory_order_relaxed);
+        }
         /*
          * The decWeak()/decStrong() calls may cause a destructor to run,
          * which in turn could have initiated an outgoing transaction,
@@ -549,6 +595,18 @@ void IPCThreadState::processPostWriteDerefs()
 
 void IPCThreadState::joinThreadPool(bool isMain)
 {
+    // Counted under the lock, so that drainThreadPool() either waits for
+    // this thread or this thread sees it draining and stays out.
+    pthread_mutex_lock(&mProcess->mThreadCountLock);
+    const bool draining = mProcess->mDraining;
+    if (!draining) {
+        mProcess->mLooperCount++;
+    }
+    pthread_mutex_unlock(&mProcess->mThreadCountLock);
+    if (draining) {
+        return;
+    }
+
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS JOINING THE THREAD POOL\n", (void*)pthread_self(), getpid());
 
     mOut.writeInt32(isMain ? BC_ENTER_LOOPER : BC_REGISTER_LOOPER);
@@ -571,14 +629,25 @@ void IPCThreadState::joinThreadPool(bool isMain)
         if(result == TIMED_OUT && !isMain) {
             break;
         }
+
+        // drainThreadPool() wakes this thread up to get here.
+        if (mProcess->mDraining) {
+            break;
+        }
     } while (result != -ECONNREFUSED && result != -EBADF);
 
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS LEAVING THE THREAD POOL err=%d\n",
         (void*)pthread_self(), getpid(), result);
 
+    processPendingDerefs();
     mOut.writeInt32(BC_EXIT_LOOPER);
     mIsLooper = false;
     talkWithDriver(false);
+
+    pthread_mutex_lock(&mProcess->mThreadCountLock);
+    mProcess->mLooperCount--;
+    pthread_cond_broadcast(&mProcess->mThreadCountDecrement);
+    pthread_mutex_unlock(&mProcess->mThreadCountLock);
 }
 
 int IPCThreadState::setupPolling(int* fd)
@@ -611,9 +680,14 @@ status_t IPCThreadState::handlePolledCommands()
     return result;
 }
 
-void IPCThreadState::stopProcess(bool /*immediate*/)
+void IPCThreadState::stopProcess(bool immediate)
 {
     //ALOGI("**** STOPPING PROCESS");
+    if (!immediate) {
+        // Let the calls in progress finish before the driver goes away, but
+        // don't let one stuck call keep the process from stopping.
+        mProcess->drainThreadPool(kStopProcessDrainTimeout);
+    }
     flushCommands();
     int fd = mProcess->mDriverFD;
     mProcess->mDriverFD = -1;
@@ -637,7 +711,10 @@ status_t IPCThreadState::transact(int32_t handle,
 
     LOG_ONEWAY(">>>> SEND from pid %d uid %d %s", getpid(), getuid(),
         (flags & TF_ONE_WAY) == 0 ? "READ REPLY" : "ONE WAY");
-    err = writeTransactionData(BC_TRANSACTION_SG, flags, handle, code, data, nullptr);
+    {
+        PhaseScope phase(this, Phase::WRITE);
+        err = writeTransactionData(BC_TRANSACTION_SG, flags, handle, code, data, nullptr);
+    }
 
     if (err != NO_ERROR) {
         if (reply) reply->setError(err);
@@ -777,7 +854,10 @@ IPCThreadState::IPCThreadState()
       mLastTransactionBinderFlags(0),
       mIsLooper(false),
       mIsPollingThread(false),
-      mCallRestriction(mProcess->mCallRestriction) {
+      mRejectTransactions(false),
+      mCallRestriction(mProcess->mCallRestriction),
+      mDriverStats(),
+      mPhase(Phase::NONE) {
     pthread_setspecific(gTLS, this);
     clearCaller();
     mIn.setDataCapacity(256);
@@ -792,6 +872,7 @@ IPCThreadState::~IPCThreadState()
 
 status_t IPCThreadState::sendReply(const Parcel& reply, uint32_t flags)
 {
+    PhaseScope phase(this, Phase::REPLY);
     status_t err;
     status_t statusBuffer;
     err = writeTransactionData(BC_REPLY_SG, flags, -1, 0, reply, &statusBuffer);
@@ -897,6 +978,7 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
         return -EBADF;
     }
 
+    PhaseScope phase(this, Phase::TALK);
     binder_write_read bwr;
     Parcel mOutCopy;
 
@@ -944,6 +1026,7 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
         IF_LOG_COMMANDS() {
             alog << "About to read/write, write size = " << mOut.dataSize() << endl;
         }
+        countDriverStat(mDriverStats.writeReads);
 #if defined(__ANDROID__)
         if (ioctl(mProcess->mDriverFD, BINDER_WRITE_READ, &bwr) >= 0)
             err = NO_ERROR;
@@ -1055,6 +1138,37 @@ void IPCThreadState::addPostCommandTask(const std::function<void(void)>& task) {
     mPostCommandTasks.push_back(task);
 }
 
+IPCThreadState::DriverStats IPCThreadState::getDriverStats() const {
+    DriverStats s;
+    s.writeReads = mDriverStats.writeReads.load(std::memory_order_relaxed);
+    s.increfs = mDriverStats.increfs.load(std::memory_order_relaxed);
+    s.acquires = mDriverStats.acquires.load(std::memory_order_relaxed);
+    s.releases = mDriverStats.releases.load(std::memory_order_relaxed);
+    s.decrefs = mDriverStats.decrefs.load(std::memory_order_relaxed);
+    s.maxPendingDerefs = mDriverStats.maxPendingDerefs.load(std::memory_order_relaxed);
+    return s;
+}
+
+void IPCThreadState::resetDriverStats() {
+    mDriverStats.writeReads.store(0, std::memory_order_relaxed);
+    mDriverStats.increfs.store(0, std::memory_order_relaxed);
+    mDriverStats.acquires.store(0, std::memory_order_relaxed);
+    mDriverStats.releases.store(0, std::memory_order_relaxed);
+    mDriverStats.decrefs.store(0, std::memory_order_relaxed);
+    mDriverStats.maxPendingDerefs.store(0, std::memory_order_relaxed);
+}
+
+void IPCThreadState::setPhaseHook(PhaseHook hook) {
+    gPhaseHook = hook;
+}
+
+IPCThreadState::Phase IPCThreadState::enterPhase(Phase phase) {
+    Phase previous = mPhase;
+    mPhase = phase;
+    if (gPhaseHook != nullptr) gPhaseHook(phase);
+    return previous;
+}
+
 status_t IPCThreadState::executeCommand(int32_t cmd)
 {
     BHwBinder* obj;
@@ -1069,6 +1183,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         break;
 
     case BR_ACQUIRE:
+        countDriverStat(mDriverStats.acquires);
         refs = (RefBase::weakref_type*)mIn.readPointer();
         obj = (BHwBinder*)mIn.readPointer();
         ALOG_ASSERT(refs->refBase() == obj,
@@ -1085,6 +1200,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         break;
 
     case BR_RELEASE:
+        countDriverStat(mDriverStats.releases);
         refs = (RefBase::weakref_type*)mIn.readPointer();
         obj = (BHwBinder*)mIn.readPointer();
         ALOG_ASSERT(refs->refBase() == obj,
@@ -1098,6 +1214,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         break;
 
     case BR_INCREFS:
+        countDriverStat(mDriverStats.increfs);
         refs = (RefBase::weakref_type*)mIn.readPointer();
         obj = (BHwBinder*)mIn.readPointer();
         refs->incWeak(mProcess.get());
@@ -1107,6 +1224,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
         break;
 
     case BR_DECREFS:
+        countDriverStat(mDriverStats.decrefs);
         refs = (RefBase::weakref_type*)mIn.readPointer();
         obj = (BHwBinder*)mIn.readPointer();
         // NOTE: This assertion is not valid, because the object may no
@@ -1203,20 +1321,27 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                 }
             };
 
-            if (tr.target.ptr) {
-                // We only have a weak reference on the target object, so we must first try to
-                // safely acquire a strong reference before doing anything else with it.
-                if (reinterpret_cast<RefBase::weakref_type*>(
-                        tr.target.ptr)->attemptIncStrong(this)) {
-                    error = reinterpret_cast<BHwBinder*>(tr.cookie)->transact(tr.code, buffer,
-                            &reply, tr.flags, reply_callback);
-                    reinterpret_cast<BHwBinder*>(tr.cookie)->decStrong(this);
+            {
+                PhaseScope phase(this, Phase::DISPATCH);
+                if (mRejectTransactions) {
+                    // The pool is draining, see ProcessState::drainThreadPool().
+                    error = DEAD_OBJECT;
+                } else if (tr.target.ptr) {
+                    // We only have a weak reference on the target object, so we must first try to
+                    // safely acquire a strong reference before doing anything else with it.
+                    if (reinterpret_cast<RefBase::weakref_type*>(
+                            tr.target.ptr)->attemptIncStrong(this)) {
+                        error = reinterpret_cast<BHwBinder*>(tr.cookie)->transact(tr.code, buffer,
+                                &reply, tr.flags, reply_callback);
+                        reinterpret_cast<BHwBinder*>(tr.cookie)->decStrong(this);
+                    } else {
+                        error = UNKNOWN_TRANSACTION;
+                    }
+
                 } else {
-                    error = UNKNOWN_TRANSACTION;
+                    error = mContextObject->transact(tr.code, buffer, &reply, tr.flags,
+                                                     reply_callback);
                 }
-
-            } else {
-                error = mContextObject->transact(tr.code, buffer, &reply, tr.flags, reply_callback);
             }
 
             mIPCThreadStateBase->popCurrentState();
@@ -1322,8 +1447,9 @@ void IPCThreadState::freeBuffer(Parcel* parcel, const uint8_t* data,
         alog << "Writing BC_FREE_BUFFER for " << data << endl;
     }
     ALOG_ASSERT(data != nullptr, "Called with NULL data");
-    if (parcel != nullptr) parcel->closeFileDescriptors();
     IPCThreadState* state = self();
+    PhaseScope phase(state, Phase::FREE);
+    if (parcel != nullptr) parcel->closeFileDescriptors();
     state->mOut.writeInt32(BC_FREE_BUFFER);
     state->mOut.writePointer((uintptr_t)data);
 }
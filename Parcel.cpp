@@ -179,13 +179,75 @@ void release_object(const sp<ProcessState>& proc,
     ALOGE("Invalid object type 0x%08x", obj.hdr.type);
 }
 
+// A parcel that owns its objects keeps, in the same allocation as their
+// offsets and after the first |capacity| of them, the proxy of each
+// BINDER_TYPE_HANDLE object it holds a strong reference on. Releasing the
+// object then drops the reference without looking the handle up in
+// ProcessState again. Entries of other objects are unused.
+static const size_t kObjectEntrySize = sizeof(binder_size_t) + sizeof(IBinder*);
+
+static inline IBinder** handle_proxies(binder_size_t* objects, size_t capacity)
+{
+    return reinterpret_cast<IBinder**>(objects + capacity);
+}
+
+static void move_handle_proxies(binder_size_t* objects, size_t size,
+    size_t fromCapacity, size_t toCapacity)
+{
+    if (size == 0 || fromCapacity == toCapacity) return;
+    memmove(handle_proxies(objects, toCapacity), handle_proxies(objects, fromCapacity),
+            size*sizeof(IBinder*));
+}
+
+// Resizes an owned object list to |newCapacity| entries, moving the proxies
+// of its first |size| objects along. Returns nullptr, leaving the list as it
+// was, if it fails.
+static binder_size_t* realloc_objects(binder_size_t* objects, size_t size,
+    size_t oldCapacity, size_t newCapacity)
+{
+    if (newCapacity == 0 || newCapacity > SIZE_MAX / kObjectEntrySize) return nullptr;
+    if (newCapacity < oldCapacity) {
+        move_handle_proxies(objects, size, oldCapacity, newCapacity);
+    }
+    binder_size_t* resized = (binder_size_t*)realloc(objects, newCapacity*kObjectEntrySize);
+    if (resized == nullptr) {
+        if (newCapacity < oldCapacity) {
+            move_handle_proxies(objects, size, newCapacity, oldCapacity);
+        }
+        return nullptr;
+    }
+    if (newCapacity > oldCapacity) {
+        move_handle_proxies(resized, size, oldCapacity, newCapacity);
+    }
+    return resized;
+}
+
+static IBinder* acquire_handle_object(const sp<ProcessState>& proc,
+    const flat_binder_object& obj, const void* who)
+{
+    const sp<IBinder> b = proc->getStrongProxyForHandle(obj.handle);
+    if (b != nullptr) {
+        LOG_REFS("Parcel %p acquiring reference on remote %p", who, b.get());
+        b->incStrong(who);
+    }
+    return b.get();
+}
+
+static void release_handle_object(IBinder* binder, const void* who)
+{
+    if (binder != nullptr) {
+        LOG_REFS("Parcel %p releasing reference on remote %p", who, binder);
+        binder->decStrong(who);
+    }
+}
+
 inline static status_t finish_flatten_binder(
     const sp<IBinder>& /*binder*/, const flat_binder_object& flat, Parcel* out)
 {
     return out->writeObject(flat);
 }
 
-status_t flatten_binder(const sp<ProcessState>& /*proc*/,
+status_t flatten_binder(const sp<ProcessState>& proc,
     const sp<IBinder>& binder, Parcel* out)
 {
     flat_binder_object obj = {};
@@ -205,11 +267,16 @@ status_t flatten_binder(const sp<ProcessState>& /*proc*/,
             obj.cookie = 0;
         } else {
             // Get policy and convert it
-            int policy = local->getMinSchedulingPolicy();
-            int priority = local->getMinSchedulingPriority();
+            int policy;
+            int priority;
+            bool inheritRt;
+            local->getSchedulerPolicy(proc, &policy, &priority, &inheritRt);
 
             obj.flags = priority & FLAT_BINDER_FLAG_PRIORITY_MASK;
-            obj.flags |= FLAT_BINDER_FLAG_ACCEPTS_FDS | FLAT_BINDER_FLAG_INHERIT_RT;
+            obj.flags |= FLAT_BINDER_FLAG_ACCEPTS_FDS;
+            if (inheritRt) {
+                obj.flags |= FLAT_BINDER_FLAG_INHERIT_RT;
+            }
             obj.flags |= (policy & 3) << FLAT_BINDER_FLAG_SCHEDPOLICY_SHIFT;
             if (local->isRequestingSid()) {
                 obj.flags |= FLAT_BINDER_FLAG_TXN_SECURITY_CTX;
@@ -440,6 +507,24 @@ status_t Parcel::setDataCapacity(size_t size)
     return NO_ERROR;
 }
 
+status_t Parcel::reserve(size_t dataBytes, size_t objectsCount)
+{
+    if (dataBytes > SIZE_MAX - mDataPos) return BAD_VALUE;
+    status_t err = setDataCapacity(mDataPos + dataBytes);
+    if (err != NO_ERROR || objectsCount == 0) return err;
+
+    if (objectsCount > SIZE_MAX / kObjectEntrySize - mObjectsSize) return NO_MEMORY;
+    const size_t desired = mObjectsSize + objectsCount;
+    // A parcel that doesn't own its objects copies them on its first write.
+    if (desired <= mObjectsCapacity || mOwner != nullptr) return NO_ERROR;
+
+    binder_size_t* objects = realloc_objects(mObjects, mObjectsSize, mObjectsCapacity, desired);
+    if (objects == nullptr) return NO_MEMORY;
+    mObjects = objects;
+    mObjectsCapacity = desired;
+    return NO_ERROR;
+}
+
 status_t Parcel::setData(const uint8_t* buffer, size_t len)
 {
     if (len > INT32_MAX) {
@@ -739,8 +824,13 @@ restart_write:
             case BINDER_TYPE_WEAK_HANDLE: {
                 const flat_binder_object *fbo = reinterpret_cast<const flat_binder_object*>(hdr);
                 if (fbo->binder != 0) {
+                    if (hdr->type == BINDER_TYPE_HANDLE) {
+                        handle_proxies(mObjects, mObjectsCapacity)[mObjectsSize] =
+                            acquire_handle_object(ProcessState::self(), *fbo, this);
+                    } else {
+                        acquire_binder_object(ProcessState::self(), *fbo, this);
+                    }
                     mObjects[mObjectsSize++] = mDataPos;
-                    acquire_binder_object(ProcessState::self(), *fbo, this);
                 }
                 break;
             }
@@ -779,8 +869,8 @@ restart_write:
     }
     if (!enoughObjects) {
         size_t newSize = ((mObjectsSize+2)*3)/2;
-        if (newSize * sizeof(binder_size_t) < mObjectsSize) return NO_MEMORY;   // overflow
-        binder_size_t* objects = (binder_size_t*)realloc(mObjects, newSize*sizeof(binder_size_t));
+        if (newSize < mObjectsSize) return NO_MEMORY;   // overflow
+        binder_size_t* objects = realloc_objects(mObjects, mObjectsSize, mObjectsCapacity, newSize);
         if (objects == nullptr) return NO_MEMORY;
         mObjects = objects;
         mObjectsCapacity = newSize;
@@ -1914,11 +2004,16 @@ void Parcel::releaseObjects()
     size_t i = mObjectsSize;
     uint8_t* const data = mData;
     binder_size_t* const objects = mObjects;
+    IBinder** const proxies = handle_proxies(mObjects, mObjectsCapacity);
     while (i > 0) {
         i--;
         const flat_binder_object* flat
             = reinterpret_cast<flat_binder_object*>(data+objects[i]);
-        release_object(proc, *flat, this);
+        if (flat->hdr.type == BINDER_TYPE_HANDLE) {
+            release_handle_object(proxies[i], this);
+        } else {
+            release_object(proc, *flat, this);
+        }
     }
 }
 
@@ -1928,11 +2023,17 @@ void Parcel::acquireObjects()
     size_t i = mObjectsSize;
     uint8_t* const data = mData;
     binder_size_t* const objects = mObjects;
+    IBinder** const proxies = handle_proxies(mObjects, mObjectsCapacity);
     while (i > 0) {
         i--;
         const binder_object_header* flat
             = reinterpret_cast<binder_object_header*>(data+objects[i]);
-        acquire_object(proc, *flat, this);
+        if (flat->type == BINDER_TYPE_HANDLE) {
+            proxies[i] = acquire_handle_object(proc,
+                    *reinterpret_cast<const flat_binder_object*>(flat), this);
+        } else {
+            acquire_object(proc, *flat, this);
+        }
     }
 }
 
@@ -2074,28 +2175,32 @@ status_t Parcel::continueWrite(size_t desired)
         binder_size_t* objects = nullptr;
 
         if (objectsSize) {
-            objects = (binder_size_t*)calloc(objectsSize, sizeof(binder_size_t));
+            objects = (binder_size_t*)calloc(objectsSize, kObjectEntrySize);
             if (!objects) {
                 free(data);
 
                 mError = NO_MEMORY;
                 return NO_MEMORY;
             }
+            memcpy(objects, mObjects, objectsSize*sizeof(binder_size_t));
 
             // Little hack to only acquire references on objects
-            // we will be keeping.
+            // we will be keeping, and to keep their proxies in the
+            // new list.
+            binder_size_t* oldObjects = mObjects;
             size_t oldObjectsSize = mObjectsSize;
-            mObjectsSize = objectsSize;
+            size_t oldObjectsCapacity = mObjectsCapacity;
+            mObjects = objects;
+            mObjectsSize = mObjectsCapacity = objectsSize;
             acquireObjects();
+            mObjects = oldObjects;
             mObjectsSize = oldObjectsSize;
+            mObjectsCapacity = oldObjectsCapacity;
         }
 
         if (mData) {
             memcpy(data, mData, mDataSize < desired ? mDataSize : desired);
         }
-        if (objects && mObjects) {
-            memcpy(objects, mObjects, objectsSize*sizeof(binder_size_t));
-        }
         //ALOGI("Freeing data ref of %p (pid=%d)", this, getpid());
         mOwner(this, mData, mDataSize, mObjects, mObjectsSize, mOwnerCookie);
         mOwner = nullptr;
@@ -2126,12 +2231,18 @@ status_t Parcel::continueWrite(size_t desired)
                     // will need to rescan because we may have lopped off the only FDs
                     mFdsKnown = false;
                 }
-                release_object(proc, *flat, this);
+                if (flat->hdr.type == BINDER_TYPE_HANDLE) {
+                    release_handle_object(handle_proxies(mObjects, mObjectsCapacity)[i], this);
+                } else {
+                    release_object(proc, *flat, this);
+                }
             }
+            // Dropping every object keeps the list, as it can't shrink to nothing.
             binder_size_t* objects =
-                (binder_size_t*)realloc(mObjects, objectsSize*sizeof(binder_size_t));
+                realloc_objects(mObjects, objectsSize, mObjectsCapacity, objectsSize);
             if (objects) {
                 mObjects = objects;
+                mObjectsCapacity = objectsSize;
             }
             mObjectsSize = objectsSize;
             mNextObjectHint = 0;
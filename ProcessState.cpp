@@ -19,11 +19,13 @@
 #include <hwbinder/ProcessState.h>
 
 #include <cutils/atomic.h>
+#include <hwbinder/Binder.h>
 #include <hwbinder/BpHwBinder.h>
 #include <hwbinder/IPCThreadState.h>
 #include <hwbinder/binder_kernel.h>
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 #include <utils/threads.h>
 
 #include <private/binder/binder_module.h>
@@ -31,6 +33,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -38,6 +41,9 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include <new>
 
 #define DEFAULT_BINDER_VM_SIZE ((1 * 1024 * 1024) - sysconf(_SC_PAGE_SIZE) * 2)
 #define DEFAULT_MAX_BINDER_THREADS 0
@@ -92,6 +98,57 @@ sp<ProcessState> ProcessState::initWithMmapSize(size_t mmap_size) {
     return gProcess;
 }
 
+sp<ProcessState> ProcessState::reinitAfterFork()
+{
+    // The child is single threaded, so if gProcessMutex is locked, it was
+    // locked by a thread of the parent that will never unlock it here.
+    // Text outputs need nothing: BufferedTextOutput resets itself in every
+    // forked child.
+    if (gProcessMutex.tryLock() == NO_ERROR) {
+        gProcessMutex.unlock();
+    } else {
+        new (&gProcessMutex) Mutex;
+    }
+    Mutex::Autolock _l(gProcessMutex);
+    if (gProcess == nullptr) {
+        return nullptr;
+    }
+
+    sp<ProcessState> old = gProcess;
+
+    // The driver doesn't copy its mapping into the child, so only the fd is
+    // left to close. The old object may outlive this through references
+    // held elsewhere; it can no longer reach the driver.
+    if (old->mDriverFD >= 0) {
+        close(old->mDriverFD);
+        old->mDriverFD = -1;
+    }
+    old->mVMStart = MAP_FAILED;
+
+    // From here on, proxies from the parent are stale and the calling
+    // thread will get a new IPCThreadState bound to the new connection.
+    gProcessGeneration.fetch_add(1, std::memory_order_release);
+    IPCThreadState::resetAfterFork();
+
+    sp<ProcessState> process = new ProcessState(old->mMmapSize);
+    process->mCallRestriction = old->mCallRestriction;
+    process->mDefaultSchedPolicy = old->mDefaultSchedPolicy.load();
+    process->mDefaultInheritRt = old->mDefaultInheritRt.load();
+    if (process->mDriverFD >= 0 && old->mKernelMaxThreads != DEFAULT_MAX_BINDER_THREADS) {
+        size_t kernelMaxThreads = old->mKernelMaxThreads;
+        if (ioctl(process->mDriverFD, BINDER_SET_MAX_THREADS, &kernelMaxThreads) == -1) {
+            ALOGE("Binder ioctl to set max threads failed: %s", strerror(errno));
+        } else {
+            process->mKernelMaxThreads = kernelMaxThreads;
+        }
+    }
+    process->mMaxThreads = old->mMaxThreads;
+    process->mSpawnThreadOnStart = old->mSpawnThreadOnStart;
+
+    gProcess = process;
+    return gProcess;
+}
+
 void ProcessState::setContextObject(const sp<IBinder>& object)
 {
     setContextObject(object, String16("default"));
@@ -155,6 +212,92 @@ void ProcessState::startThreadPool()
     }
 }
 
+status_t ProcessState::drainThreadPool(nsecs_t timeout)
+{
+    const nsecs_t deadline = timeout < 0 ? -1 : systemTime(SYSTEM_TIME_MONOTONIC) + timeout;
+
+    {
+        AutoMutex _l(mLock);
+        pthread_mutex_lock(&mThreadCountLock);
+        mDraining = true;
+        pthread_mutex_unlock(&mThreadCountLock);
+
+        // Stop the driver from asking for more threads.
+        size_t kernelMaxThreads = 0;
+        if (mDriverFD >= 0 && ioctl(mDriverFD, BINDER_SET_MAX_THREADS, &kernelMaxThreads) != -1) {
+            mKernelMaxThreads = 0;
+        }
+    }
+
+    // A binder thread draining the pool can't wait for itself.
+    IPCThreadState* self = IPCThreadState::self();
+    const size_t remaining = self != nullptr && self->mIsLooper ? 1 : 0;
+
+    status_t result = NO_ERROR;
+    pthread_mutex_lock(&mThreadCountLock);
+    while (mLooperCount > remaining) {
+        nsecs_t wait = milliseconds_to_nanoseconds(10);
+        if (deadline >= 0) {
+            nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (left <= 0) {
+                ALOGW("Draining the thread pool timed out, %zu loopers left, %zu executing",
+                      mLooperCount - remaining, mExecutingThreadsCount);
+                result = TIMED_OUT;
+                break;
+            }
+            if (left < wait) wait = left;
+        }
+
+        // Loopers that checked mDraining just before it was set may only
+        // now be going back to the driver, so wake them again until the
+        // count drops.
+        pthread_mutex_unlock(&mThreadCountLock);
+        wakeLoopers();
+        pthread_mutex_lock(&mThreadCountLock);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        nsecs_t until = seconds_to_nanoseconds(ts.tv_sec) + ts.tv_nsec + wait;
+        ts.tv_sec = until / 1000000000;
+        ts.tv_nsec = until % 1000000000;
+        pthread_cond_timedwait(&mThreadCountDecrement, &mThreadCountLock, &ts);
+    }
+    Vector<sp<Thread> > threads;
+    if (result == NO_ERROR) {
+        threads = mPoolThreads;
+        mPoolThreads.clear();
+    }
+    pthread_mutex_unlock(&mThreadCountLock);
+
+    // Every pool thread is out of the loop or never entered it, so these
+    // return as soon as the threads are done. join() on the calling thread
+    // itself returns WOULD_BLOCK.
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+    }
+
+    if (self != nullptr) {
+        self->flushCommands();
+    }
+    return result;
+}
+
+bool ProcessState::isDraining() const
+{
+    return mDraining;
+}
+
+void ProcessState::wakeLoopers()
+{
+    // The driver flushes the process on every close() of its file, which
+    // makes all threads waiting for work return to user space with just a
+    // BR_NOOP. Closing a duplicate leaves mDriverFD usable.
+    int fd = dup(mDriverFD);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
 bool ProcessState::isContextManager(void) const
 {
     return mManagesContexts;
@@ -249,6 +392,30 @@ void ProcessState::setCallRestriction(CallRestriction restriction) {
     mCallRestriction = restriction;
 }
 
+status_t ProcessState::setDefaultSchedulerPolicy(int policy, int priority) {
+    if (!BHwBinder::isValidSchedulerPolicy(policy, priority)) {
+        ALOGE("Invalid default scheduler policy %d priority %d", policy, priority);
+        return BAD_VALUE;
+    }
+    mDefaultSchedPolicy.store(((uint32_t)policy << 16) | (uint16_t)priority,
+                              std::memory_order_relaxed);
+    return NO_ERROR;
+}
+
+void ProcessState::getDefaultSchedulerPolicy(int* policy, int* priority) const {
+    const uint32_t packed = mDefaultSchedPolicy.load(std::memory_order_relaxed);
+    *policy = packed >> 16;
+    *priority = (int16_t)(packed & 0xffff);
+}
+
+void ProcessState::setDefaultInheritRt(bool inheritRt) {
+    mDefaultInheritRt.store(inheritRt, std::memory_order_relaxed);
+}
+
+bool ProcessState::getDefaultInheritRt() const {
+    return mDefaultInheritRt.load(std::memory_order_relaxed);
+}
+
 ProcessState::handle_entry* ProcessState::lookupHandleLocked(int32_t handle)
 {
     const size_t N=mHandleToObject.size();
@@ -266,7 +433,7 @@ sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
 {
     sp<IBinder> result;
 
-    AutoMutex _l(mLock);
+    HandleTableLock _l(this);
 
     handle_entry* e = lookupHandleLocked(handle);
 
@@ -296,7 +463,7 @@ wp<IBinder> ProcessState::getWeakProxyForHandle(int32_t handle)
 {
     wp<IBinder> result;
 
-    AutoMutex _l(mLock);
+    HandleTableLock _l(this);
 
     handle_entry* e = lookupHandleLocked(handle);
 
@@ -325,7 +492,7 @@ wp<IBinder> ProcessState::getWeakProxyForHandle(int32_t handle)
 
 void ProcessState::expungeHandle(int32_t handle, IBinder* binder)
 {
-    AutoMutex _l(mLock);
+    HandleTableLock _l(this);
 
     handle_entry* e = lookupHandleLocked(handle);
 
@@ -335,6 +502,38 @@ void ProcessState::expungeHandle(int32_t handle, IBinder* binder)
     if (e && e->binder == binder) e->binder = nullptr;
 }
 
+void ProcessState::lockHandleTable()
+{
+    if (mLock.tryLock() == NO_ERROR) return;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    mLock.lock();
+    mHandleLockContentions++;
+    mHandleLockWaitNs += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+}
+
+ProcessState::HandleTableStats ProcessState::getHandleTableStats()
+{
+    AutoMutex _l(mLock);
+
+    HandleTableStats stats;
+    stats.entries = mHandleToObject.size();
+    stats.proxies = 0;
+    for (size_t i = 0; i < mHandleToObject.size(); i++) {
+        if (mHandleToObject[i].binder != nullptr) stats.proxies++;
+    }
+    stats.bytes = mHandleToObject.capacity() * sizeof(handle_entry);
+    stats.lockContentions = mHandleLockContentions;
+    stats.lockWaitNs = mHandleLockWaitNs;
+    return stats;
+}
+
+void ProcessState::resetHandleLockStats()
+{
+    AutoMutex _l(mLock);
+    mHandleLockContentions = 0;
+    mHandleLockWaitNs = 0;
+}
+
 String8 ProcessState::makeBinderThreadName() {
     int32_t s = android_atomic_add(1, &mThreadPoolSeq);
     pid_t pid = getpid();
@@ -345,12 +544,26 @@ String8 ProcessState::makeBinderThreadName() {
 
 void ProcessState::spawnPooledThread(bool isMain)
 {
-    if (mThreadPoolStarted) {
-        String8 name = makeBinderThreadName();
-        ALOGV("Spawning new pooled thread, name=%s\n", name.string());
-        sp<Thread> t = new PoolThread(isMain);
-        t->run(name.string());
+    if (!mThreadPoolStarted) return;
+
+    pthread_mutex_lock(&mThreadCountLock);
+    // Checked together with the push, so that drainThreadPool() either
+    // finds the thread in mPoolThreads or stops it from being spawned.
+    if (mDraining) {
+        pthread_mutex_unlock(&mThreadCountLock);
+        return;
     }
+    // Threads that left the pool on their own have nothing to join.
+    for (size_t i = mPoolThreads.size(); i-- > 0;) {
+        if (!mPoolThreads[i]->isRunning()) mPoolThreads.removeAt(i);
+    }
+    sp<Thread> t = new PoolThread(isMain);
+    mPoolThreads.push(t);
+    pthread_mutex_unlock(&mThreadCountLock);
+
+    String8 name = makeBinderThreadName();
+    ALOGV("Spawning new pooled thread, name=%s\n", name.string());
+    t->run(name.string());
 }
 
 status_t ProcessState::setThreadPoolConfiguration(size_t maxThreads, bool callerJoinsPool) {
@@ -382,6 +595,7 @@ status_t ProcessState::setThreadPoolConfiguration(size_t maxThreads, bool caller
     }
 
     mMaxThreads = maxThreads;
+    mKernelMaxThreads = kernelMaxThreads;
     mSpawnThreadOnStart = spawnThreadOnStart;
 
     return NO_ERROR;
@@ -429,7 +643,12 @@ ProcessState::ProcessState(size_t mmap_size)
     , mThreadCountDecrement(PTHREAD_COND_INITIALIZER)
     , mExecutingThreadsCount(0)
     , mMaxThreads(DEFAULT_MAX_BINDER_THREADS)
+    , mKernelMaxThreads(DEFAULT_MAX_BINDER_THREADS)
     , mStarvationStartTimeMs(0)
+    , mLooperCount(0)
+    , mDraining(false)
+    , mHandleLockContentions(0)
+    , mHandleLockWaitNs(0)
     , mManagesContexts(false)
     , mBinderContextCheckFunc(nullptr)
     , mBinderContextUserData(nullptr)
@@ -438,6 +657,8 @@ ProcessState::ProcessState(size_t mmap_size)
     , mThreadPoolSeq(1)
     , mMmapSize(mmap_size)
     , mCallRestriction(CallRestriction::NONE)
+    , mDefaultSchedPolicy((uint32_t)SCHED_NORMAL << 16)
+    , mDefaultInheritRt(true)
 {
     if (mDriverFD >= 0) {
         // mmap the binder, providing a chunk of virtual address space to receive transactions.
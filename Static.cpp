@@ -23,34 +23,65 @@
 #include <hwbinder/IPCThreadState.h>
 #include <utils/Log.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 namespace android {
 namespace hardware {
 
 // ------------ Text output streams
 
-Vector<int32_t> gTextBuffers;
-
 class LogTextOutput : public BufferedTextOutput
 {
 public:
-    LogTextOutput() : BufferedTextOutput(MULTITHREADED) { }
-    virtual ~LogTextOutput() { };
+    LogTextOutput() : BufferedTextOutput(MULTITHREADED | ASYNC) { }
+    virtual ~LogTextOutput() { stopAsync(); };
+
+    // Writes out queued lines. Later lines are written synchronously.
+    void flush() { stopAsync(); }
 
 protected:
     virtual status_t writeLines(const struct iovec& vec, size_t N)
     {
         //android_writevLog(&vec, N);       <-- this is now a no-op
-        if (N != 1) ALOGI("WARNING: writeLines N=%zu\n", N);
-        ALOGI("%.*s", (int)vec.iov_len, (const char*) vec.iov_base);
+        if (N == 1) {
+            ALOGI("%.*s", (int)vec.iov_len, (const char*) vec.iov_base);
+            return NO_ERROR;
+        }
+
+        // A batch from the async queue: join the lines into as few log
+        // entries as fit.
+        const struct iovec* vecs = &vec;
+        char buf[kMaxLogEntry];
+        size_t pos = 0;
+        for (size_t i = 0; i < N; i++) {
+            const size_t len = vecs[i].iov_len;
+            if (pos > 0 && pos + len > sizeof(buf)) {
+                ALOGI("%.*s", (int)pos, buf);
+                pos = 0;
+            }
+            if (len >= sizeof(buf)) {
+                ALOGI("%.*s", (int)len, (const char*) vecs[i].iov_base);
+                continue;
+            }
+            memcpy(buf + pos, vecs[i].iov_base, len);
+            pos += len;
+        }
+        if (pos > 0) ALOGI("%.*s", (int)pos, buf);
         return NO_ERROR;
     }
+
+private:
+    // Stays under the logger's per-entry payload limit.
+    static constexpr size_t kMaxLogEntry = 4000;
 };
 
 class FdTextOutput : public BufferedTextOutput
 {
 public:
-    explicit FdTextOutput(int fd) : BufferedTextOutput(MULTITHREADED), mFD(fd) { }
-    virtual ~FdTextOutput() { };
+    explicit FdTextOutput(int fd, uint32_t flags = MULTITHREADED)
+        : BufferedTextOutput(flags), mFD(fd) { }
+    virtual ~FdTextOutput() { stopAsync(); };
 
 protected:
     virtual status_t writeLines(const struct iovec& vec, size_t N)
@@ -63,9 +94,58 @@ private:
     int mFD;
 };
 
-static LogTextOutput gLogTextOutput;
-static FdTextOutput gStdoutTextOutput(STDOUT_FILENO);
-static FdTextOutput gStderrTextOutput(STDERR_FILENO);
+// The streams are only created on first use, so processes that never print
+// don't construct them (and their buffers) when the library is loaded.
+// They are never destroyed, so they stay usable from other static
+// destructors.
+
+// Binder threads log through alog, so its lines are written from a
+// background thread. aout and aerr stay synchronous to keep their output
+// ordered with other writes to the same fd.
+static void flushLogTextOutput();
+
+static TextOutput& getLogTextOutput()
+{
+    static LogTextOutput* output = [] {
+        // Write out anything still queued when the process exits.
+        atexit(flushLogTextOutput);
+        return new LogTextOutput;
+    }();
+    return *output;
+}
+
+static void flushLogTextOutput()
+{
+    static_cast<LogTextOutput&>(getLogTextOutput()).flush();
+}
+
+static TextOutput& getStdoutTextOutput()
+{
+    static FdTextOutput* output = new FdTextOutput(STDOUT_FILENO);
+    return *output;
+}
+
+static TextOutput& getStderrTextOutput()
+{
+    static FdTextOutput* output = new FdTextOutput(STDERR_FILENO);
+    return *output;
+}
+
+// Stands in for a stream until it is first used. Constructing one doesn't
+// allocate.
+template<TextOutput& (*getOutput)()>
+class LazyTextOutput : public TextOutput
+{
+public:
+    virtual status_t print(const char* txt, size_t len) { return getOutput().print(txt, len); }
+    virtual void moveIndent(int delta) { getOutput().moveIndent(delta); }
+    virtual void pushBundle() { getOutput().pushBundle(); }
+    virtual void popBundle() { getOutput().popBundle(); }
+};
+
+static LazyTextOutput<getLogTextOutput> gLogTextOutput;
+static LazyTextOutput<getStdoutTextOutput> gStdoutTextOutput;
+static LazyTextOutput<getStderrTextOutput> gStderrTextOutput;
 
 TextOutput& alog(gLogTextOutput);
 TextOutput& aout(gStdoutTextOutput);
@@ -75,6 +155,7 @@ TextOutput& aerr(gStderrTextOutput);
 
 Mutex& gProcessMutex = *new Mutex;
 sp<ProcessState> gProcess;
+std::atomic<uint32_t> gProcessGeneration(0);
 
 }   // namespace hardware
 }   // namespace android
@@ -20,7 +20,9 @@
 
 #include <utils/String8.h>
 #include <utils/String16.h>
+#include <utils/Unicode.h>
 
+#include <charconv>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +40,95 @@ TextOutput::~TextOutput() {
 
 // ---------------------------------------------------------------------------
 
+// Large enough for any 64-bit integer in base 10 plus sign, a "0x" prefixed
+// 64-bit pointer, or a %g formatted double.
+static constexpr size_t kNumberBufferSize = 32;
+
+// Strings converted from UTF-16 up to this size are formatted on the stack.
+static constexpr size_t kStringBufferSize = 256;
+
+template<typename T>
+static TextOutput& printInteger(TextOutput& to, T val)
+{
+    char buf[kNumberBufferSize];
+    const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), val);
+    to.print(buf, res.ptr - buf);
+    return to;
+}
+
+// std::to_chars() for floating point is not available in our libc++, so
+// these use snprintf(), which formats into the stack buffer and matches the
+// default ostream precision.
+static TextOutput& printFloat(TextOutput& to, double val)
+{
+    char buf[kNumberBufferSize];
+    const int len = snprintf(buf, sizeof(buf), "%g", val);
+    if (len > 0) to.print(buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1);
+    return to;
+}
+
+TextOutput& operator<<(TextOutput& to, short val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, unsigned short val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, int val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, unsigned int val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, long val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, unsigned long val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, long long val) { return printInteger(to, val); }
+TextOutput& operator<<(TextOutput& to, unsigned long long val) { return printInteger(to, val); }
+
+TextOutput& operator<<(TextOutput& to, float val) { return printFloat(to, val); }
+TextOutput& operator<<(TextOutput& to, double val) { return printFloat(to, val); }
+
+TextOutput& operator<<(TextOutput& to, const void* val)
+{
+    char buf[kNumberBufferSize] = { '0', 'x' };
+    const std::to_chars_result res = std::to_chars(buf + 2, buf + sizeof(buf),
+            reinterpret_cast<uintptr_t>(val), 16);
+    to.print(buf, res.ptr - buf);
+    return to;
+}
+
+TextOutput& operator<<(TextOutput& to, const char* val)
+{
+    if (val != nullptr) to.print(val, strlen(val));
+    return to;
+}
+
+TextOutput& operator<<(TextOutput& to, char* val)
+{
+    return to << const_cast<const char*>(val);
+}
+
+TextOutput& operator<<(TextOutput& to, const std::string& val)
+{
+    to.print(val.data(), val.size());
+    return to;
+}
+
+TextOutput& operator<<(TextOutput& to, const String8& val)
+{
+    to.print(val.string(), val.length());
+    return to;
+}
+
+TextOutput& operator<<(TextOutput& to, const String16& val)
+{
+    const ssize_t len = utf16_to_utf8_length(val.string(), val.size());
+    if (len <= 0) return to;
+
+    if (static_cast<size_t>(len) < kStringBufferSize) {
+        char buf[kStringBufferSize];
+        utf16_to_utf8(val.string(), val.size(), buf, len + 1);
+        to.print(buf, len);
+    } else {
+        const String8 str(val);
+        to.print(str.string(), str.length());
+    }
+    return to;
+}
+
+// ---------------------------------------------------------------------------
+
 static void textOutputPrinter(void* cookie, const char* txt)
 {
     ((TextOutput*)cookie)->print(txt, strlen(txt));
@@ -25,6 +25,8 @@
 namespace android {
 namespace hardware {
 
+class ProcessState;
+
 class BHwBinder : public IBinder
 {
 public:
@@ -57,6 +59,57 @@ public:
     int                 getMinSchedulingPolicy();
     int                 getMinSchedulingPriority();
 
+    // Sets the minimum scheduling policy transactions to this node run at:
+    // SCHED_NORMAL with a nice value [-20..19], or SCHED_FIFO or SCHED_RR
+    // with an RT priority [1..99]. Returns BAD_VALUE for anything else.
+    // Nodes that are never given one are sent with
+    // ProcessState::setDefaultSchedulerPolicy(). Must be called before the
+    // object is sent to another process. Not thread safe.
+    status_t            setMinSchedulerPolicy(int policy, int priority);
+
+    // Whether transactions to this node run at the RT priority of the
+    // caller when it is higher. Nodes that are never told are sent with
+    // ProcessState::setDefaultInheritRt(), true unless set. Must be called
+    // before the object is sent to another process. Not thread safe.
+    void                setInheritRt(bool inheritRt);
+
+    // What the node is sent with: the policy and RT inheritance set on it,
+    // or else the defaults of |proc| at the time of the call.
+    void                getSchedulerPolicy(const sp<ProcessState>& proc,
+                                           int* policy,
+                                           int* priority,
+                                           bool* inheritRt);
+
+    static bool         isValidSchedulerPolicy(int policy, int priority);
+
+    // Keeps the replies to the codes marked with setReplyCacheable() and
+    // answers a later call with the same arguments from the cache, without
+    // calling onTransact(). Only for methods whose reply depends on nothing
+    // but their arguments. Calls are compared with their interface token
+    // and the contents of their buffers; calls without a token, and calls
+    // or replies that carry binders or file descriptors, are never cached.
+    // A reply is kept whatever it says, so one with an error status is
+    // cached like any other; don't mark methods that can fail transiently.
+    // |maxBytes| bounds what the cache holds, and the least recently used
+    // replies are dropped first. 0, the default, turns it off and drops
+    // what it held. The cacheable codes are meant to be set up front: each
+    // change keeps a copy of them until the object is destroyed.
+    void                setReplyCacheSize(size_t maxBytes);
+    void                setReplyCacheable(uint32_t code, bool cacheable);
+    // Drops every cached reply, for when what they were computed from has
+    // changed. Replies of calls still running are not kept either.
+    void                invalidateReplyCache();
+
+    struct ReplyCacheStats {
+        uint64_t            hits;
+        uint64_t            misses;
+        uint64_t            uncacheable;    // calls or replies it couldn't keep
+        uint64_t            evictions;      // replies dropped to stay in bounds
+        size_t              entries;
+        size_t              bytes;
+    };
+    ReplyCacheStats     getReplyCacheStats();
+
     bool                isRequestingSid();
 
 protected:
@@ -71,6 +124,14 @@ protected:
     // This must be called before the object is sent to another process. Not thread safe.
     void                setRequestingSid(bool requestSid);
 
+    // Accepts requests of up to |bytes| sent with BpHwBinder::transactChunked().
+    // 0, the default, rejects them. Requests are reassembled in memory before
+    // onTransact() is called, so this bounds what one client can make this
+    // process allocate per transfer. Such requests and their replies carry no
+    // objects, so the generated stub methods don't take them. Must be called
+    // before the object is sent to another process. Not thread safe.
+    void                setMaxChunkedSize(size_t bytes);
+
     int                 mSchedPolicy; // policy to run transaction from this node at
     // priority [-20..19] for SCHED_NORMAL, [1..99] for SCHED_FIFO/RT
     int                 mSchedPriority;
@@ -79,8 +140,18 @@ private:
             BHwBinder&    operator=(const BHwBinder& o);
 
     class Extras;
+    class ReplyCache;
 
     Extras*             getOrCreateExtras();
+    status_t            onChunkTransact(uint32_t code,
+                                        const Parcel& data,
+                                        Parcel* reply);
+    bool                isReplyCacheable(uint32_t code);
+    status_t            cachedTransact(uint32_t code,
+                                       const Parcel& data,
+                                       Parcel* reply,
+                                       uint32_t flags,
+                                       TransactCallback callback);
 
     std::atomic<Extras*> mExtras;
             void*       mReserved0;
@@ -38,6 +38,27 @@ public:
                                     uint32_t flags = 0,
                                     TransactCallback callback = nullptr);
 
+    // Like transact(), for requests and replies that may not fit in the
+    // receiver's binder buffer. The request is sent in bounded pieces and
+    // reassembled into a single Parcel before the remote onTransact() sees
+    // it; a large reply is read back the same way.
+    //
+    // Only plain data is carried: BAD_TYPE is returned if the request or the
+    // reply contains objects. That includes the buffer objects hidl_vec and
+    // hidl_string are written as, so the parcels of generated HIDL methods
+    // can't be sent this way; the payload must be written with write(),
+    // writeUnpadded() and the like.
+    //
+    // The remote object must have enabled this with
+    // BHwBinder::setMaxChunkedSize(), or UNKNOWN_TRANSACTION is returned.
+    // WOULD_BLOCK is returned if it has too many transfers in progress, and
+    // may be retried. TIMED_OUT is returned if the remote side stops taking
+    // pieces for several seconds.
+            status_t    transactChunked(uint32_t code,
+                                        const Parcel& data,
+                                        Parcel* reply,
+                                        uint32_t flags = 0);
+
     virtual status_t    linkToDeath(const sp<DeathRecipient>& recipient,
                                     void* cookie = nullptr,
                                     uint32_t flags = 0);
@@ -108,6 +129,15 @@ private:
     };
 
             void                reportOneDeath(const Obituary& obit);
+            // True in the child of a fork() once ProcessState::reinitAfterFork()
+            // has run, when mHandle refers to the parent's handle table.
+            bool                isStale() const;
+            bool                isStaleLocked() const;
+            // Returns TIMED_OUT if the receiver stops making progress.
+            status_t            waitForChunks(uint64_t token, size_t target,
+                                              size_t* received);
+            status_t            readChunkedReply(uint64_t token, const Parcel& first,
+                                                 Parcel* reply);
             bool                isDescriptorCached() const;
 
     mutable Mutex               mLock;
@@ -30,7 +30,14 @@ class BufferedTextOutput : public TextOutput
 public:
     //** Flags for constructor */
     enum {
-        MULTITHREADED = 0x0001
+        MULTITHREADED = 0x0001,
+        // Completed lines are queued and handed to writeLines() in batches
+        // from a background thread, instead of on the printing thread.
+        // Subclasses must call stopAsync() from their destructor.
+        ASYNC = 0x0002,
+        // With ASYNC, block the printing thread when the queue is full
+        // instead of dropping the line.
+        ASYNC_BLOCK_WHEN_FULL = 0x0004
     };
     
     explicit            BufferedTextOutput(uint32_t flags = 0);
@@ -43,23 +50,41 @@ public:
     virtual void        popBundle();
     
 protected:
+    // Writes N consecutive iovecs starting at vec. With ASYNC, N can be
+    // greater than one. Calls never overlap, even for a MULTITHREADED
+    // output.
     virtual status_t    writeLines(const struct iovec& vec, size_t N) = 0;
 
+    // Writes out everything queued so far and stops the background thread.
+    // Must be called before a subclass using ASYNC is destroyed.
+            void        stopAsync();
+
 private:
     struct BufferState;
     struct ThreadState;
+    struct AsyncState;
     
     static  ThreadState*getThreadState();
     static  void        threadDestructor(void *st);
     
-            BufferState*getBuffer() const;
+            BufferState*getThreadBuffer() const;
+            status_t    appendLines(BufferState* b, const char* txt, size_t len);
+            void        doMoveIndent(BufferState* b, int delta);
+            void        doPopBundle(BufferState* b);
+            status_t    emitLines(const struct iovec& vec);
+            status_t    doWriteLines(const struct iovec& vec, size_t N);
             
     uint32_t            mFlags;
     const int32_t       mSeq;
     const int32_t       mIndex;
     
+    // Only guards mGlobalState; MULTITHREADED outputs print to per-thread
+    // buffers without locking.
     Mutex               mLock;
-    BufferState*        mGlobalState;
+    // Serializes writeLines().
+    Mutex               mWriteLock;
+    BufferState* const  mGlobalState;
+    AsyncState* const   mAsync;
 };
 
 // ---------------------------------------------------------------------------
@@ -49,6 +49,16 @@ public:
         FLAG_ONEWAY             = 0x00000001
     };
 
+    enum {
+        // Reserved for the chunked transfer protocol between
+        // BpHwBinder::transactChunked() and BHwBinder. These are handled
+        // by BHwBinder::transact() and never reach onTransact().
+        CHUNK_DATA_TRANSACTION      = 0x5f434b44, // '_CKD'
+        CHUNK_PROGRESS_TRANSACTION  = 0x5f434b50, // '_CKP'
+        CHUNK_COMMIT_TRANSACTION    = 0x5f434b43, // '_CKC'
+        CHUNK_READ_TRANSACTION      = 0x5f434b52, // '_CKR'
+    };
+
                           IBinder();
 
     virtual status_t        transact(   uint32_t code,
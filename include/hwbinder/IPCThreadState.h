@@ -22,6 +22,7 @@
 #include <hwbinder/ProcessState.h>
 #include <utils/Vector.h>
 
+#include <atomic>
 #include <functional>
 
 #if defined(_WIN32)
@@ -69,7 +70,9 @@ public:
 
             void                joinThreadPool(bool isMain = true);
 
-            // Stop the local process.
+            // Stop the local process. Unless |immediate|, the thread pool is
+            // drained first for up to five seconds, see
+            // ProcessState::drainThreadPool().
             void                stopProcess(bool immediate = true);
 
             status_t            transact(int32_t handle,
@@ -134,10 +137,50 @@ public:
             // threadpool.
             void addPostCommandTask(const std::function<void(void)>& task);
 
+            // What this thread has exchanged with the driver, for
+            // benchmarks and debugging. Both calls may be made from any
+            // thread. A snapshot taken while the thread is busy may miss
+            // the commands it is handling, and a reset may keep them.
+            struct DriverStats {
+                uint64_t            writeReads;         // BINDER_WRITE_READ ioctls
+                uint64_t            increfs;            // BR_INCREFS received
+                uint64_t            acquires;           // BR_ACQUIRE received
+                uint64_t            releases;           // BR_RELEASE received
+                uint64_t            decrefs;            // BR_DECREFS received
+                size_t              maxPendingDerefs;   // largest batch processPendingDerefs() ran
+            };
+            DriverStats         getDriverStats() const;
+            void                resetDriverStats();
+
+            // The parts of a transaction a thread goes through. A hook set
+            // with setPhaseHook() is called as a thread enters each of them,
+            // and with the enclosing phase as it leaves, so that tools can
+            // attribute costs such as allocations to them. Phases nest: a
+            // reply is sent from within a dispatch, and both talk to the
+            // driver.
+            enum class Phase {
+                NONE,       // none of the below
+                WRITE,      // transact() writing the call into mOut
+                TALK,       // talkWithDriver()
+                DISPATCH,   // BHwBinder::transact() of a received call
+                REPLY,      // sendReply()
+                FREE,       // freeBuffer() of a received buffer
+            };
+            typedef void (*PhaseHook)(Phase phase);
+
+            // Sets the hook of every thread, or clears it with nullptr.
+            // Meant to be called once, before any thread transacts.
+    static  void                setPhaseHook(PhaseHook hook);
+
            private:
+    friend class ProcessState;
             IPCThreadState();
             ~IPCThreadState();
 
+            // Forgets the calling thread's state, used by
+            // ProcessState::reinitAfterFork().
+    static  void                resetAfterFork();
+
             status_t            sendReply(const Parcel& reply, uint32_t flags);
             status_t            waitForResponse(Parcel *reply,
                                                 status_t *acquireResult=nullptr);
@@ -155,6 +198,9 @@ public:
 
             void                clearCaller();
 
+            class PhaseScope;
+            Phase               enterPhase(Phase phase);
+
     static  void                threadDestructor(void *st);
     static  void                freeBuffer(Parcel* parcel,
                                            const uint8_t* data, size_t dataSize,
@@ -177,11 +223,24 @@ public:
             sp<BHwBinder>         mContextObject;
             bool                mIsLooper;
             bool mIsPollingThread;
+            // Set while a looper of a draining pool executes a command.
+            bool                mRejectTransactions;
 
             std::vector<std::function<void(void)>> mPostCommandTasks;
             IPCThreadStateBase *mIPCThreadStateBase;
 
             ProcessState::CallRestriction mCallRestriction;
+            // Only this thread counts; others read and reset.
+            struct AtomicDriverStats {
+                std::atomic<uint64_t> writeReads{0};
+                std::atomic<uint64_t> increfs{0};
+                std::atomic<uint64_t> acquires{0};
+                std::atomic<uint64_t> releases{0};
+                std::atomic<uint64_t> decrefs{0};
+                std::atomic<size_t> maxPendingDerefs{0};
+            };
+            AtomicDriverStats   mDriverStats;
+            Phase               mPhase;
 };
 
 }; // namespace hardware
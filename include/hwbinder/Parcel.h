@@ -42,6 +42,7 @@ class TextOutput;
 
 class Parcel {
     friend class IPCThreadState;
+    friend class BHwBinder;
 public:
 
                         Parcel();
@@ -125,6 +126,19 @@ public:
 
     void                remove(size_t start, size_t amt);
 
+    // Makes room for |dataBytes| more bytes at the current position and
+    // |objectsCount| more objects, so that writing them doesn't reallocate.
+    status_t            reserve(size_t dataBytes, size_t objectsCount = 0);
+
+    // Writes or reads a value of any type described by ParcelTraits. They
+    // are defined in ParcelTraits.h, which needs C++17 and which callers
+    // include themselves. write() computes the exact size first and
+    // reserves it once, so containers don't grow the parcel step by step.
+    template<typename T>
+    status_t            write(const T& val);
+    template<typename T>
+    status_t            read(T* val) const;
+
     status_t            read(void* outData, size_t len) const;
     const void*         readInplace(size_t len) const;
     status_t            readInt8(int8_t *pArg) const;
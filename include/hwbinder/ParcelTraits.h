@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_PARCEL_TRAITS_H
+#define ANDROID_HARDWARE_PARCEL_TRAITS_H
+
+#if __cplusplus < 201703L
+#error "hwbinder/ParcelTraits.h needs C++17"
+#endif
+
+#include <stdint.h>
+
+#include <array>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <hwbinder/Parcel.h>
+
+// ---------------------------------------------------------------------------
+namespace android {
+namespace hardware {
+
+// Describes how a value of type T is written to and read from a Parcel,
+// for Parcel::write<T>() and Parcel::read<T>(). Every type is laid out
+// exactly as the equivalent sequence of Parcel calls:
+//
+//   bool, integers, enums     writeBool(), writeInt8() ... writeUint64(),
+//   float, double             writeFloat(), writeDouble()
+//   std::string               writeUint32(size), write(data, size)
+//   std::vector<T>            writeUint32(size), then each element
+//   std::array<T, N>          each element
+//   std::optional<T>          writeBool(has_value()), then the value if any
+//   std::pair, std::tuple     each member in order
+//   sp<IBinder>               writeStrongBinder()
+//   user structs              each field returned by parcelFields(), in order
+//
+// A struct opts in by providing, next to its definition,
+//
+//   inline auto parcelFields(Sample& s) { return std::tie(s.id, s.name); }
+//
+// Each specialization provides:
+//
+//   kFixedSize                true if every value has the same layout
+//   kDataSize, kObjectsCount  that layout, when kFixedSize
+//   kMinDataSize              a lower bound on dataSize(), used to validate
+//                             element counts before allocating
+//   dataSize(v)               exact number of data bytes written for v
+//   objectsCount(v)           most objects written for v
+//   write(parcel, v), read(parcel, &v)
+template<typename T, typename Enable = void>
+struct ParcelTraits;
+
+namespace details {
+
+constexpr size_t parcelPadSize(size_t len) {
+    return (len + 3) & ~size_t(3);
+}
+
+template<size_t Size, bool Signed> struct ParcelScalar;
+template<> struct ParcelScalar<1, true>  { typedef int8_t type; };
+template<> struct ParcelScalar<1, false> { typedef uint8_t type; };
+template<> struct ParcelScalar<2, true>  { typedef int16_t type; };
+template<> struct ParcelScalar<2, false> { typedef uint16_t type; };
+template<> struct ParcelScalar<4, true>  { typedef int32_t type; };
+template<> struct ParcelScalar<4, false> { typedef uint32_t type; };
+template<> struct ParcelScalar<8, true>  { typedef int64_t type; };
+template<> struct ParcelScalar<8, false> { typedef uint64_t type; };
+
+inline status_t writeScalar(Parcel* p, bool v)      { return p->writeBool(v); }
+inline status_t writeScalar(Parcel* p, int8_t v)    { return p->writeInt8(v); }
+inline status_t writeScalar(Parcel* p, uint8_t v)   { return p->writeUint8(v); }
+inline status_t writeScalar(Parcel* p, int16_t v)   { return p->writeInt16(v); }
+inline status_t writeScalar(Parcel* p, uint16_t v)  { return p->writeUint16(v); }
+inline status_t writeScalar(Parcel* p, int32_t v)   { return p->writeInt32(v); }
+inline status_t writeScalar(Parcel* p, uint32_t v)  { return p->writeUint32(v); }
+inline status_t writeScalar(Parcel* p, int64_t v)   { return p->writeInt64(v); }
+inline status_t writeScalar(Parcel* p, uint64_t v)  { return p->writeUint64(v); }
+inline status_t writeScalar(Parcel* p, float v)     { return p->writeFloat(v); }
+inline status_t writeScalar(Parcel* p, double v)    { return p->writeDouble(v); }
+
+inline status_t readScalar(const Parcel& p, bool* v)      { return p.readBool(v); }
+inline status_t readScalar(const Parcel& p, int8_t* v)    { return p.readInt8(v); }
+inline status_t readScalar(const Parcel& p, uint8_t* v)   { return p.readUint8(v); }
+inline status_t readScalar(const Parcel& p, int16_t* v)   { return p.readInt16(v); }
+inline status_t readScalar(const Parcel& p, uint16_t* v)  { return p.readUint16(v); }
+inline status_t readScalar(const Parcel& p, int32_t* v)   { return p.readInt32(v); }
+inline status_t readScalar(const Parcel& p, uint32_t* v)  { return p.readUint32(v); }
+inline status_t readScalar(const Parcel& p, int64_t* v)   { return p.readInt64(v); }
+inline status_t readScalar(const Parcel& p, uint64_t* v)  { return p.readUint64(v); }
+inline status_t readScalar(const Parcel& p, float* v)     { return p.readFloat(v); }
+inline status_t readScalar(const Parcel& p, double* v)    { return p.readDouble(v); }
+
+// The fixed width type a scalar is written as: char, long long and
+// friends map onto the matching intN_t, enums onto their underlying type.
+template<typename T, typename Enable = void>
+struct ParcelWireType {
+    typedef typename ParcelScalar<sizeof(T), std::is_signed<T>::value>::type type;
+};
+template<> struct ParcelWireType<bool> { typedef bool type; };
+template<> struct ParcelWireType<float> { typedef float type; };
+template<> struct ParcelWireType<double> { typedef double type; };
+template<typename T>
+struct ParcelWireType<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    typedef typename ParcelWireType<typename std::underlying_type<T>::type>::type type;
+};
+
+// Checks an element count read from a parcel against what is left in it,
+// before anything is allocated for it.
+template<typename T>
+inline bool parcelCountFits(const Parcel& p, uint32_t count) {
+    constexpr size_t kMin = ParcelTraits<T>::kMinDataSize;
+    return kMin == 0 ? count <= p.dataAvail() : count <= p.dataAvail() / kMin;
+}
+
+// Members of a std::tuple, or of the std::tie() of a struct's fields.
+template<typename Tuple, typename Indices =
+        std::make_index_sequence<std::tuple_size<Tuple>::value>>
+struct ParcelTupleTraits;
+
+template<typename Tuple, size_t... I>
+struct ParcelTupleTraits<Tuple, std::index_sequence<I...>> {
+    template<size_t N>
+    using Member = ParcelTraits<typename std::decay<
+            typename std::tuple_element<N, Tuple>::type>::type>;
+
+    static constexpr bool kFixedSize = (true && ... && Member<I>::kFixedSize);
+    static constexpr size_t kMinDataSize = (size_t(0) + ... + Member<I>::kMinDataSize);
+
+    static constexpr size_t fixedDataSize() {
+        if constexpr (kFixedSize) {
+            return (size_t(0) + ... + Member<I>::kDataSize);
+        } else {
+            return 0;
+        }
+    }
+    static constexpr size_t fixedObjectsCount() {
+        if constexpr (kFixedSize) {
+            return (size_t(0) + ... + Member<I>::kObjectsCount);
+        } else {
+            return 0;
+        }
+    }
+    static constexpr size_t kDataSize = fixedDataSize();
+    static constexpr size_t kObjectsCount = fixedObjectsCount();
+
+    static size_t dataSize(const Tuple& v) {
+        if constexpr (kFixedSize) {
+            return kDataSize;
+        } else {
+            return (size_t(0) + ... + Member<I>::dataSize(std::get<I>(v)));
+        }
+    }
+    static size_t objectsCount(const Tuple& v) {
+        if constexpr (kFixedSize) {
+            return kObjectsCount;
+        } else {
+            return (size_t(0) + ... + Member<I>::objectsCount(std::get<I>(v)));
+        }
+    }
+    static status_t write(Parcel* p, const Tuple& v) {
+        status_t err = NO_ERROR;
+        (void)(((err = Member<I>::write(p, std::get<I>(v))) == NO_ERROR) && ...);
+        return err;
+    }
+    static status_t read(const Parcel& p, Tuple* v) {
+        status_t err = NO_ERROR;
+        (void)(((err = Member<I>::read(p, &std::get<I>(*v))) == NO_ERROR) && ...);
+        return err;
+    }
+};
+
+template<typename T, typename Enable = void>
+struct HasParcelFields : std::false_type {};
+template<typename T>
+struct HasParcelFields<T, decltype((void)parcelFields(std::declval<T&>()))>
+        : std::true_type {};
+
+}  // namespace details
+
+// ---------------------------------------------------------------------------
+
+template<typename T>
+struct ParcelTraits<T, typename std::enable_if<
+        std::is_arithmetic<T>::value || std::is_enum<T>::value>::type> {
+    typedef typename details::ParcelWireType<T>::type Wire;
+
+    static constexpr bool kFixedSize = true;
+    static constexpr size_t kDataSize = details::parcelPadSize(sizeof(Wire));
+    static constexpr size_t kObjectsCount = 0;
+    static constexpr size_t kMinDataSize = kDataSize;
+
+    static constexpr size_t dataSize(const T&) { return kDataSize; }
+    static constexpr size_t objectsCount(const T&) { return 0; }
+    static status_t write(Parcel* p, const T& v) {
+        return details::writeScalar(p, static_cast<Wire>(v));
+    }
+    static status_t read(const Parcel& p, T* v) {
+        Wire wire;
+        status_t err = details::readScalar(p, &wire);
+        if (err == NO_ERROR) *v = static_cast<T>(wire);
+        return err;
+    }
+};
+
+template<>
+struct ParcelTraits<std::string> {
+    static constexpr bool kFixedSize = false;
+    static constexpr size_t kMinDataSize = sizeof(uint32_t);
+
+    static size_t dataSize(const std::string& v) {
+        return sizeof(uint32_t) + details::parcelPadSize(v.size());
+    }
+    static size_t objectsCount(const std::string&) { return 0; }
+    static status_t write(Parcel* p, const std::string& v) {
+        if (static_cast<uint64_t>(v.size()) > UINT32_MAX) return BAD_VALUE;
+        status_t err = p->writeUint32(v.size());
+        if (err == NO_ERROR) err = p->write(v.data(), v.size());
+        return err;
+    }
+    static status_t read(const Parcel& p, std::string* v) {
+        uint32_t size;
+        status_t err = p.readUint32(&size);
+        if (err != NO_ERROR) return err;
+        const void* data = p.readInplace(size);
+        if (data == nullptr) return BAD_VALUE;
+        v->assign(static_cast<const char*>(data), size);
+        return NO_ERROR;
+    }
+};
+
+template<typename T>
+struct ParcelTraits<std::vector<T>> {
+    typedef ParcelTraits<T> Element;
+
+    static constexpr bool kFixedSize = false;
+    static constexpr size_t kMinDataSize = sizeof(uint32_t);
+
+    static size_t dataSize(const std::vector<T>& v) {
+        if constexpr (Element::kFixedSize) {
+            return sizeof(uint32_t) + v.size() * Element::kDataSize;
+        } else {
+            size_t size = sizeof(uint32_t);
+            for (const auto& e : v) size += Element::dataSize(e);
+            return size;
+        }
+    }
+    static size_t objectsCount(const std::vector<T>& v) {
+        if constexpr (Element::kFixedSize) {
+            return v.size() * Element::kObjectsCount;
+        } else {
+            size_t count = 0;
+            for (const auto& e : v) count += Element::objectsCount(e);
+            return count;
+        }
+    }
+    static status_t write(Parcel* p, const std::vector<T>& v) {
+        if (static_cast<uint64_t>(v.size()) > UINT32_MAX) return BAD_VALUE;
+        status_t err = p->writeUint32(v.size());
+        for (size_t i = 0; err == NO_ERROR && i < v.size(); i++) {
+            err = Element::write(p, v[i]);
+        }
+        return err;
+    }
+    static status_t read(const Parcel& p, std::vector<T>* v) {
+        uint32_t size;
+        status_t err = p.readUint32(&size);
+        if (err != NO_ERROR) return err;
+        if (!details::parcelCountFits<T>(p, size)) return BAD_VALUE;
+        v->clear();
+        v->reserve(size);
+        for (uint32_t i = 0; i < size; i++) {
+            T e{};
+            err = Element::read(p, &e);
+            if (err != NO_ERROR) return err;
+            v->push_back(std::move(e));
+        }
+        return NO_ERROR;
+    }
+};
+
+template<typename T, size_t N>
+struct ParcelTraits<std::array<T, N>> {
+    typedef ParcelTraits<T> Element;
+
+    static constexpr bool kFixedSize = Element::kFixedSize;
+    static constexpr size_t kMinDataSize = N * Element::kMinDataSize;
+
+    static constexpr size_t fixedDataSize() {
+        if constexpr (kFixedSize) {
+            return N * Element::kDataSize;
+        } else {
+            return 0;
+        }
+    }
+    static constexpr size_t fixedObjectsCount() {
+        if constexpr (kFixedSize) {
+            return N * Element::kObjectsCount;
+        } else {
+            return 0;
+        }
+    }
+    static constexpr size_t kDataSize = fixedDataSize();
+    static constexpr size_t kObjectsCount = fixedObjectsCount();
+
+    static size_t dataSize(const std::array<T, N>& v) {
+        if constexpr (kFixedSize) {
+            return kDataSize;
+        } else {
+            size_t size = 0;
+            for (const auto& e : v) size += Element::dataSize(e);
+            return size;
+        }
+    }
+    static size_t objectsCount(const std::array<T, N>& v) {
+        if constexpr (kFixedSize) {
+            return kObjectsCount;
+        } else {
+            size_t count = 0;
+            for (const auto& e : v) count += Element::objectsCount(e);
+            return count;
+        }
+    }
+    static status_t write(Parcel* p, const std::array<T, N>& v) {
+        for (const auto& e : v) {
+            status_t err = Element::write(p, e);
+            if (err != NO_ERROR) return err;
+        }
+        return NO_ERROR;
+    }
+    static status_t read(const Parcel& p, std::array<T, N>* v) {
+        for (auto& e : *v) {
+            status_t err = Element::read(p, &e);
+            if (err != NO_ERROR) return err;
+        }
+        return NO_ERROR;
+    }
+};
+
+template<typename T>
+struct ParcelTraits<std::optional<T>> {
+    typedef ParcelTraits<T> Value;
+
+    static constexpr bool kFixedSize = false;
+    static constexpr size_t kMinDataSize = ParcelTraits<bool>::kDataSize;
+
+    static size_t dataSize(const std::optional<T>& v) {
+        return ParcelTraits<bool>::kDataSize + (v ? Value::dataSize(*v) : 0);
+    }
+    static size_t objectsCount(const std::optional<T>& v) {
+        return v ? Value::objectsCount(*v) : 0;
+    }
+    static status_t write(Parcel* p, const std::optional<T>& v) {
+        status_t err = p->writeBool(v.has_value());
+        if (err == NO_ERROR && v) err = Value::write(p, *v);
+        return err;
+    }
+    static status_t read(const Parcel& p, std::optional<T>* v) {
+        bool present;
+        status_t err = p.readBool(&present);
+        if (err != NO_ERROR) return err;
+        if (!present) {
+            v->reset();
+            return NO_ERROR;
+        }
+        return Value::read(p, &v->emplace());
+    }
+};
+
+template<typename... Ts>
+struct ParcelTraits<std::tuple<Ts...>> : details::ParcelTupleTraits<std::tuple<Ts...>> {};
+
+template<typename A, typename B>
+struct ParcelTraits<std::pair<A, B>> : details::ParcelTupleTraits<std::pair<A, B>> {};
+
+template<>
+struct ParcelTraits<sp<IBinder>> {
+    static constexpr bool kFixedSize = true;
+    static constexpr size_t kDataSize = sizeof(flat_binder_object);
+    static constexpr size_t kObjectsCount = 1;
+    static constexpr size_t kMinDataSize = kDataSize;
+
+    static constexpr size_t dataSize(const sp<IBinder>&) { return kDataSize; }
+    static constexpr size_t objectsCount(const sp<IBinder>&) { return kObjectsCount; }
+    static status_t write(Parcel* p, const sp<IBinder>& v) {
+        return p->writeStrongBinder(v);
+    }
+    static status_t read(const Parcel& p, sp<IBinder>* v) {
+        return p.readNullableStrongBinder(v);
+    }
+};
+
+// Structs that describe their fields with parcelFields().
+template<typename T>
+struct ParcelTraits<T, typename std::enable_if<details::HasParcelFields<T>::value>::type> {
+    typedef decltype(parcelFields(std::declval<T&>())) Fields;
+    typedef details::ParcelTupleTraits<Fields> Members;
+
+    static constexpr bool kFixedSize = Members::kFixedSize;
+    static constexpr size_t kDataSize = Members::kDataSize;
+    static constexpr size_t kObjectsCount = Members::kObjectsCount;
+    static constexpr size_t kMinDataSize = Members::kMinDataSize;
+
+    // parcelFields() only needs to be written for non-const structs; the
+    // fields are not modified when writing.
+    static Fields fields(const T& v) { return parcelFields(const_cast<T&>(v)); }
+
+    static size_t dataSize(const T& v) {
+        if constexpr (kFixedSize) {
+            return kDataSize;
+        } else {
+            return Members::dataSize(fields(v));
+        }
+    }
+    static size_t objectsCount(const T& v) {
+        if constexpr (kFixedSize) {
+            return kObjectsCount;
+        } else {
+            return Members::objectsCount(fields(v));
+        }
+    }
+    static status_t write(Parcel* p, const T& v) { return Members::write(p, fields(v)); }
+    static status_t read(const Parcel& p, T* v) {
+        Fields f = parcelFields(*v);
+        return Members::read(p, &f);
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+template<typename T>
+status_t Parcel::write(const T& val)
+{
+    typedef ParcelTraits<T> Traits;
+    status_t err = reserve(Traits::dataSize(val), Traits::objectsCount(val));
+    if (err != NO_ERROR) return err;
+    return Traits::write(this, val);
+}
+
+template<typename T>
+status_t Parcel::read(T* val) const
+{
+    return ParcelTraits<T>::read(*this, val);
+}
+
+}; // namespace hardware
+}; // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_HARDWARE_PARCEL_TRAITS_H
@@ -21,9 +21,12 @@
 #include <utils/KeyedVector.h>
 #include <utils/String8.h>
 #include <utils/String16.h>
+#include <utils/Timers.h>
 
 #include <utils/threads.h>
 
+#include <atomic>
+
 #include <pthread.h>
 
 // ---------------------------------------------------------------------------
@@ -40,6 +43,16 @@ public:
     // Note: don't call self() or selfOrNull() before initWithMmapSize()
     static  sp<ProcessState>    initWithMmapSize(size_t mmapSize); // size in bytes
 
+    // Call in the child of a fork(), while it is still single threaded and
+    // before it uses binder. The driver connection, handles and thread pool
+    // inherited from the parent belong to the parent and can't be used by
+    // the child; this drops them and connects the child to the driver with
+    // the same mmap size, call restriction and thread pool configuration.
+    // Proxies obtained before the fork fail with DEAD_OBJECT afterwards, and
+    // the thread pool has to be started again. Returns nullptr if the parent
+    // never initialized a ProcessState.
+    static  sp<ProcessState>    reinitAfterFork();
+
             void                setContextObject(const sp<IBinder>& object);
             sp<IBinder>         getContextObject(const sp<IBinder>& caller);
 
@@ -50,6 +63,20 @@ public:
 
             void                startThreadPool();
 
+            // Takes the thread pool down for a restart or exit of the process.
+            // From this call on no pool thread is spawned, transactions that
+            // reach a looper fail with DEAD_OBJECT (one-way ones are dropped),
+            // and loopers leave with BC_EXIT_LOOPER once they are done with
+            // the command they are executing. Waits up to |timeout| ns for
+            // all of them to leave, or without limit if it is negative, joins
+            // the pool threads and flushes the calling thread's commands.
+            // Returns TIMED_OUT if some were still busy at the deadline; they
+            // still leave when they finish. May be called from a binder
+            // thread, which leaves after its current command. The pool can't
+            // be started again.
+            status_t            drainThreadPool(nsecs_t timeout);
+            bool                isDraining() const;
+
     typedef bool (*context_check_func)(const String16& name,
                                        const sp<IBinder>& caller,
                                        void* userData);
@@ -63,6 +90,18 @@ public:
             wp<IBinder>         getWeakProxyForHandle(int32_t handle);
             void                expungeHandle(int32_t handle, IBinder* binder);
 
+            // The table behind the three calls above, for benchmarks and
+            // debugging. The lock counts only cover those calls.
+            struct HandleTableStats {
+                size_t              entries;         // handles the table has room for
+                size_t              proxies;         // entries with a BpHwBinder
+                size_t              bytes;           // memory the table itself holds
+                uint64_t            lockContentions; // calls that had to wait for mLock
+                uint64_t            lockWaitNs;      // time they waited
+            };
+            HandleTableStats    getHandleTableStats();
+            void                resetHandleLockStats();
+
             void                spawnPooledThread(bool isMain);
 
             status_t            setThreadPoolConfiguration(size_t maxThreads, bool callerJoinsPool);
@@ -90,6 +129,15 @@ public:
             // before any threads are spawned.
             void setCallRestriction(CallRestriction restriction);
 
+            // Defaults of the BHwBinder objects that aren't given their own,
+            // see BHwBinder::setMinSchedulerPolicy() and setInheritRt(). They
+            // are read when an object is sent to another process, so they
+            // apply to every object first sent after the call. Thread safe.
+            status_t            setDefaultSchedulerPolicy(int policy, int priority);
+            void                getDefaultSchedulerPolicy(int* policy, int* priority) const;
+            void                setDefaultInheritRt(bool inheritRt);
+            bool                getDefaultInheritRt() const;
+
 private:
     friend class IPCThreadState;
             explicit            ProcessState(size_t mmap_size);
@@ -105,23 +153,48 @@ private:
             };
 
             handle_entry*       lookupHandleLocked(int32_t handle);
+            // Locks mLock, counting the wait if another thread held it.
+            void                lockHandleTable();
+            // Holds the handle table lock for a scope.
+            class HandleTableLock {
+            public:
+                explicit HandleTableLock(ProcessState* proc) : mProc(proc) {
+                    mProc->lockHandleTable();
+                }
+                ~HandleTableLock() { mProc->mLock.unlock(); }
+            private:
+                ProcessState* const mProc;
+            };
+            // Makes the loopers waiting in the driver return to user space.
+            void                wakeLoopers();
 
             int                 mDriverFD;
             void*               mVMStart;
 
-            // Protects thread count variable below.
+            // Protects thread count variables below.
             pthread_mutex_t     mThreadCountLock;
             pthread_cond_t      mThreadCountDecrement;
             // Number of binder threads current executing a command.
             size_t              mExecutingThreadsCount;
             // Maximum number for binder threads allowed for this process.
             size_t              mMaxThreads;
+            // What the driver was last told with BINDER_SET_MAX_THREADS.
+            size_t              mKernelMaxThreads;
             // Time when thread pool was emptied
             int64_t             mStarvationStartTimeMs;
+            // Threads in IPCThreadState::joinThreadPool().
+            size_t              mLooperCount;
+            // Threads started by spawnPooledThread(), for drainThreadPool().
+            Vector<sp<Thread> > mPoolThreads;
+            // Set by drainThreadPool() under mThreadCountLock, read by
+            // loopers without it.
+            std::atomic<bool>   mDraining;
 
     mutable Mutex               mLock;  // protects everything below.
 
             Vector<handle_entry>mHandleToObject;
+            uint64_t            mHandleLockContentions;
+            uint64_t            mHandleLockWaitNs;
 
             bool                mManagesContexts;
             context_check_func  mBinderContextCheckFunc;
@@ -138,6 +211,11 @@ private:
             const size_t        mMmapSize;
 
             CallRestriction     mCallRestriction;
+
+            // policy in the high half, priority in the low half, so that
+            // the pair is always read together
+            std::atomic<uint32_t> mDefaultSchedPolicy;
+            std::atomic<bool>   mDefaultInheritRt;
 };
 
 }; // namespace hardware
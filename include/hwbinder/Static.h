@@ -17,6 +17,8 @@
 // All static variables go here, to control initialization and
 // destruction order in the library.
 
+#include <atomic>
+
 #include <utils/threads.h>
 
 #include <hwbinder/IBinder.h>
@@ -25,12 +27,12 @@
 namespace android {
 namespace hardware {
 
-// For TextStream.cpp
-extern Vector<int32_t> gTextBuffers;
-
 // For ProcessState.cpp
 extern Mutex& gProcessMutex;
 extern sp<ProcessState> gProcess;
+// Bumped by ProcessState::reinitAfterFork(). Proxies created under an
+// older generation refer to handles of the parent process.
+extern std::atomic<uint32_t> gProcessGeneration;
 
 }   // namespace hardware
 }   // namespace android
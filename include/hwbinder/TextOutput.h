@@ -23,6 +23,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <sstream>
+#include <string>
+#include <type_traits>
 
 // ---------------------------------------------------------------------------
 namespace android {
@@ -66,6 +68,9 @@ TextOutput& endl(TextOutput& to);
 TextOutput& indent(TextOutput& to);
 TextOutput& dedent(TextOutput& to);
 
+// Fallback for types without a dedicated overload below. This goes through
+// a std::stringstream and allocates, so common types are formatted directly
+// into a stack buffer instead.
 template<typename T>
 TextOutput& operator<<(TextOutput& to, const T& val)
 {
@@ -141,12 +146,37 @@ inline TextOutput& operator<<(TextOutput& to, const bool &val)
     return to;
 }
 
-inline TextOutput& operator<<(TextOutput& to, const String16& val)
+TextOutput& operator<<(TextOutput& to, short val);
+TextOutput& operator<<(TextOutput& to, unsigned short val);
+TextOutput& operator<<(TextOutput& to, int val);
+TextOutput& operator<<(TextOutput& to, unsigned int val);
+TextOutput& operator<<(TextOutput& to, long val);
+TextOutput& operator<<(TextOutput& to, unsigned long val);
+TextOutput& operator<<(TextOutput& to, long long val);
+TextOutput& operator<<(TextOutput& to, unsigned long long val);
+TextOutput& operator<<(TextOutput& to, float val);
+TextOutput& operator<<(TextOutput& to, double val);
+
+// Pointers are printed as "0x<hex>", like std::ostream does for void*.
+// Pointers to volatile and to functions are left to the generic overload.
+TextOutput& operator<<(TextOutput& to, const void* val);
+
+template<typename T,
+         typename = typename std::enable_if<!std::is_function<T>::value &&
+                                            !std::is_volatile<T>::value>::type>
+inline TextOutput& operator<<(TextOutput& to, T* val)
 {
-    to << String8(val).string();
-    return to;
+    return to << static_cast<const void*>(val);
 }
 
+// C strings; char* needs its own overload so it is not taken as a pointer.
+TextOutput& operator<<(TextOutput& to, const char* val);
+TextOutput& operator<<(TextOutput& to, char* val);
+
+TextOutput& operator<<(TextOutput& to, const std::string& val);
+TextOutput& operator<<(TextOutput& to, const String8& val);
+TextOutput& operator<<(TextOutput& to, const String16& val);
+
 // ---------------------------------------------------------------------------
 // No user servicable parts below.
 
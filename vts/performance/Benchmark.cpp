@@ -31,6 +31,8 @@
 
 #include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
 
+#include "PerfCounters.h"
+
 // libutils:
 using android::OK;
 using android::sp;
@@ -55,6 +57,9 @@ using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
 
 const char gServiceName[] = "android.hardware.tests.libhwbinder.IBenchmark";
 
+// Report perf event counts per call, set by -perf.
+static bool gPerfCounters = false;
+
 static bool startServer() {
     sp<IBenchmark> service = IBenchmark::getService(gServiceName, true);
     status_t status = service->registerAsService(gServiceName);
@@ -74,11 +79,27 @@ static void BM_sendVec(benchmark::State& state, sp<IBenchmark> service) {
     for (int i = 0; i < state.range(0); i++) {
        data_vec[i] = i % 256;
     }
+    PerfCounters counters;
+    bool counting = gPerfCounters && counters.open();
+    if (counting) {
+        counters.start();
+    }
     // Start running
     while (state.KeepRunning()) {
        service->sendVec(data_vec, [&] (const auto &/*res*/) {
                });
     }
+    if (counting) {
+        counters.stop();
+        PerfCounterValues values = counters.read();
+        for (int i = 0; i < PerfCounterValues::kEventCount; i++) {
+            auto event = PerfCounterValues::Event(i);
+            if (values.has(event)) {
+                state.counters[PerfCounterValues::name(event)] =
+                        (double)values.counts[i] / state.iterations();
+            }
+        }
+    }
 }
 
 static void BM_sendVec_passthrough(benchmark::State& state) {
@@ -120,7 +141,11 @@ int main(int argc, char* argv []) {
             if (!strcmp(argv[i + 1], "PASSTHROUGH")) {
                 mode = HwBinderMode::kPassthrough;
             }
-            break;
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-perf") {
+            gPerfCounters = true;
         }
     }
     if (mode == HwBinderMode::kBinderize) {
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Counts the heap allocations of a transaction, on both ends.
+//
+// This binary defines malloc(), calloc(), realloc() and free(), which the
+// dynamic linker then uses for the libraries too, and counts every call
+// by the phase the calling thread is in, as IPCThreadState reports it
+// through setPhaseHook():
+//
+//   serialize: the generated proxy writing the call and reading the reply
+//              (client, outside the phases below)
+//   write:     transact() copying the call into mOut
+//   talk:      talkWithDriver()
+//   dispatch:  the stub reading the call, running the method and writing
+//              the reply (server)
+//   reply:     sendReply()
+//   free:      freeBuffer(), giving a received buffer back
+//   other:     anything else, e.g. a looper thread between calls
+//
+// The calls are IBenchmark::sendVec() to a server forked from this binary,
+// which counts the same way. After warm-up calls, which let buffers such as
+// mIn and mOut grow to size, it prints per payload size the allocations
+// and bytes per client call and per served call. With -max_allocs, it
+// fails if either exceeds the target, so that changes to Parcel and
+// IPCThreadState can be held to it (-max_allocs 0 for none at all).
+//
+//  libhwbinder_alloc -sizes 0,64,4096,65536 -i 1000 -max_allocs 0
+
+#define LOG_TAG "libhwbinder_alloc"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/IPCThreadState.h>
+#include <log/log.h>
+
+#include "PerfTest.h"
+
+using android::sp;
+using android::hardware::hidl_vec;
+using android::hardware::IPCThreadState;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::get;
+using std::move;
+using std::string;
+using std::vector;
+
+typedef IPCThreadState::Phase Phase;
+
+static const char kServiceName[] = "hwbinderAlloc";
+
+// default arguments
+static vector<size_t> payload_sizes = {0, 64, 4096, 65536};
+static int iterations = 1000;
+static int warmup = 20;
+static long max_allocs = -1;  // no target
+
+enum Bucket { OTHER, SERIALIZE, WRITE, TALK, DISPATCH, REPLY, FREE, kBuckets };
+static const char* const kBucketNames[kBuckets] = {"other", "serialize", "write", "talk",
+                                                   "dispatch", "reply", "free"};
+
+struct AllocCounts {
+    uint64_t allocs[kBuckets];
+    uint64_t bytes[kBuckets];
+    uint64_t frees[kBuckets];
+    uint64_t served;  // calls dispatched, server side
+
+    uint64_t totalAllocs() const {
+        uint64_t n = 0;
+        for (int b = 0; b < kBuckets; b++) n += allocs[b];
+        return n;
+    }
+    uint64_t totalBytes() const {
+        uint64_t n = 0;
+        for (int b = 0; b < kBuckets; b++) n += bytes[b];
+        return n;
+    }
+};
+
+// server commands
+enum Command { RESET, REPORT, EXIT };
+
+static atomic<uint64_t> alloc_count[kBuckets];
+static atomic<uint64_t> alloc_bytes[kBuckets];
+static atomic<uint64_t> free_count[kBuckets];
+static atomic<uint64_t> served_count(0);
+
+// The phase of each thread, with kInCall set while the client is in a
+// measured call. A pthread key and not thread_local, which may allocate.
+static pthread_key_t phase_key;
+static atomic<bool> counting(false);
+static const uintptr_t kPhaseMask = 0xff;
+static const uintptr_t kInCall = 0x100;
+
+static uintptr_t threadPhase() {
+    return reinterpret_cast<uintptr_t>(pthread_getspecific(phase_key));
+}
+
+static void setThreadPhase(uintptr_t phase) {
+    pthread_setspecific(phase_key, reinterpret_cast<void*>(phase));
+}
+
+static Bucket currentBucket() {
+    uintptr_t state = threadPhase();
+    switch (static_cast<Phase>(state & kPhaseMask)) {
+        case Phase::NONE:
+            return (state & kInCall) ? SERIALIZE : OTHER;
+        case Phase::WRITE:
+            return WRITE;
+        case Phase::TALK:
+            return TALK;
+        case Phase::DISPATCH:
+            return DISPATCH;
+        case Phase::REPLY:
+            return REPLY;
+        case Phase::FREE:
+            return FREE;
+    }
+    return OTHER;
+}
+
+static void phaseHook(Phase phase) {
+    uintptr_t state = threadPhase();
+    // entered from outside a transaction, not back from a nested phase
+    if (phase == Phase::DISPATCH && (state & kPhaseMask) == uintptr_t(Phase::NONE)) {
+        served_count++;
+    }
+    setThreadPhase((state & ~kPhaseMask) | uintptr_t(phase));
+}
+
+static void countAlloc(size_t size) {
+    if (!counting) return;
+    Bucket bucket = currentBucket();
+    alloc_count[bucket].fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes[bucket].fetch_add(size, std::memory_order_relaxed);
+}
+
+static void countFree(void* ptr) {
+    if (!counting || ptr == nullptr) return;
+    free_count[currentBucket()].fetch_add(1, std::memory_order_relaxed);
+}
+
+static void resetCounts() {
+    for (int b = 0; b < kBuckets; b++) {
+        alloc_count[b] = 0;
+        alloc_bytes[b] = 0;
+        free_count[b] = 0;
+    }
+    served_count = 0;
+}
+
+static AllocCounts readCounts() {
+    AllocCounts counts;
+    for (int b = 0; b < kBuckets; b++) {
+        counts.allocs[b] = alloc_count[b];
+        counts.bytes[b] = alloc_bytes[b];
+        counts.frees[b] = free_count[b];
+    }
+    counts.served = served_count;
+    return counts;
+}
+
+static void startCounting() {
+    ASSERT(pthread_key_create(&phase_key, nullptr) == 0);
+    IPCThreadState::setPhaseHook(phaseHook);
+    resetCounts();
+    counting = true;
+}
+
+// The allocator this binary stands in front of, looked up on first use.
+// What dlsym() allocates meanwhile comes from a static arena and is never
+// freed. memalign() and posix_memalign() aren't counted.
+typedef void* (*MallocFn)(size_t);
+typedef void* (*CallocFn)(size_t, size_t);
+typedef void* (*ReallocFn)(void*, size_t);
+typedef void (*FreeFn)(void*);
+
+static MallocFn real_malloc;
+static CallocFn real_calloc;
+static ReallocFn real_realloc;
+static FreeFn real_free;
+
+alignas(16) static char bootstrap_arena[4096];
+static size_t bootstrap_used;
+static bool resolving;
+
+static void* bootstrapAlloc(size_t size) {
+    size = (size + 15) & ~size_t(15);
+    if (bootstrap_used + size > sizeof(bootstrap_arena)) abort();
+    void* ptr = bootstrap_arena + bootstrap_used;
+    bootstrap_used += size;
+    return ptr;
+}
+
+static bool isBootstrap(void* ptr) {
+    return ptr >= bootstrap_arena && ptr < bootstrap_arena + sizeof(bootstrap_arena);
+}
+
+static void resolve() {
+    resolving = true;
+    real_malloc = reinterpret_cast<MallocFn>(dlsym(RTLD_NEXT, "malloc"));
+    real_calloc = reinterpret_cast<CallocFn>(dlsym(RTLD_NEXT, "calloc"));
+    real_realloc = reinterpret_cast<ReallocFn>(dlsym(RTLD_NEXT, "realloc"));
+    real_free = reinterpret_cast<FreeFn>(dlsym(RTLD_NEXT, "free"));
+    if (!real_malloc || !real_calloc || !real_realloc || !real_free) abort();
+    resolving = false;
+}
+
+extern "C" void* malloc(size_t size) {
+    if (real_malloc == nullptr) {
+        if (resolving) return bootstrapAlloc(size);
+        resolve();
+    }
+    countAlloc(size);
+    return real_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    if (real_calloc == nullptr) {
+        // the arena is zeroed and never reused
+        if (resolving) return bootstrapAlloc(count * size);
+        resolve();
+    }
+    countAlloc(count * size);
+    return real_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    if (real_realloc == nullptr) {
+        if (resolving) return nullptr;
+        resolve();
+    }
+    if (isBootstrap(ptr)) return nullptr;
+    // a move or a resize in place, either way one allocation
+    countAlloc(size);
+    return real_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+    if (ptr == nullptr || isBootstrap(ptr)) return;
+    if (real_free == nullptr) resolve();
+    countFree(ptr);
+    real_free(ptr);
+}
+
+static void dumpCounts(const AllocCounts& counts, uint64_t calls) {
+    cout << "{ \"allocs_per_call\":" << (double)counts.totalAllocs() / calls
+         << ", \"bytes_per_call\":" << (double)counts.totalBytes() / calls << ", \"phases\":{ ";
+    bool first = true;
+    for (int b = 0; b < kBuckets; b++) {
+        if (counts.allocs[b] == 0 && counts.frees[b] == 0) continue;
+        cout << (first ? "" : ", ") << "\"" << kBucketNames[b]
+             << "\":{ \"allocs\":" << (double)counts.allocs[b] / calls
+             << ", \"bytes\":" << (double)counts.bytes[b] / calls
+             << ", \"frees\":" << (double)counts.frees[b] / calls << " }";
+        first = false;
+    }
+    cout << " } }";
+}
+
+static bool overTarget(const AllocCounts& counts, uint64_t calls) {
+    return max_allocs >= 0 && counts.totalAllocs() > uint64_t(max_allocs) * calls;
+}
+
+// Returns false if the client or the server went over -max_allocs.
+static bool runSize(const sp<IBenchmark>& service, Pipe* server, size_t size, bool first) {
+    hidl_vec<uint8_t> data;
+    data.resize(size);
+    for (int i = 0; i < warmup; i++) {
+        ASSERT(service->sendVec(data, [&](const auto&) {}).isOk());
+    }
+
+    server->send(RESET);
+    server->wait();
+    resetCounts();
+    for (int i = 0; i < iterations; i++) {
+        setThreadPhase(threadPhase() | kInCall);
+        bool ok = service->sendVec(data, [&](const auto&) {}).isOk();
+        setThreadPhase(threadPhase() & ~kInCall);
+        ASSERT(ok);
+    }
+    AllocCounts client = readCounts();
+    AllocCounts served;
+    server->send(REPORT);
+    ASSERT(server->recv(served) == sizeof(served));
+    ASSERT(served.served > 0);
+
+    cout << (first ? "" : ",\n") << "  { \"size\":" << size << ", \"calls\":" << iterations
+         << ", \"served\":" << served.served << ",\n    \"client\":";
+    dumpCounts(client, iterations);
+    cout << ",\n    \"server\":";
+    dumpCounts(served, served.served);
+    cout << " }";
+    return !overTarget(client, iterations) && !overTarget(served, served.served);
+}
+
+static void serverFx(Pipe p) {
+    startCounting();
+    sp<IBenchmark> server = IBenchmark::getService(kServiceName, true);
+    ASSERT(server != nullptr);
+    if (server->registerAsService(kServiceName) != android::OK) {
+        ALOGE("Failed to register service %s", kServiceName);
+        exit(EXIT_FAILURE);
+    }
+    p.signal();
+    while (true) {
+        Command command;
+        if (p.recv(command) != sizeof(command) || command == EXIT) break;
+        if (command == RESET) {
+            resetCounts();
+            p.signal();
+        } else {
+            p.send(readCounts());
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-sizes 0,64,4096,65536    # payload bytes of sendVec()" << endl;
+    cout << "-i 1000                   # measured calls per size" << endl;
+    cout << "-warmup 20                # calls before measuring" << endl;
+    cout << "-max_allocs N             # fail above N allocations per call" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-sizes") {
+            payload_sizes = parseList(argv[++i]);
+        } else if (arg == "-i") {
+            iterations = atoi(argv[++i]);
+        } else if (arg == "-warmup") {
+            warmup = atoi(argv[++i]);
+        } else if (arg == "-max_allocs") {
+            max_allocs = atol(argv[++i]);
+        } else {
+            help();
+        }
+    }
+    ASSERT(iterations > 0);
+    ASSERT(warmup >= 0);
+
+    auto pipe_pair = Pipe::createPipePair();
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+        serverFx(move(get<1>(pipe_pair)));
+    }
+    Pipe& server_pipe = get<0>(pipe_pair);
+    server_pipe.wait();
+
+    startCounting();
+    sp<IBenchmark> service = IBenchmark::getService(kServiceName);
+    ASSERT(service != nullptr && service->isRemote());
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"iterations\":" << iterations << ",\"warmup\":" << warmup
+         << ",\"max_allocs\":" << max_allocs << "}," << endl;
+    cout << "\"sizes\":[" << endl;
+    bool pass = true;
+    bool first = true;
+    for (size_t size : payload_sizes) {
+        pass &= runSize(service, &server_pipe, size, first);
+        cout.flush();
+        first = false;
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    if (max_allocs >= 0) {
+        cout << "alloc: " << (pass ? "PASS" : "FAIL") << endl;
+    }
+
+    server_pipe.send(EXIT);
+    waitpid(pid, nullptr, 0);
+    return pass ? 0 : 1;
+}
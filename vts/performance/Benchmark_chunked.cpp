@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Moves payloads through BpHwBinder::transactChunked() to a forked server
+// and checks that they arrive intact:
+//
+//   echo:   a synchronous call whose reply is the request. Requests over
+//           64KB go out in pieces, and replies over 64KB are read back
+//           piece by piece.
+//   oneway: a oneway call, all of whose pieces and the commit are oneway.
+//           The server keeps a checksum of what it got, which the client
+//           then asks for.
+//
+// Several client processes run at once, so that their transfers overlap
+// on the server. The server is the IBenchmark test HAL, with a stub that
+// also answers the codes above, put in the stub constructor map the way
+// generated code registers its own stub.
+//
+// It prints the time per echo for every size and ends with
+// "chunked: PASS" if every transfer came back intact.
+//
+//  libhwbinder_chunked -sizes 16,65537,200000,4194304 -clients 2 -i 4
+
+#define LOG_TAG "libhwbinder_chunked"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/BnHwBenchmark.h>
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/BpHwBinder.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+
+#include "PerfTest.h"
+
+using android::BAD_VALUE;
+using android::OK;
+using android::WOULD_BLOCK;
+using android::sp;
+using android::status_t;
+using android::hardware::BHwBinder;
+using android::hardware::BpHwBinder;
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::ProcessState;
+using android::hardware::toBinder;
+using android::hardware::tests::libhwbinder::V1_0::BnHwBenchmark;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using std::atomic;
+using std::cout;
+using std::endl;
+using std::move;
+using std::string;
+using std::vector;
+
+static const char kServiceName[] = "libhwbinder_chunked";
+// not methods of IBenchmark
+static const uint32_t kEchoCode = 0x00ffff01;
+static const uint32_t kSumCode = 0x00ffff02;      // remembers the checksum of a payload
+static const uint32_t kLastSumCode = 0x00ffff03;  // returns it
+static const uint32_t kMaxClients = 64;
+// how long a oneway transfer may take to show up on the server
+static const int kOnewayWaitMs = 5000;
+
+// default arguments
+static vector<size_t> payload_sizes = {16, 65536, 65537, 200000, 1048576, 4194304};
+static int iterations = 4;
+static int client_count = 2;
+
+// What a client sends back to the parent for one size.
+struct SizeResult {
+    uint64_t echoNs;
+    uint32_t echoFailures;
+    uint32_t onewayFailures;
+};
+
+// FNV-1a
+static uint64_t checksum(const uint8_t* bytes, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// last checksum of a kSumCode transfer, per client
+static atomic<uint64_t> sums[kMaxClients];
+
+class ChunkedStub : public BnHwBenchmark {
+   public:
+    explicit ChunkedStub(const sp<IBenchmark>& impl) : BnHwBenchmark(impl) {}
+
+    status_t onTransact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags,
+                        TransactCallback callback) override {
+        uint32_t client;
+        switch (code) {
+            case kEchoCode:
+                return reply->writeUnpadded(data.data(), data.dataSize());
+            case kSumCode:
+                if (data.readUint32(&client) != OK || client >= kMaxClients) return BAD_VALUE;
+                sums[client] = checksum(data.data(), data.dataSize());
+                return OK;
+            case kLastSumCode:
+                if (data.readUint32(&client) != OK || client >= kMaxClients) return BAD_VALUE;
+                return reply->writeUint64(sums[client]);
+        }
+        return BnHwBenchmark::onTransact(code, data, reply, flags, callback);
+    }
+};
+
+// Runs in the server before the stub is registered.
+static void setupServer(BHwBinder* stub) {
+    ASSERT(ProcessState::self()->setThreadPoolConfiguration(4, true) == OK);
+    ProcessState::self()->startThreadPool();
+    size_t max_size = 0;
+    for (size_t size : payload_sizes) max_size = std::max(max_size, size);
+    stub->setMaxChunkedSize(max_size);
+}
+
+static bool waitForSum(const sp<IBinder>& binder, uint32_t index, uint64_t expected) {
+    for (int ms = 0; ms < kOnewayWaitMs; ms++) {
+        Parcel query, reply;
+        uint64_t sum;
+        if (query.writeUint32(index) != OK || binder->transact(kLastSumCode, query, &reply) != OK ||
+            reply.readUint64(&sum) != OK) {
+            return false;
+        }
+        if (sum == expected) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+// The server takes a few transfers per uid at once, and all the clients
+// run as the same uid, so a transfer may have to wait for a slot.
+static status_t transactChunked(BpHwBinder* proxy, uint32_t code, const Parcel& data,
+                                Parcel* reply, uint32_t flags = 0) {
+    status_t err = proxy->transactChunked(code, data, reply, flags);
+    for (int ms = 0; err == WOULD_BLOCK && ms < kOnewayWaitMs; ms++) {
+        usleep(1000);
+        err = proxy->transactChunked(code, data, reply, flags);
+    }
+    return err;
+}
+
+static void clientFx(uint32_t index, Pipe p) {
+    sp<IBenchmark> service = IBenchmark::getService(kServiceName);
+    ASSERT(service != nullptr && service->isRemote());
+    sp<IBinder> binder = toBinder<IBenchmark>(service);
+    BpHwBinder* proxy = binder->remoteBinder();
+    ASSERT(proxy != nullptr);
+    // tell main I'm init-ed and wait for kick-off
+    p.signal();
+    p.wait();
+
+    for (size_t size : payload_sizes) {
+        SizeResult result = {};
+        vector<uint8_t> payload(size);
+        for (size_t i = 0; i < size; i++) payload[i] = i * 131 + index;
+        memcpy(payload.data(), &index, sizeof(index));
+
+        for (int i = 0; i < iterations; i++) {
+            // no two transfers of a client alike, so that a stale checksum
+            // can't pass for the current one
+            memcpy(payload.data() + sizeof(index), &i, sizeof(i));
+            Parcel data, reply;
+            ASSERT(data.writeUnpadded(payload.data(), size) == OK);
+
+            Tick sta, end;
+            TICK_NOW(sta);
+            status_t err = transactChunked(proxy, kEchoCode, data, &reply);
+            TICK_NOW(end);
+            result.echoNs += tickDiffNS(sta, end);
+            if (err != OK || reply.dataSize() != size ||
+                memcmp(reply.data(), payload.data(), size) != 0) {
+                cout << "# client " << index << ": echo of " << size << " bytes failed, err "
+                     << err << ", " << reply.dataSize() << " bytes back" << endl;
+                result.echoFailures++;
+            }
+
+            err = transactChunked(proxy, kSumCode, data, nullptr, IBinder::FLAG_ONEWAY);
+            if (err != OK || !waitForSum(binder, index, checksum(payload.data(), size))) {
+                cout << "# client " << index << ": oneway " << size << " bytes failed, err "
+                     << err << endl;
+                result.onewayFailures++;
+            }
+        }
+        ASSERT(p.send(result) >= 0);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-sizes 16,65536,65537,200000,1048576,4194304  # payload bytes, at least 8" << endl;
+    cout << "-i 4                                          # transfers per client and size"
+         << endl;
+    cout << "-clients 2                                    # client processes at once" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-sizes") {
+            payload_sizes = parseList(argv[++i]);
+        } else if (arg == "-i") {
+            iterations = atoi(argv[++i]);
+        } else if (arg == "-clients") {
+            client_count = atoi(argv[++i]);
+        } else {
+            help();
+        }
+    }
+    for (size_t size : payload_sizes) ASSERT(size >= 2 * sizeof(uint32_t));
+    ASSERT(iterations > 0);
+    ASSERT(client_count > 0 && uint32_t(client_count) <= kMaxClients);
+
+    pid_t server;
+    Pipe server_pipe = forkStubServer<ChunkedStub>(kServiceName, &server, setupServer);
+    server_pipe.wait();
+
+    vector<Pipe> clients;
+    for (int i = 0; i < client_count; i++) {
+        pid_t pid;
+        clients.push_back(forkChild([i](Pipe p) { clientFx(i, move(p)); }, &pid));
+    }
+    for (auto& c : clients) c.wait();
+    for (auto& c : clients) c.signal();
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"iterations\":" << iterations << ",\"clients\":" << client_count << "},"
+         << endl;
+    cout << "\"sizes\":[" << endl;
+    bool pass = true;
+    bool first = true;
+    for (size_t size : payload_sizes) {
+        SizeResult total = {};
+        for (auto& c : clients) {
+            SizeResult result;
+            ASSERT(c.recv(result) >= 0);
+            total.echoNs += result.echoNs;
+            total.echoFailures += result.echoFailures;
+            total.onewayFailures += result.onewayFailures;
+        }
+        uint64_t transfers = uint64_t(iterations) * client_count;
+        cout << (first ? "" : ",\n") << "  { \"size\":" << size << ", \"transfers\":" << transfers
+             << ", \"echo_ms\":" << total.echoNs / 1.0E6 / transfers
+             << ", \"echo_failures\":" << total.echoFailures
+             << ", \"oneway_failures\":" << total.onewayFailures << " }";
+        cout.flush();
+        pass &= total.echoFailures == 0 && total.onewayFailures == 0;
+        first = false;
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    cout << "chunked: " << (pass ? "PASS" : "FAIL") << endl;
+
+    // only the clients have exited so far
+    for (int i = 0; i < client_count; i++) {
+        wait(nullptr);
+    }
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// libhwbinder (HIDL) against libbinder (AIDL) on the same workload, so
+// that their numbers can be compared directly, which those of
+// libhwbinder_benchmark and libbinder_benchmark can't.
+//
+// Both stacks get a server process of their own, set up the same way:
+// |server_threads| threads in the pool, the main thread being one of them,
+// and the driver allowed to ask for the rest. The same client processes
+// then call both, for every payload and size in the same order and with
+// the same warm-up, alternating between the stacks so that drift in the
+// device hits them alike. Payloads:
+//
+//   vec:  sendVec() of |size| bytes through the generated code, which
+//         sends them there and back.
+//   flat: |size| bytes written into a Parcel as one block and sent with a
+//         raw transaction, which the server rejects unread. No generated
+//         code is involved, only Parcel and the IPC path.
+//   sg:   the same bytes in |chunks| pieces, the way each stack sends a
+//         vector of vectors: hwbinder as a tree of buffer objects that the
+//         driver gathers, binder as length-prefixed arrays inline in the
+//         Parcel. Also a raw transaction.
+//
+// Every cell reports the latency histogram of both stacks in us and their
+// ratio, hidl over aidl, so values above 1 are where hwbinder is slower.
+//
+//  libhwbinder_compare -payloads vec,flat,sg -sizes 16,4096 -i 10000
+
+#define LOG_TAG "libhwbinder_compare"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <android/tests/binder/BnBenchmark.h>
+#include <android/tests/binder/IBenchmark.h>
+#include <binder/IPCThreadState.h>
+#include <binder/IServiceManager.h>
+#include <binder/Parcel.h>
+#include <binder/ProcessState.h>
+#include <hidl/HidlBinderSupport.h>
+#include <hidl/HidlSupport.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/IPCThreadState.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+#include <log/log.h>
+#include <utils/String16.h>
+
+#include "Histogram.h"
+#include "PerfTest.h"
+
+// libutils:
+using android::OK;
+using android::sp;
+using android::status_t;
+using android::String16;
+using android::UNKNOWN_TRANSACTION;
+
+// libhidl:
+using android::hardware::hidl_vec;
+using android::hardware::toBinder;
+using android::hardware::writeEmbeddedToParcel;
+
+// libbinder:
+using android::binder::Status;
+
+// Standard library
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::get;
+using std::move;
+using std::string;
+using std::vector;
+
+// Both stacks name their classes alike.
+typedef android::hardware::IBinder HwIBinder;
+typedef android::hardware::IPCThreadState HwIPCThreadState;
+typedef android::hardware::Parcel HwParcel;
+typedef android::hardware::ProcessState HwProcessState;
+
+// Generated HIDL and AIDL files
+typedef android::hardware::tests::libhwbinder::V1_0::IBenchmark IHidlBenchmark;
+typedef android::tests::binder::IBenchmark IAidlBenchmark;
+using android::tests::binder::BnBenchmark;
+
+static const char kServiceName[] = "libhwbinder_compare";
+// not a method of either IBenchmark
+static const uint32_t kRawCode = 0x00ffffff;
+
+enum class Stack { HIDL, AIDL };
+enum class Payload { VEC, FLAT, SG };
+
+static const char* const kPayloadNames[] = {"vec", "flat", "sg"};
+
+struct Cell {
+    Stack stack;
+    Payload payload;
+    size_t size;
+};
+
+// default arguments
+static vector<Payload> payloads = {Payload::VEC, Payload::FLAT, Payload::SG};
+static vector<size_t> payload_sizes = {16, 256, 4096, 65536};
+static int iterations = 10000;
+static int warmup = 100;
+static int client_count = 1;
+static int server_threads = 1;
+static size_t chunk_count = 8;
+
+// the schedule every client runs, built before forking
+static vector<Cell> cells;
+
+// chunk |i| of |size| bytes split into chunk_count pieces
+static size_t chunkSize(size_t size, size_t i) {
+    return size / chunk_count + (i < size % chunk_count ? 1 : 0);
+}
+
+class HidlStack {
+   public:
+    explicit HidlStack(const sp<IHidlBenchmark>& service)
+        : service_(service), binder_(toBinder<IHidlBenchmark>(service)) {}
+
+    void prepare(size_t size) {
+        flat_.resize(size);
+        for (size_t i = 0; i < size; i++) flat_[i] = i;
+        chunks_.resize(chunk_count);
+        for (size_t i = 0; i < chunk_count; i++) {
+            chunks_[i].resize(chunkSize(size, i));
+            for (size_t j = 0; j < chunks_[i].size(); j++) chunks_[i][j] = j;
+        }
+    }
+
+    bool call(Payload payload) {
+        HwParcel data, reply;
+        status_t err = OK;
+        switch (payload) {
+            case Payload::VEC:
+                return service_->sendVec(flat_, [](const auto&) {}).isOk();
+            case Payload::FLAT:
+                err = data.write(flat_.data(), flat_.size());
+                break;
+            case Payload::SG: {
+                size_t parent, child, grandchild;
+                err = data.writeBuffer(&chunks_, sizeof(chunks_), &parent);
+                if (err == OK) err = writeEmbeddedToParcel(chunks_, &data, parent, 0, &child);
+                for (size_t i = 0; err == OK && i < chunks_.size(); i++) {
+                    err = writeEmbeddedToParcel(chunks_[i], &data, child,
+                                                i * sizeof(hidl_vec<uint8_t>), &grandchild);
+                }
+                break;
+            }
+        }
+        return err == OK && binder_->transact(kRawCode, data, &reply) == UNKNOWN_TRANSACTION;
+    }
+
+   private:
+    sp<IHidlBenchmark> service_;
+    sp<HwIBinder> binder_;
+    hidl_vec<uint8_t> flat_;
+    hidl_vec<hidl_vec<uint8_t>> chunks_;
+};
+
+class AidlStack {
+   public:
+    explicit AidlStack(const sp<IAidlBenchmark>& service)
+        : service_(service), binder_(android::IInterface::asBinder(service)) {}
+
+    void prepare(size_t size) {
+        flat_.resize(size);
+        for (size_t i = 0; i < size; i++) flat_[i] = i;
+        chunks_.resize(chunk_count);
+        for (size_t i = 0; i < chunk_count; i++) {
+            chunks_[i].resize(chunkSize(size, i));
+            for (size_t j = 0; j < chunks_[i].size(); j++) chunks_[i][j] = j;
+        }
+    }
+
+    bool call(Payload payload) {
+        android::Parcel data, reply;
+        status_t err = OK;
+        switch (payload) {
+            case Payload::VEC:
+                return service_->sendVec(flat_, &echo_).isOk();
+            case Payload::FLAT:
+                err = data.write(flat_.data(), flat_.size());
+                break;
+            case Payload::SG:
+                // what AIDL generates for byte[][]
+                err = data.writeInt32(chunks_.size());
+                for (size_t i = 0; err == OK && i < chunks_.size(); i++) {
+                    err = data.writeByteVector(chunks_[i]);
+                }
+                break;
+        }
+        return err == OK && binder_->transact(kRawCode, data, &reply) == UNKNOWN_TRANSACTION;
+    }
+
+   private:
+    sp<IAidlBenchmark> service_;
+    sp<android::IBinder> binder_;
+    vector<uint8_t> flat_;
+    vector<uint8_t> echo_;
+    vector<vector<uint8_t>> chunks_;
+};
+
+class AidlBenchmarkService : public BnBenchmark {
+   public:
+    Status sendVec(const vector<uint8_t>& data, vector<uint8_t>* _aidl_return) override {
+        *_aidl_return = data;
+        return Status::ok();
+    }
+};
+
+// The main thread joins the pool, so it is one of the |server_threads|,
+// and the driver may ask for the others. Both servers end up with the
+// same threads, spawned the same way.
+static void hidlServerFx(Pipe p) {
+    sp<HwProcessState> process = HwProcessState::self();
+    ASSERT(process->setThreadPoolConfiguration(server_threads, true) == OK);
+    process->startThreadPool();
+
+    sp<IHidlBenchmark> service = IHidlBenchmark::getService(kServiceName, true);
+    ASSERT(service != nullptr);
+    if (service->registerAsService(kServiceName) != OK) {
+        ALOGE("Failed to register service %s", kServiceName);
+        exit(EXIT_FAILURE);
+    }
+    p.signal();
+    // killed by the parent once all cells are done
+    HwIPCThreadState::self()->joinThreadPool();
+    exit(EXIT_FAILURE);
+}
+
+static void aidlServerFx(Pipe p) {
+    sp<android::ProcessState> process = android::ProcessState::self();
+    // startThreadPool() spawns one thread on top of what the driver may
+    // ask for, as setThreadPoolConfiguration() does above.
+    ASSERT(process->setThreadPoolMaxThreadCount(server_threads > 1 ? server_threads - 2 : 0) ==
+           OK);
+    if (server_threads > 1) {
+        process->startThreadPool();
+    }
+
+    sp<AidlBenchmarkService> service = new AidlBenchmarkService();
+    ASSERT(android::defaultServiceManager()->addService(String16(kServiceName), service) == OK);
+    p.signal();
+    android::IPCThreadState::self()->joinThreadPool();
+    exit(EXIT_FAILURE);
+}
+
+template <typename S>
+static void measure(S& stack, const Cell& cell, LatencyHistogram* latency) {
+    stack.prepare(cell.size);
+    for (int i = 0; i < warmup; i++) {
+        ASSERT(stack.call(cell.payload));
+    }
+    Tick sta, end;
+    for (int i = 0; i < iterations; i++) {
+        TICK_NOW(sta);
+        bool ok = stack.call(cell.payload);
+        TICK_NOW(end);
+        ASSERT(ok);
+        latency->record(tickDiffNS(sta, end));
+    }
+}
+
+static void clientFx(Pipe p) {
+    sp<IHidlBenchmark> hidl = IHidlBenchmark::getService(kServiceName);
+    ASSERT(hidl != nullptr && hidl->isRemote());
+    sp<IAidlBenchmark> aidl;
+    // getService() retries
+    ASSERT(android::getService(String16(kServiceName), &aidl) == OK && aidl != nullptr);
+    HidlStack hidlStack(hidl);
+    AidlStack aidlStack(aidl);
+    // tell main I'm init-ed
+    p.signal();
+
+    for (const Cell& cell : cells) {
+        // wait for kick-off
+        p.wait();
+        LatencyHistogram latency;
+        if (cell.stack == Stack::HIDL) {
+            measure(hidlStack, cell, &latency);
+        } else {
+            measure(aidlStack, cell, &latency);
+        }
+        ASSERT(p.send(latency) >= 0);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static void dumpCell(const Cell& cell, const LatencyHistogram& hidl,
+                     const LatencyHistogram& aidl, bool first) {
+    cout << (first ? "" : ",\n") << "  { \"payload\":\"" << kPayloadNames[int(cell.payload)]
+         << "\", \"size\":" << cell.size << "," << endl;
+    cout << "    \"hidl\":";
+    hidl.dumpJson(cout, 1.0E3);
+    cout << "," << endl << "    \"aidl\":";
+    aidl.dumpJson(cout, 1.0E3);
+    cout << "," << endl
+         << "    \"hidl_over_aidl\":{ \"avg\":" << hidl.mean() / aidl.mean()
+         << ", \"p50\":" << (double)hidl.percentile(50) / aidl.percentile(50)
+         << ", \"p99\":" << (double)hidl.percentile(99) / aidl.percentile(99) << " } }";
+}
+
+static vector<Payload> parsePayloads(const char* arg) {
+    vector<Payload> values;
+    std::istringstream in(arg);
+    string item;
+    while (getline(in, item, ',')) {
+        size_t i = 0;
+        while (i < 3 && item != kPayloadNames[i]) i++;
+        ASSERT(i < 3);
+        values.push_back(Payload(i));
+    }
+    return values;
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-payloads vec,flat,sg     # see the top of Benchmark_compare.cpp" << endl;
+    cout << "-sizes 16,256,4096,65536  # payload sizes in bytes" << endl;
+    cout << "-i 10000                  # measured calls per client, stack and cell" << endl;
+    cout << "-warmup 100               # calls before measuring" << endl;
+    cout << "-clients 1                # client processes calling at once" << endl;
+    cout << "-server_threads 1         # thread pool size of both servers" << endl;
+    cout << "-chunks 8                 # pieces of an sg payload" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-payloads") {
+            payloads = parsePayloads(argv[++i]);
+        } else if (arg == "-sizes") {
+            payload_sizes = parseList(argv[++i]);
+        } else if (arg == "-i") {
+            iterations = atoi(argv[++i]);
+        } else if (arg == "-warmup") {
+            warmup = atoi(argv[++i]);
+        } else if (arg == "-clients") {
+            client_count = atoi(argv[++i]);
+        } else if (arg == "-server_threads") {
+            server_threads = atoi(argv[++i]);
+        } else if (arg == "-chunks") {
+            chunk_count = strtoul(argv[++i], nullptr, 0);
+        } else {
+            help();
+        }
+    }
+    ASSERT(iterations > 0 && warmup >= 0);
+    ASSERT(client_count > 0 && server_threads > 0 && chunk_count > 0);
+
+    // hidl right before aidl for every payload and size
+    for (Payload payload : payloads) {
+        for (size_t size : payload_sizes) {
+            cells.push_back({Stack::HIDL, payload, size});
+            cells.push_back({Stack::AIDL, payload, size});
+        }
+    }
+
+    vector<pid_t> servers;
+    for (auto serverFx : {hidlServerFx, aidlServerFx}) {
+        pid_t pid;
+        Pipe server = forkChild(serverFx, &pid);
+        server.wait();
+        servers.push_back(pid);
+    }
+
+    vector<Pipe> clients;
+    for (int i = 0; i < client_count; i++) {
+        clients.push_back(forkChild(clientFx));
+    }
+    for (auto& c : clients) c.wait();
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"iterations\":" << iterations << ",\"warmup\":" << warmup
+         << ",\"clients\":" << client_count << ",\"server_threads\":" << server_threads
+         << ",\"chunks\":" << chunk_count << "}," << endl;
+    cout << "\"cells\":[" << endl;
+    LatencyHistogram hidl;
+    bool first = true;
+    for (const Cell& cell : cells) {
+        for (auto& c : clients) c.signal();
+        LatencyHistogram total;
+        for (auto& c : clients) {
+            LatencyHistogram latency;
+            ASSERT(c.recv(latency) >= 0);
+            total.add(latency);
+        }
+        if (cell.stack == Stack::HIDL) {
+            hidl = total;
+        } else {
+            dumpCell(cell, hidl, total, first);
+            cout.flush();
+            first = false;
+        }
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+
+    // only the clients have exited so far
+    for (int i = 0; i < client_count; i++) {
+        wait(nullptr);
+    }
+    for (pid_t server : servers) {
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// File descriptors in native handles, which go out as a buffer object and
+// a BINDER_TYPE_FDA fd array object each. N fds are sent two ways:
+//
+//   Single:  N native handles of one fd, written one at a time
+//   Batched: one native handle of N fds
+//
+// and measured four ways, each reporting items (fds) per second, so that
+// the time per fd is the inverse:
+//
+//   BM_write:   writing them into a Parcel (send side, user space)
+//   BM_read:    reading them back in-process (receive side, user space)
+//   BM_keep:    reading them and keeping the fds the way a receiver that
+//               holds on to a handle does, native_handle_clone(), then
+//               closing and deleting the clones (receive side with close)
+//   BM_send:    one call carrying them to a remote service. This covers
+//               the kernel: looking up every fd in the sender, installing
+//               it in the receiver, and closing it there once the buffer
+//               is freed. The test HAL has no method taking handles, so
+//               this is a raw transaction with a code the server rejects.
+//
+// With -local only the in-process benchmarks are run and no service is
+// started.
+
+#define LOG_TAG "libhwbinder_fd_benchmark"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <benchmark/benchmark.h>
+#include <cutils/native_handle.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/Parcel.h>
+#include <log/log.h>
+
+// libutils:
+using android::OK;
+using android::sp;
+using android::status_t;
+
+// libhidl:
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::toBinder;
+
+// Standard library
+using std::string;
+using std::vector;
+
+// Generated HIDL files
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+
+static const char gServiceName[] = "libhwbinder_fd_benchmark";
+// not a method of IBenchmark
+static const uint32_t kRawCode = 0x00ffffff;
+
+// N distinct fds, the arg of the benchmark, owned by the shapes below
+class Fds {
+   public:
+    explicit Fds(const benchmark::State& state) {
+        for (int i = 0; i < state.range(0); i++) {
+            fds_.push_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+        }
+    }
+    ~Fds() {
+        for (int fd : fds_) close(fd);
+    }
+    const vector<int>& get() const { return fds_; }
+
+   private:
+    vector<int> fds_;
+};
+
+// one native handle per fd
+struct Single {
+    Fds fds;
+    vector<native_handle_t*> handles;
+
+    explicit Single(const benchmark::State& state) : fds(state) {
+        for (int fd : fds.get()) {
+            native_handle_t* handle = native_handle_create(1, 0);
+            handle->data[0] = fd;
+            handles.push_back(handle);
+        }
+    }
+    ~Single() {
+        for (native_handle_t* handle : handles) native_handle_delete(handle);
+    }
+    status_t write(Parcel* parcel) const {
+        status_t err = OK;
+        for (size_t i = 0; err == OK && i < handles.size(); i++) {
+            err = parcel->writeNativeHandleNoDup(handles[i]);
+        }
+        return err;
+    }
+    // reads every handle and passes it to |fn|
+    template <typename F>
+    status_t read(const Parcel& parcel, F fn) const {
+        status_t err = OK;
+        for (size_t i = 0; err == OK && i < handles.size(); i++) {
+            const native_handle_t* handle;
+            err = parcel.readNativeHandleNoDup(&handle);
+            if (err == OK) fn(handle);
+        }
+        return err;
+    }
+};
+
+// all the fds in one native handle
+struct Batched {
+    Fds fds;
+    native_handle_t* handle;
+
+    explicit Batched(const benchmark::State& state) : fds(state) {
+        handle = native_handle_create(fds.get().size(), 0);
+        for (size_t i = 0; i < fds.get().size(); i++) handle->data[i] = fds.get()[i];
+    }
+    ~Batched() { native_handle_delete(handle); }
+    status_t write(Parcel* parcel) const { return parcel->writeNativeHandleNoDup(handle); }
+    template <typename F>
+    status_t read(const Parcel& parcel, F fn) const {
+        const native_handle_t* received;
+        status_t err = parcel.readNativeHandleNoDup(&received);
+        if (err == OK) fn(received);
+        return err;
+    }
+};
+
+template <typename Shape>
+static void BM_write(benchmark::State& state) {
+    Shape shape(state);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        if (shape.write(&parcel) != OK) {
+            state.SkipWithError("write failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Shape>
+static void BM_read(benchmark::State& state) {
+    Shape shape(state);
+    Parcel parcel;
+    if (shape.write(&parcel) != OK) {
+        state.SkipWithError("write failed");
+        return;
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        if (shape.read(parcel, [](const native_handle_t*) {}) != OK) {
+            state.SkipWithError("read failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Shape>
+static void BM_keep(benchmark::State& state) {
+    Shape shape(state);
+    Parcel parcel;
+    if (shape.write(&parcel) != OK) {
+        state.SkipWithError("write failed");
+        return;
+    }
+    vector<native_handle_t*> kept;
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        status_t err = shape.read(parcel, [&kept](const native_handle_t* handle) {
+            kept.push_back(native_handle_clone(handle));
+        });
+        for (native_handle_t* handle : kept) {
+            if (handle == nullptr) {
+                err = android::NO_MEMORY;
+                continue;
+            }
+            native_handle_close(handle);
+            native_handle_delete(handle);
+        }
+        kept.clear();
+        if (err != OK) {
+            state.SkipWithError("read or clone failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename Shape>
+static void BM_send(benchmark::State& state) {
+    sp<IBenchmark> service = IBenchmark::getService(gServiceName);
+    if (service == nullptr || !service->isRemote()) {
+        state.SkipWithError("Failed to retrieve remote benchmark service.");
+        return;
+    }
+    sp<IBinder> binder = toBinder<IBenchmark>(service);
+    Shape shape(state);
+    Parcel data;
+    if (shape.write(&data) != OK) {
+        state.SkipWithError("write failed");
+        return;
+    }
+    while (state.KeepRunning()) {
+        Parcel reply;
+        if (binder->transact(kRawCode, data, &reply) != android::UNKNOWN_TRANSACTION) {
+            state.SkipWithError("transact failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// 1, 4, 16, 64 and 256 fds
+static void fdCounts(benchmark::internal::Benchmark* b) {
+    b->RangeMultiplier(4)->Range(1, 256);
+}
+
+#define FD_BENCHMARKS(shape)                                 \
+    BENCHMARK_TEMPLATE(BM_write, shape)->Apply(fdCounts);    \
+    BENCHMARK_TEMPLATE(BM_read, shape)->Apply(fdCounts);     \
+    BENCHMARK_TEMPLATE(BM_keep, shape)->Apply(fdCounts);     \
+    if (remote) {                                            \
+        BENCHMARK_TEMPLATE(BM_send, shape)->Apply(fdCounts); \
+    }
+
+static void registerBenchmarks(bool remote) {
+    FD_BENCHMARKS(Single);
+    FD_BENCHMARKS(Batched);
+}
+
+static void startServer() {
+    sp<IBenchmark> service = IBenchmark::getService(gServiceName, true);
+    if (service->registerAsService(gServiceName) != OK) {
+        ALOGE("Failed to register service %s.", gServiceName);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    bool remote = true;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "-local") {
+            remote = false;
+        }
+    }
+    registerBenchmarks(remote);
+    ::benchmark::Initialize(&argc, argv);
+
+    if (!remote) {
+        ::benchmark::RunSpecifiedBenchmarks();
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child, start benchmarks
+        ::benchmark::RunSpecifiedBenchmarks();
+    } else {
+        startServer();
+        while (true) {
+            int stat, retval;
+            retval = wait(&stat);
+            if (retval == -1 && errno == ECHILD) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stresses the handle table of ProcessState (mHandleToObject under mLock)
+// from many threads at once. For every handle count and thread count:
+//
+// create:  every thread makes proxies for its share of the handles with
+//          getStrongProxyForHandle() and keeps them.
+// lookup:  getStrongProxyForHandle() of random handles that have a proxy.
+// promote: getWeakProxyForHandle() of random handles, then promote().
+// destroy: the proxies are dropped, and BpHwBinder's destructor calls
+//          expungeHandle().
+// churn:   with no proxy kept, random handles are fetched and dropped, so
+//          every lookup creates a proxy and every drop expunges it.
+//
+// Each phase reports its rate and the time threads spent waiting for
+// mLock, and the create phase the memory the table and the proxies hold.
+//
+// The handles are made up: this process never asks the driver for any, so
+// the refcount commands the proxies queue for them are rejected by the
+// driver (which only logs it) when the threads flush them. Those flushes
+// happen every kFlushBatch operations, like a looper thread flushes after
+// every command.
+//
+//  libhwbinder_handles -handles 10,1000,100000 -threads 1,4,16 -ops 20000
+
+#define LOG_TAG "libhwbinder_handles"
+
+#include <malloc.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hwbinder/IPCThreadState.h>
+#include <hwbinder/ProcessState.h>
+
+#include "PerfTest.h"
+
+using android::sp;
+using android::wp;
+using android::hardware::IBinder;
+using android::hardware::IPCThreadState;
+using android::hardware::ProcessState;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+
+typedef ProcessState::HandleTableStats HandleTableStats;
+
+// Handle 0 is the context manager, which the driver would take for real.
+static const int32_t kFirstHandle = 1;
+static const int kFlushBatch = 64;
+
+// default arguments
+static vector<size_t> handle_counts = {10, 100, 1000, 10000, 100000};
+static vector<size_t> thread_counts = {1, 4, 16};
+static size_t ops_per_thread = 20000;
+
+// xorshift64, so that picking a handle costs next to nothing
+class Random {
+   public:
+    explicit Random(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ull + 1) {}
+    int32_t handle(size_t count) {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        return kFirstHandle + state_ % count;
+    }
+
+   private:
+    uint64_t state_;
+};
+
+static size_t heapBytes() {
+    return mallinfo().uordblks;
+}
+
+// Runs fn(index) on |threads| threads at once and returns the wall time
+// in ns, from the first start to the last finish.
+template <typename F>
+static uint64_t runThreads(size_t threads, F fn) {
+    vector<thread> pool;
+    Tick sta, end;
+    TICK_NOW(sta);
+    for (size_t i = 0; i < threads; i++) {
+        pool.emplace_back(fn, i);
+    }
+    for (auto& t : pool) t.join();
+    TICK_NOW(end);
+    return tickDiffNS(sta, end);
+}
+
+static void dumpPhase(const char* name, uint64_t ops, uint64_t ns) {
+    HandleTableStats stats = ProcessState::self()->getHandleTableStats();
+    cout << ", \"" << name << "\":{ \"ops_per_sec\":" << uint64_t(ops / (ns / 1.0E9))
+         << ", \"lock_contentions\":" << stats.lockContentions
+         << ", \"lock_wait_ns_per_op\":" << (double)stats.lockWaitNs / ops << " }";
+}
+
+static void runCell(size_t count, size_t threads, bool first) {
+    sp<ProcessState> process = ProcessState::self();
+    vector<sp<IBinder>> proxies(count);
+    // thread i owns handles [slice(i), slice(i + 1))
+    auto slice = [&](size_t i) { return count * i / threads; };
+
+    cout << (first ? "" : ",\n") << "  { \"handles\":" << count << ", \"threads\":" << threads;
+
+    size_t heap = heapBytes();
+    size_t table = process->getHandleTableStats().bytes;
+    process->resetHandleLockStats();
+    uint64_t ns = runThreads(threads, [&](size_t t) {
+        for (size_t i = slice(t); i < slice(t + 1); i++) {
+            proxies[i] = process->getStrongProxyForHandle(kFirstHandle + i);
+            ASSERT(proxies[i] != nullptr);
+            if (i % kFlushBatch == 0) IPCThreadState::self()->flushCommands();
+        }
+        IPCThreadState::self()->flushCommands();
+    });
+    HandleTableStats stats = process->getHandleTableStats();
+    ASSERT(stats.proxies >= count);
+    dumpPhase("create", count, ns);
+    cout << ", \"table_bytes\":" << stats.bytes << ", \"table_growth_bytes\":" << stats.bytes - table
+         << ", \"heap_bytes_per_proxy\":"
+         << ((double)heapBytes() - heap - (stats.bytes - table)) / count;
+
+    uint64_t ops = ops_per_thread * threads;
+    process->resetHandleLockStats();
+    ns = runThreads(threads, [&](size_t t) {
+        Random random(t);
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            sp<IBinder> proxy = process->getStrongProxyForHandle(random.handle(count));
+        }
+    });
+    dumpPhase("lookup", ops, ns);
+
+    process->resetHandleLockStats();
+    ns = runThreads(threads, [&](size_t t) {
+        Random random(t);
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            sp<IBinder> proxy = process->getWeakProxyForHandle(random.handle(count)).promote();
+            ASSERT(proxy != nullptr);
+        }
+    });
+    dumpPhase("promote", ops, ns);
+
+    process->resetHandleLockStats();
+    ns = runThreads(threads, [&](size_t t) {
+        for (size_t i = slice(t); i < slice(t + 1); i++) {
+            proxies[i].clear();
+            if (i % kFlushBatch == 0) IPCThreadState::self()->flushCommands();
+        }
+        IPCThreadState::self()->flushCommands();
+    });
+    dumpPhase("destroy", count, ns);
+    ASSERT(process->getHandleTableStats().proxies == 0);
+
+    process->resetHandleLockStats();
+    ns = runThreads(threads, [&](size_t t) {
+        Random random(t);
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            sp<IBinder> proxy = process->getStrongProxyForHandle(random.handle(count));
+            proxy.clear();
+            if (i % kFlushBatch == 0) IPCThreadState::self()->flushCommands();
+        }
+        IPCThreadState::self()->flushCommands();
+    });
+    dumpPhase("churn", ops, ns);
+    cout << " }";
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-handles 10,100,1000,10000,100000  # handles with a proxy" << endl;
+    cout << "-threads 1,4,16                    # concurrent threads" << endl;
+    cout << "-ops 20000                         # lookups per thread and phase" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-handles") {
+            handle_counts = parseList(argv[++i]);
+        } else if (arg == "-threads") {
+            thread_counts = parseList(argv[++i]);
+        } else if (arg == "-ops") {
+            ops_per_thread = strtoul(argv[++i], nullptr, 0);
+        } else {
+            help();
+        }
+    }
+    for (size_t n : handle_counts) ASSERT(n > 0);
+    for (size_t n : thread_counts) ASSERT(n > 0);
+    ASSERT(ops_per_thread > 0);
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"ops_per_thread\":" << ops_per_thread << ",\"flush_batch\":" << kFlushBatch
+         << "}," << endl;
+    cout << "\"cells\":[" << endl;
+    bool first = true;
+    for (size_t count : handle_counts) {
+        for (size_t threads : thread_counts) {
+            runCell(count, threads, first);
+            cout.flush();
+            first = false;
+        }
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    return 0;
+}
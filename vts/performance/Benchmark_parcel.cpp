@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "libhwbinder_parcel_benchmark"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <array>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ParcelTraits.h>
+
+// libhwbinder:
+using android::hardware::Parcel;
+
+// Standard library
+using std::string;
+using std::vector;
+
+// libutils:
+using android::NO_ERROR;
+using android::status_t;
+
+struct Record {
+    int32_t id;
+    string name;
+    vector<string> tags;
+    std::optional<std::array<uint64_t, 4>> digest;
+};
+
+static auto parcelFields(Record& r) {
+    return std::tie(r.id, r.name, r.tags, r.digest);
+}
+
+// What Parcel::write() of the same values is expected to produce.
+static void writeStringByHand(Parcel* p, const string& s) {
+    p->writeUint32(s.size());
+    p->write(s.data(), s.size());
+}
+
+static void writeRecordByHand(Parcel* p, const Record& r) {
+    p->writeInt32(r.id);
+    writeStringByHand(p, r.name);
+    p->writeUint32(r.tags.size());
+    for (const auto& tag : r.tags) writeStringByHand(p, tag);
+    p->writeBool(r.digest.has_value());
+    if (r.digest) {
+        for (uint64_t word : *r.digest) p->writeUint64(word);
+    }
+}
+
+static void writeRecordsByHand(Parcel* p, const vector<Record>& records) {
+    p->writeUint32(records.size());
+    for (const auto& r : records) writeRecordByHand(p, r);
+}
+
+static vector<Record> makeRecords(size_t count) {
+    vector<Record> records(count);
+    for (size_t i = 0; i < count; i++) {
+        Record& r = records[i];
+        r.id = i;
+        r.name = "record-" + std::to_string(i);
+        for (size_t t = 0; t < i % 5; t++) r.tags.push_back(string(t * 7 + 1, 'a' + t));
+        if (i % 2) r.digest = std::array<uint64_t, 4>{i, i * 3, i * 5, i * 7};
+    }
+    return records;
+}
+
+static vector<vector<string>> makeNested(size_t count) {
+    vector<vector<string>> nested(count);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < i % 8; j++) nested[i].push_back(string(j * 13 % 40, 'x'));
+    }
+    return nested;
+}
+
+static bool sameBytes(const Parcel& a, const Parcel& b) {
+    return a.dataSize() == b.dataSize() && memcmp(a.data(), b.data(), a.dataSize()) == 0;
+}
+
+// Checks that write() matches the hand-written calls and read() returns
+// what was written.
+static bool checkParcelTraits() {
+    for (size_t count : {0, 1, 7, 100}) {
+        const vector<Record> records = makeRecords(count);
+        Parcel traits, byHand;
+        if (traits.write(records) != NO_ERROR) return false;
+        writeRecordsByHand(&byHand, records);
+        if (!sameBytes(traits, byHand)) {
+            fprintf(stderr, "write() of %zu records differs from the hand-written calls\n", count);
+            return false;
+        }
+
+        vector<Record> readBack;
+        traits.setDataPosition(0);
+        if (traits.read(&readBack) != NO_ERROR || readBack.size() != records.size() ||
+                traits.dataAvail() != 0) {
+            fprintf(stderr, "read() of %zu records failed\n", count);
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (readBack[i].id != records[i].id || readBack[i].name != records[i].name ||
+                    readBack[i].tags != records[i].tags ||
+                    readBack[i].digest != records[i].digest) {
+                fprintf(stderr, "record %zu read back differently\n", i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void BM_writeRecords(benchmark::State& state) {
+    const vector<Record> records = makeRecords(state.range(0));
+    while (state.KeepRunning()) {
+        Parcel p;
+        p.write(records);
+        benchmark::DoNotOptimize(p.data());
+    }
+}
+BENCHMARK(BM_writeRecords)->RangeMultiplier(8)->Range(1, 4096);
+
+static void BM_writeRecordsByHand(benchmark::State& state) {
+    const vector<Record> records = makeRecords(state.range(0));
+    while (state.KeepRunning()) {
+        Parcel p;
+        writeRecordsByHand(&p, records);
+        benchmark::DoNotOptimize(p.data());
+    }
+}
+BENCHMARK(BM_writeRecordsByHand)->RangeMultiplier(8)->Range(1, 4096);
+
+static void BM_writeNestedStrings(benchmark::State& state) {
+    const vector<vector<string>> nested = makeNested(state.range(0));
+    while (state.KeepRunning()) {
+        Parcel p;
+        p.write(nested);
+        benchmark::DoNotOptimize(p.data());
+    }
+}
+BENCHMARK(BM_writeNestedStrings)->RangeMultiplier(8)->Range(1, 4096);
+
+static void BM_writeNestedStringsByHand(benchmark::State& state) {
+    const vector<vector<string>> nested = makeNested(state.range(0));
+    while (state.KeepRunning()) {
+        Parcel p;
+        p.writeUint32(nested.size());
+        for (const auto& strings : nested) {
+            p.writeUint32(strings.size());
+            for (const auto& s : strings) writeStringByHand(&p, s);
+        }
+        benchmark::DoNotOptimize(p.data());
+    }
+}
+BENCHMARK(BM_writeNestedStringsByHand)->RangeMultiplier(8)->Range(1, 4096);
+
+static void BM_readRecords(benchmark::State& state) {
+    Parcel p;
+    p.write(makeRecords(state.range(0)));
+    while (state.KeepRunning()) {
+        vector<Record> records;
+        p.setDataPosition(0);
+        p.read(&records);
+        benchmark::DoNotOptimize(records.data());
+    }
+}
+BENCHMARK(BM_readRecords)->RangeMultiplier(8)->Range(1, 4096);
+
+int main(int argc, char** argv) {
+    if (!checkParcelTraits()) {
+        fprintf(stderr, "Parcel::write() output differs from the reference\n");
+        return EXIT_FAILURE;
+    }
+
+    ::benchmark::Initialize(&argc, argv);
+    ::benchmark::RunSpecifiedBenchmarks();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "libhwbinder_print_benchmark"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <hwbinder/Debug.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/TextOutput.h>
+
+// libhwbinder:
+using android::hardware::Parcel;
+using android::hardware::TextOutput;
+using android::hardware::debugPrintFunc;
+using android::hardware::printHexData;
+using android::hardware::stringForIndent;
+
+// Standard library
+using std::string;
+using std::vector;
+
+// libutils:
+using android::status_t;
+
+// Discards everything, so the benchmarks only measure formatting.
+class NullTextOutput : public TextOutput {
+public:
+    virtual status_t print(const char* /*txt*/, size_t len) {
+        mBytes += len;
+        return android::NO_ERROR;
+    }
+    virtual void moveIndent(int /*delta*/) {}
+    virtual void pushBundle() {}
+    virtual void popBundle() {}
+
+    size_t bytes() const { return mBytes; }
+
+private:
+    size_t mBytes = 0;
+};
+
+// Has no TextOutput overload, so it is formatted by the std::stringstream
+// fallback. Used as the baseline for the direct overloads.
+struct Boxed {
+    uint64_t value;
+};
+
+static std::ostream& operator<<(std::ostream& os, const Boxed& b) {
+    return os << b.value;
+}
+
+static void BM_formatInt(benchmark::State& state) {
+    NullTextOutput out;
+    uint64_t value = 0;
+    while (state.KeepRunning()) {
+        out << value++;
+    }
+    state.SetBytesProcessed(out.bytes());
+}
+BENCHMARK(BM_formatInt);
+
+static void BM_formatIntStringstream(benchmark::State& state) {
+    NullTextOutput out;
+    uint64_t value = 0;
+    while (state.KeepRunning()) {
+        out << Boxed{value++};
+    }
+    state.SetBytesProcessed(out.bytes());
+}
+BENCHMARK(BM_formatIntStringstream);
+
+static void BM_formatPointer(benchmark::State& state) {
+    NullTextOutput out;
+    uintptr_t value = 0x7fff0000;
+    while (state.KeepRunning()) {
+        out << reinterpret_cast<void*>(value++);
+    }
+    state.SetBytesProcessed(out.bytes());
+}
+BENCHMARK(BM_formatPointer);
+
+// Builds a parcel with |count| objects, each followed by some payload, so
+// print() has both hex dumps and per-object lines to format.
+static void fillParcel(Parcel* parcel, size_t count) {
+    static const uint8_t kBuffer[64] = {};
+    for (size_t i = 0; i < count; i++) {
+        parcel->writeInt32(i);
+        parcel->writeUint64(i * 31);
+        size_t handle;
+        parcel->writeBuffer(kBuffer, sizeof(kBuffer), &handle);
+    }
+}
+
+static void BM_parcelPrint(benchmark::State& state) {
+    Parcel parcel;
+    fillParcel(&parcel, state.range(0));
+    NullTextOutput out;
+    while (state.KeepRunning()) {
+        parcel.print(out);
+    }
+    state.SetBytesProcessed(out.bytes());
+}
+BENCHMARK(BM_parcelPrint)->RangeMultiplier(4)->Range(1, 1024);
+
+// printHexData() as it was before it was made table driven, kept as the
+// golden reference for its output.
+static inline char hexDigit(uint32_t val) {
+    return "0123456789abcdef"[val&0xF];
+}
+
+static void referencePrintHexData(int32_t indent, const void *buf, size_t length,
+    size_t bytesPerLine, int32_t singleLineBytesCutoff,
+    size_t alignment, bool cStyle,
+    debugPrintFunc func, void* cookie)
+{
+    if (alignment == 0) {
+        if (bytesPerLine >= 16) alignment = 4;
+        else if (bytesPerLine >= 8) alignment = 2;
+        else alignment = 1;
+    }
+
+    size_t offset;
+
+    unsigned char *pos = (unsigned char *)buf;
+
+    if (pos == nullptr) {
+        if (singleLineBytesCutoff < 0) func(cookie, "\n");
+        func(cookie, "(NULL)");
+        return;
+    }
+
+    if (length == 0) {
+        if (singleLineBytesCutoff < 0) func(cookie, "\n");
+        func(cookie, "(empty)");
+        return;
+    }
+
+    if ((int32_t)length < 0) {
+        if (singleLineBytesCutoff < 0) func(cookie, "\n");
+        char buf[64];
+        sprintf(buf, "(bad length: %zu)", length);
+        func(cookie, buf);
+        return;
+    }
+
+    // Was 256, which overflows for wide C style lines.
+    char buffer[1024];
+    static const size_t maxBytesPerLine = (256-1-11-4)/(3+1);
+
+    if (bytesPerLine > maxBytesPerLine) bytesPerLine = maxBytesPerLine;
+
+    const bool oneLine = (int32_t)length <= singleLineBytesCutoff;
+    bool newLine = false;
+    if (cStyle) {
+        indent++;
+        func(cookie, "{\n");
+        newLine = true;
+    } else if (!oneLine) {
+        func(cookie, "\n");
+        newLine = true;
+    }
+
+    for (offset = 0; ; offset += bytesPerLine, pos += bytesPerLine) {
+        long remain = length;
+
+        char* c = buffer;
+        if (!oneLine && !cStyle) {
+            sprintf(c, "0x%08x: ", (int)offset);
+            c += 12;
+        }
+
+        size_t index;
+        size_t word;
+
+        for (word = 0; word < bytesPerLine; ) {
+
+            size_t align_offset = alignment-(alignment?1:0);
+            if (remain > 0 && (size_t)remain <= align_offset) {
+                align_offset = remain - 1;
+            }
+            const size_t startIndex = word+align_offset;
+
+            for (index = 0; index < alignment || (alignment == 0 && index < bytesPerLine); index++) {
+
+                if (!cStyle) {
+                    if (index == 0 && word > 0 && alignment > 0) {
+                        *c++ = ' ';
+                    }
+
+                    if (remain-- > 0) {
+                        const unsigned char val = *(pos+startIndex-index);
+                        *c++ = hexDigit(val>>4);
+                        *c++ = hexDigit(val);
+                    } else if (!oneLine) {
+                        *c++ = ' ';
+                        *c++ = ' ';
+                    }
+                } else {
+                    if (remain > 0) {
+                        if (index == 0 && word > 0) {
+                            *c++ = ',';
+                            *c++ = ' ';
+                        }
+                        if (index == 0) {
+                            *c++ = '0';
+                            *c++ = 'x';
+                        }
+                        const unsigned char val = *(pos+startIndex-index);
+                        *c++ = hexDigit(val>>4);
+                        *c++ = hexDigit(val);
+                        remain--;
+                    }
+                }
+            }
+
+            word += index;
+        }
+
+        if (!cStyle) {
+            remain = length;
+            *c++ = ' ';
+            *c++ = '\'';
+            for (index = 0; index < bytesPerLine; index++) {
+
+                if (remain-- > 0) {
+                    const unsigned char val = pos[index];
+                    *c++ = (val >= ' ' && val < 127) ? val : '.';
+                } else if (!oneLine) {
+                    *c++ = ' ';
+                }
+            }
+
+            *c++ = '\'';
+            if (length > bytesPerLine) *c++ = '\n';
+        } else {
+            if (remain > 0) *c++ = ',';
+            *c++ = '\n';
+        }
+
+        if (newLine && indent) func(cookie, stringForIndent(indent));
+        *c = 0;
+        func(cookie, buffer);
+        newLine = true;
+
+        if (length <= bytesPerLine) break;
+        length -= bytesPerLine;
+    }
+
+    if (cStyle) {
+        if (indent > 0) func(cookie, stringForIndent(indent-1));
+        func(cookie, "};");
+    }
+}
+
+static void appendText(void* cookie, const char* txt) {
+    static_cast<string*>(cookie)->append(txt);
+}
+
+static void countText(void* cookie, const char* txt) {
+    *static_cast<size_t*>(cookie) += strlen(txt);
+}
+
+// Checks printHexData() against the reference for every layout option.
+static bool checkHexDumpOutput() {
+    vector<uint8_t> data(2048);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i * 37 + 11;
+
+    vector<size_t> lengths = {129, 1000, data.size()};
+    for (size_t len = 0; len <= 70; len++) lengths.push_back(len);
+
+    size_t failures = 0;
+    for (size_t len : lengths)
+    for (size_t bytesPerLine = 1; bytesPerLine <= 64; bytesPerLine++)
+    for (size_t alignment : {0, 1, 2, 3, 4, 8, 16})
+    for (int32_t cutoff : {-1, 0, 16, 1 << 20})
+    for (int32_t indent : {0, 2})
+    for (bool cStyle : {false, true}) {
+        string expected, actual;
+        referencePrintHexData(indent, data.data(), len, bytesPerLine, cutoff,
+                              alignment, cStyle, appendText, &expected);
+        printHexData(indent, data.data(), len, bytesPerLine, cutoff,
+                     alignment, cStyle, appendText, &actual);
+        if (expected != actual && failures++ < 3) {
+            fprintf(stderr, "printHexData mismatch: length %zu, bytesPerLine %zu, "
+                    "alignment %zu, cutoff %d, indent %d, cStyle %d\n"
+                    "expected:\n%s\nactual:\n%s\n", len, bytesPerLine, alignment,
+                    cutoff, indent, cStyle, expected.c_str(), actual.c_str());
+        }
+    }
+    return failures == 0;
+}
+
+static void BM_hexDump(benchmark::State& state) {
+    vector<uint8_t> data(state.range(0), 0x5a);
+    size_t chars = 0;
+    while (state.KeepRunning()) {
+        printHexData(1, data.data(), data.size(), 16, 16, 0, false, countText, &chars);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_hexDump)->RangeMultiplier(4)->Range(64, 65536);
+
+static void BM_hexDumpReference(benchmark::State& state) {
+    vector<uint8_t> data(state.range(0), 0x5a);
+    size_t chars = 0;
+    while (state.KeepRunning()) {
+        referencePrintHexData(1, data.data(), data.size(), 16, 16, 0, false, countText, &chars);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_hexDumpReference)->RangeMultiplier(4)->Range(64, 65536);
+
+int main(int argc, char** argv) {
+    if (!checkHexDumpOutput()) {
+        fprintf(stderr, "printHexData output differs from the reference\n");
+        return EXIT_FAILURE;
+    }
+
+    ::benchmark::Initialize(&argc, argv);
+    ::benchmark::RunSpecifiedBenchmarks();
+    return EXIT_SUCCESS;
+}
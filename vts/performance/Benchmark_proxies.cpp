@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks the references a Parcel holds on the proxies of its handle
+// objects, by the strong count of a proxy to a forked server, through:
+//
+//   write:    every written handle object holds one reference.
+//   read:     reading them back holds no more.
+//   truncate: setDataSize() below an object drops its reference.
+//   free:     freeData() drops the rest.
+//   receive:  a reply with handle objects holds no reference, and the
+//             proxies read from it are only held by their readers.
+//   takeover: setDataSize() of a received reply copies it and holds a
+//             reference per object, whether it was read or not, which
+//             truncating and freeing it drop again.
+//
+// Each is run for every count, so that the object list grows a few times.
+// It also prints the time to write the handle objects into a parcel, and
+// to free it, which releases them without looking them up in ProcessState.
+// Ends with "proxies: PASS" if every check passed.
+//
+//  libhwbinder_proxies -counts 1,4,5,64 -i 1000
+
+#define LOG_TAG "libhwbinder_proxies"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/BnHwBenchmark.h>
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/Parcel.h>
+
+#include "PerfTest.h"
+
+using android::BAD_VALUE;
+using android::OK;
+using android::sp;
+using android::status_t;
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::toBinder;
+using android::hardware::tests::libhwbinder::V1_0::BnHwBenchmark;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+static const char kServiceName[] = "libhwbinder_proxies";
+// not a method of IBenchmark: replies with N references to the service
+static const uint32_t kProxiesCode = 0x00ffff11;
+
+// default arguments
+static vector<size_t> counts = {1, 4, 5, 64};
+static int iterations = 1000;
+
+static bool pass = true;
+
+class ProxiesStub : public BnHwBenchmark {
+   public:
+    explicit ProxiesStub(const sp<IBenchmark>& impl) : BnHwBenchmark(impl) {}
+
+    status_t onTransact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags,
+                        TransactCallback callback) override {
+        if (code != kProxiesCode) {
+            return BnHwBenchmark::onTransact(code, data, reply, flags, callback);
+        }
+        uint32_t count;
+        if (data.readUint32(&count) != OK) return BAD_VALUE;
+        sp<IBinder> self = this;
+        for (uint32_t i = 0; i < count; i++) {
+            status_t err = reply->writeStrongBinder(self);
+            if (err != OK) return err;
+        }
+        return OK;
+    }
+};
+
+static void check(const string& what, size_t count, int32_t refs, int32_t expected) {
+    if (refs == expected) return;
+    cout << "# " << what << " of " << count << ": " << refs << " references, expected "
+         << expected << endl;
+    pass = false;
+}
+
+// Reads |count| handle objects from the start of |p|, which must all be
+// |binder|. Returns the offsets of the objects, and what was read in |read|
+// if not null.
+static vector<size_t> readAll(const Parcel& p, size_t count, const sp<IBinder>& binder,
+                              vector<sp<IBinder>>* read = nullptr) {
+    vector<size_t> offsets;
+    p.setDataPosition(0);
+    for (size_t i = 0; i < count; i++) {
+        offsets.push_back(p.dataPosition());
+        sp<IBinder> proxy;
+        if (p.readStrongBinder(&proxy) != OK || proxy != binder) {
+            cout << "# read " << i << " of " << count << " is not the proxy" << endl;
+            pass = false;
+        }
+        if (read != nullptr) read->push_back(proxy);
+    }
+    return offsets;
+}
+
+static status_t fetch(const sp<IBinder>& binder, size_t count, Parcel* reply) {
+    Parcel data;
+    data.writeUint32(count);
+    return binder->transact(kProxiesCode, data, reply);
+}
+
+static void checkWritten(const sp<IBinder>& binder, size_t count) {
+    const int32_t base = binder->getStrongCount();
+    Parcel p;
+    for (size_t i = 0; i < count; i++) {
+        ASSERT(p.writeStrongBinder(binder) == OK);
+    }
+    check("write", count, binder->getStrongCount(), base + count);
+
+    vector<size_t> offsets = readAll(p, count, binder);
+    check("read", count, binder->getStrongCount(), base + count);
+
+    const size_t kept = count / 2;
+    ASSERT(p.setDataSize(offsets[kept]) == OK);
+    check("truncate", count, binder->getStrongCount(), base + kept);
+
+    p.freeData();
+    check("free", count, binder->getStrongCount(), base);
+}
+
+static void checkReceived(const sp<IBinder>& binder, size_t count) {
+    const int32_t base = binder->getStrongCount();
+    Parcel reply;
+    ASSERT(fetch(binder, count, &reply) == OK);
+    check("receive", count, binder->getStrongCount(), base);
+
+    {
+        vector<sp<IBinder>> read;
+        readAll(reply, count, binder, &read);
+        check("receive and hold", count, binder->getStrongCount(), base + count);
+    }
+    check("receive and drop", count, binder->getStrongCount(), base);
+    reply.freeData();
+    check("receive and free", count, binder->getStrongCount(), base);
+
+    // Takes over a reply of which only some objects were read.
+    ASSERT(fetch(binder, count, &reply) == OK);
+    reply.setDataPosition(0);
+    const size_t kept = count / 2;
+    for (size_t i = 0; i < kept; i++) {
+        sp<IBinder> read;
+        ASSERT(reply.readStrongBinder(&read) == OK);
+    }
+    ASSERT(reply.setDataSize(reply.dataSize()) == OK);
+    check("takeover", count, binder->getStrongCount(), base + count);
+    vector<size_t> offsets = readAll(reply, count, binder);
+    check("takeover and read", count, binder->getStrongCount(), base + count);
+    ASSERT(reply.setDataSize(offsets[kept]) == OK);
+    check("takeover and truncate", count, binder->getStrongCount(), base + kept);
+    reply.freeData();
+    check("takeover and free", count, binder->getStrongCount(), base);
+}
+
+// Average ns to write |count| handle objects into a parcel, and to free it.
+static void timeWriteFree(const sp<IBinder>& binder, size_t count, uint64_t* write_ns,
+                          uint64_t* free_ns) {
+    *write_ns = 0;
+    *free_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        Parcel p;
+        Tick sta, mid, end;
+        TICK_NOW(sta);
+        for (size_t j = 0; j < count; j++) p.writeStrongBinder(binder);
+        TICK_NOW(mid);
+        p.freeData();
+        TICK_NOW(end);
+        *write_ns += tickDiffNS(sta, mid);
+        *free_ns += tickDiffNS(mid, end);
+    }
+    *write_ns /= iterations;
+    *free_ns /= iterations;
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-counts 1,4,5,64  # handle objects per parcel" << endl;
+    cout << "-i 1000           # parcels timed per count" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-counts") {
+            counts = parseList(argv[++i]);
+        } else if (arg == "-i") {
+            iterations = atoi(argv[++i]);
+        } else {
+            help();
+        }
+    }
+    for (size_t count : counts) ASSERT(count > 0);
+    ASSERT(iterations > 0);
+
+    pid_t server;
+    Pipe server_pipe = forkStubServer<ProxiesStub>(kServiceName, &server);
+    server_pipe.wait();
+
+    sp<IBenchmark> service = IBenchmark::getService(kServiceName);
+    ASSERT(service != nullptr && service->isRemote());
+    sp<IBinder> binder = toBinder<IBenchmark>(service);
+    ASSERT(binder->remoteBinder() != nullptr);
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"iterations\":" << iterations << "}," << endl;
+    cout << "\"counts\":[" << endl;
+    bool first = true;
+    for (size_t count : counts) {
+        checkWritten(binder, count);
+        checkReceived(binder, count);
+        uint64_t write_ns, free_ns;
+        timeWriteFree(binder, count, &write_ns, &free_ns);
+        cout << (first ? "" : ",\n") << "  { \"count\":" << count
+             << ", \"write_ns\":" << write_ns << ", \"free_ns\":" << free_ns << " }";
+        cout.flush();
+        first = false;
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    cout << "proxies: " << (pass ? "PASS" : "FAIL") << endl;
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Storms the binder reference counting protocol.
+//
+// nodes_fresh: every call carries N binder objects created for it. The
+//   driver makes a node for each (BR_INCREFS/BR_ACQUIRE back to us), the
+//   server holds references until it frees the buffer, and then the
+//   BR_RELEASE/BR_DECREFS land on our looper thread, which drops them in
+//   processPendingDerefs().
+// nodes_kept: the same N objects in every call, so the nodes stay but
+//   each call still takes and drops their strong references.
+// proxies: fetches the service from hwservicemanager again and again,
+//   once while holding a proxy to it and once without, so that every
+//   fetch of the second kind creates a BpHwBinder (incStrongHandle(),
+//   incWeakHandle()) and drops it (decStrongHandle(), decWeakHandle()).
+//   The difference is what a proxy costs.
+//
+// The server is IBenchmark, which has no method taking binders; calls are
+// raw transactions with a code it doesn't know, which it rejects after
+// the driver has done all of the above.
+//
+//  libhwbinder_refcount -objects 1,16,256,1024 -i 200
+
+#define LOG_TAG "libhwbinder_refcount"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hidl/ServiceManagement.h>
+#include <hwbinder/Binder.h>
+#include <hwbinder/IPCThreadState.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+#include <log/log.h>
+
+#include "PerfTest.h"
+
+using android::sp;
+using android::status_t;
+using android::hardware::BHwBinder;
+using android::hardware::defaultServiceManager;
+using android::hardware::IBinder;
+using android::hardware::IPCThreadState;
+using android::hardware::Parcel;
+using android::hardware::ProcessState;
+using android::hardware::toBinder;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using android::hidl::base::V1_0::IBase;
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::get;
+using std::move;
+using std::string;
+using std::thread;
+using std::vector;
+
+typedef IPCThreadState::DriverStats DriverStats;
+
+// not a method of IBenchmark
+static const uint32_t kStormCode = 0x00ffffff;
+static const char kServiceName[] = "hwbinderRefcount";
+
+// default arguments
+static vector<size_t> object_counts = {1, 16, 256, 1024};
+static int iterations = 200;
+
+static atomic<uint64_t> nodes_alive(0);
+// set once the looper thread has joined the pool
+static atomic<IPCThreadState*> looper(nullptr);
+
+class StormNode : public BHwBinder {
+   public:
+    StormNode() { nodes_alive++; }
+    ~StormNode() override { nodes_alive--; }
+};
+
+static DriverStats sum(const DriverStats& a, const DriverStats& b) {
+    DriverStats s;
+    s.writeReads = a.writeReads + b.writeReads;
+    s.increfs = a.increfs + b.increfs;
+    s.acquires = a.acquires + b.acquires;
+    s.releases = a.releases + b.releases;
+    s.decrefs = a.decrefs + b.decrefs;
+    s.maxPendingDerefs = std::max(a.maxPendingDerefs, b.maxPendingDerefs);
+    return s;
+}
+
+// Resets the stats of this thread and of the looper. Only called while the
+// looper is idle: no node is waiting for a release.
+static void resetStats() {
+    IPCThreadState::self()->resetDriverStats();
+    looper.load()->resetDriverStats();
+}
+
+static DriverStats readStats() {
+    return sum(IPCThreadState::self()->getDriverStats(), looper.load()->getDriverStats());
+}
+
+// Waits for the looper to run the releases of every node.
+static void drainNodes() {
+    while (nodes_alive > 0) {
+        usleep(100);
+    }
+}
+
+static void dumpStats(const DriverStats& s, uint64_t iterations, uint64_t objects) {
+    cout << ", \"ioctls_per_call\":" << (double)s.writeReads / iterations
+         << ", \"per_object\":{ \"increfs\":" << (double)s.increfs / objects
+         << ", \"acquires\":" << (double)s.acquires / objects
+         << ", \"releases\":" << (double)s.releases / objects
+         << ", \"decrefs\":" << (double)s.decrefs / objects << " }"
+         << ", \"max_pending_derefs\":" << s.maxPendingDerefs;
+}
+
+static void nodeStorm(const sp<IBinder>& server, size_t count, bool fresh, bool first) {
+    vector<sp<IBinder>> nodes;
+    if (!fresh) {
+        for (size_t i = 0; i < count; i++) nodes.push_back(new StormNode);
+    }
+    resetStats();
+
+    uint64_t transact_ns = 0;
+    Tick sta, end, call_sta, call_end;
+    TICK_NOW(sta);
+    for (int i = 0; i < iterations; i++) {
+        if (fresh) {
+            nodes.clear();
+            for (size_t j = 0; j < count; j++) nodes.push_back(new StormNode);
+        }
+        Parcel data, reply;
+        for (const auto& node : nodes) {
+            ASSERT(data.writeStrongBinder(node) == android::OK);
+        }
+        TICK_NOW(call_sta);
+        status_t status = server->transact(kStormCode, data, &reply);
+        TICK_NOW(call_end);
+        ASSERT(status == android::UNKNOWN_TRANSACTION);
+        transact_ns += tickDiffNS(call_sta, call_end);
+    }
+    nodes.clear();
+    drainNodes();
+    TICK_NOW(end);
+
+    uint64_t objects = uint64_t(iterations) * count;
+    cout << (first ? "" : ",\n") << "    { \"objects\":" << count << ", \"calls\":" << iterations
+         << ", \"ns_per_object\":" << tickDiffNS(sta, end) / objects
+         << ", \"call_us\":" << transact_ns / iterations / 1.0E3;
+    dumpStats(readStats(), iterations, objects);
+    cout << " }";
+}
+
+static uint64_t proxyStorm(bool hold, DriverStats* stats) {
+    sp<android::hidl::manager::V1_0::IServiceManager> manager = defaultServiceManager();
+    ASSERT(manager != nullptr);
+    sp<IBase> held;
+    if (hold) {
+        held = manager->get(IBenchmark::descriptor, kServiceName);
+        ASSERT(held != nullptr);
+    }
+    resetStats();
+
+    Tick sta, end;
+    TICK_NOW(sta);
+    for (int i = 0; i < iterations; i++) {
+        sp<IBase> service = manager->get(IBenchmark::descriptor, kServiceName);
+        ASSERT(service != nullptr);
+    }
+    TICK_NOW(end);
+    *stats = readStats();
+    return tickDiffNS(sta, end) / iterations;
+}
+
+static void serverFx(Pipe p) {
+    sp<IBenchmark> server = IBenchmark::getService(kServiceName, true);
+    ASSERT(server != nullptr);
+    if (server->registerAsService(kServiceName) != android::OK) {
+        ALOGE("Failed to register service %s", kServiceName);
+        exit(EXIT_FAILURE);
+    }
+    p.signal();
+    // wait for kill
+    p.wait();
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "-objects" && i + 1 < argc) {
+            object_counts = parseList(argv[++i]);
+        } else if (string(argv[i]) == "-i" && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            cout << "usage: " << argv[0] << " [-objects 1,16,256,1024] [-i iterations]" << endl;
+            return string(argv[i]) == "-h" ? 0 : 1;
+        }
+    }
+    ASSERT(iterations > 0);
+    for (size_t count : object_counts) ASSERT(count > 0);
+
+    // The server is forked before this process opens the driver.
+    auto pipe_pair = Pipe::createPipePair();
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+        serverFx(move(get<1>(pipe_pair)));
+    }
+    Pipe& server_pipe = get<0>(pipe_pair);
+    server_pipe.wait();
+
+    // Releases of our nodes come to the process, not to the calling thread,
+    // so one looper thread of our own takes them.
+    ProcessState::self()->setThreadPoolConfiguration(1, true /* callerJoinsPool */);
+    thread([] {
+        looper = IPCThreadState::self();
+        IPCThreadState::self()->joinThreadPool();
+    }).detach();
+    while (looper.load() == nullptr) {
+        usleep(100);
+    }
+
+    sp<IBenchmark> service = IBenchmark::getService(kServiceName);
+    ASSERT(service != nullptr && service->isRemote());
+    sp<IBinder> server = toBinder<IBenchmark>(service);
+
+    cout << "{" << endl;
+    for (bool fresh : {true, false}) {
+        cout << (fresh ? "\"nodes_fresh\": [" : "\"nodes_kept\": [") << endl;
+        bool first = true;
+        for (size_t count : object_counts) {
+            nodeStorm(server, count, fresh, first);
+            first = false;
+        }
+        cout << endl << "]," << endl;
+    }
+
+    // Nothing but the fetches below may hold a proxy to the service.
+    server.clear();
+    service.clear();
+    DriverStats held_stats, new_stats;
+    uint64_t held_ns = proxyStorm(true, &held_stats);
+    uint64_t new_ns = proxyStorm(false, &new_stats);
+    cout << "\"proxies\": { \"calls\":" << iterations << ", \"get_held_us\":" << held_ns / 1.0E3
+         << ", \"get_new_proxy_us\":" << new_ns / 1.0E3
+         << ", \"proxy_us\":" << ((double)new_ns - held_ns) / 1.0E3
+         << ", \"ioctls_per_get_held\":" << (double)held_stats.writeReads / iterations
+         << ", \"ioctls_per_get_new_proxy\":" << (double)new_stats.writeReads / iterations << " }"
+         << endl;
+    cout << "}" << endl;
+
+    server_pipe.signal();
+    waitpid(pid, nullptr, 0);
+    return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks the reply cache of BHwBinder (setReplyCacheable()) from a client
+// of a forked server. The cached method takes a hidl_string and replies
+// with the words in it as a hidl_vec<hidl_string>, along with how many
+// times the method has run, so a reply from the cache is told apart from
+// a new one by that number. Its hit, miss and eviction counts are asked
+// from the server.
+//
+//   hits:     a repeated call is a hit, and its reply, buffers included,
+//             is the same as that of the first call.
+//   errors:   a reply with an error status is cached like any other.
+//   tokens:   a call with another interface token, or none, is not
+//             answered from the cache.
+//   invalidate: after invalidateReplyCache() the method runs again.
+//   evict:    with a cache too small for every call, it stays within its
+//             bound, drops the least recently used replies first and
+//             keeps the one just used.
+//
+// It also prints the time per call for misses and hits, and ends with
+// "replycache: PASS" if every check passed.
+//
+//  libhwbinder_replycache -words 4,64 -i 1000
+
+#define LOG_TAG "libhwbinder_replycache"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/BnHwBenchmark.h>
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlBinderSupport.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/Parcel.h>
+
+#include "PerfTest.h"
+
+using android::BAD_VALUE;
+using android::OK;
+using android::sp;
+using android::status_t;
+using android::hardware::BHwBinder;
+using android::hardware::hidl_string;
+using android::hardware::hidl_vec;
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::readEmbeddedFromParcel;
+using android::hardware::toBinder;
+using android::hardware::writeEmbeddedToParcel;
+using android::hardware::tests::libhwbinder::V1_0::BnHwBenchmark;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+static const char kServiceName[] = "libhwbinder_replycache";
+// not methods of IBenchmark
+static const uint32_t kSplitCode = 0x00ffff21;       // cached
+static const uint32_t kStatsCode = 0x00ffff22;       // getReplyCacheStats()
+static const uint32_t kInvalidateCode = 0x00ffff23;  // invalidateReplyCache()
+static const uint32_t kCacheSizeCode = 0x00ffff24;   // setReplyCacheSize()
+static const size_t kCacheBytes = 1 << 20;
+
+// default arguments
+static vector<size_t> word_counts = {4, 64};
+static int iterations = 1000;
+
+static bool pass = true;
+
+// What the cached method replied.
+struct Split {
+    int32_t status;
+    uint32_t call;
+    vector<string> words;
+
+    bool operator==(const Split& o) const {
+        return status == o.status && call == o.call && words == o.words;
+    }
+};
+
+class ReplyCacheStub : public BnHwBenchmark {
+   public:
+    explicit ReplyCacheStub(const sp<IBenchmark>& impl) : BnHwBenchmark(impl) {}
+
+    status_t onTransact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags,
+                        TransactCallback callback) override {
+        switch (code) {
+            case kSplitCode:
+                return split(data, reply, callback);
+            case kStatsCode: {
+                ReplyCacheStats stats = getReplyCacheStats();
+                reply->writeUint64(stats.hits);
+                reply->writeUint64(stats.misses);
+                reply->writeUint64(stats.uncacheable);
+                reply->writeUint64(stats.evictions);
+                reply->writeUint64(stats.entries);
+                return reply->writeUint64(stats.bytes);
+            }
+            case kInvalidateCode:
+                invalidateReplyCache();
+                return OK;
+            case kCacheSizeCode: {
+                uint64_t bytes;
+                if (data.readUint64(&bytes) != OK) return BAD_VALUE;
+                setReplyCacheSize(bytes);
+                return OK;
+            }
+        }
+        return BnHwBenchmark::onTransact(code, data, reply, flags, callback);
+    }
+
+   private:
+    // Replies like a generated stub: a status, then the results, sent
+    // through |callback| so that the cache sees them.
+    status_t split(const Parcel& data, Parcel* reply, TransactCallback callback) {
+        if (!data.enforceInterface(IBenchmark::descriptor)) return BAD_VALUE;
+        const hidl_string* text;
+        size_t parent;
+        status_t err = data.readBuffer(sizeof(*text), &parent,
+                                       reinterpret_cast<const void**>(&text));
+        if (err == OK) err = readEmbeddedFromParcel(*text, data, parent, 0);
+        if (err != OK) return err;
+
+        calls++;
+        if (text->size() == 0) {
+            reply->writeInt32(BAD_VALUE);
+            callback(*reply);
+            return OK;
+        }
+        vector<string> split;
+        std::istringstream stream(text->c_str());
+        for (string word; stream >> word;) split.push_back(word);
+        hidl_vec<hidl_string> words(split.size());
+        for (size_t i = 0; i < split.size(); i++) words[i] = split[i];
+
+        reply->writeInt32(OK);
+        reply->writeUint32(calls);
+        size_t words_parent;
+        err = reply->writeBuffer(&words, sizeof(words), &words_parent);
+        size_t words_child;
+        if (err == OK) err = writeEmbeddedToParcel(words, reply, words_parent, 0, &words_child);
+        for (size_t i = 0; err == OK && i < words.size(); i++) {
+            err = writeEmbeddedToParcel(words[i], reply, words_child, i * sizeof(hidl_string));
+        }
+        if (err != OK) return err;
+        callback(*reply);
+        return OK;
+    }
+
+    // only touched by the one binder thread
+    uint32_t calls = 0;
+};
+
+// Calls the cached method with |token| as the interface token, or none if
+// it is nullptr. A call the stub rejects has the error as its status.
+static Split split(const sp<IBinder>& binder, const string& text,
+                   const char* token = IBenchmark::descriptor) {
+    Parcel data, reply;
+    hidl_string arg(text);
+    size_t parent;
+    if (token != nullptr) ASSERT(data.writeInterfaceToken(token) == OK);
+    ASSERT(data.writeBuffer(&arg, sizeof(arg), &parent) == OK);
+    ASSERT(writeEmbeddedToParcel(arg, &data, parent, 0) == OK);
+
+    Split result = {};
+    result.status = binder->transact(kSplitCode, data, &reply);
+    if (result.status != OK) return result;
+    ASSERT(reply.readInt32(&result.status) == OK);
+    if (result.status != OK) return result;
+    ASSERT(reply.readUint32(&result.call) == OK);
+    const hidl_vec<hidl_string>* words;
+    size_t words_parent, words_child;
+    ASSERT(reply.readBuffer(sizeof(*words), &words_parent,
+                            reinterpret_cast<const void**>(&words)) == OK);
+    ASSERT(readEmbeddedFromParcel(*words, reply, words_parent, 0, &words_child) == OK);
+    for (size_t i = 0; i < words->size(); i++) {
+        ASSERT(readEmbeddedFromParcel((*words)[i], reply, words_child,
+                                      i * sizeof(hidl_string)) == OK);
+        result.words.push_back((*words)[i]);
+    }
+    return result;
+}
+
+struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t uncacheable;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+static Stats stats(const sp<IBinder>& binder) {
+    Parcel data, reply;
+    ASSERT(binder->transact(kStatsCode, data, &reply) == OK);
+    Stats s;
+    ASSERT(reply.readUint64(&s.hits) == OK);
+    ASSERT(reply.readUint64(&s.misses) == OK);
+    ASSERT(reply.readUint64(&s.uncacheable) == OK);
+    ASSERT(reply.readUint64(&s.evictions) == OK);
+    ASSERT(reply.readUint64(&s.entries) == OK);
+    ASSERT(reply.readUint64(&s.bytes) == OK);
+    return s;
+}
+
+static void call(const sp<IBinder>& binder, uint32_t code, uint64_t arg = 0) {
+    Parcel data, reply;
+    data.writeUint64(arg);
+    ASSERT(binder->transact(code, data, &reply) == OK);
+}
+
+static void check(bool ok, const string& what) {
+    if (ok) return;
+    cout << "# " << what << ": FAIL" << endl;
+    pass = false;
+}
+
+static string sentence(size_t words, size_t seed) {
+    string text;
+    for (size_t i = 0; i < words; i++) {
+        text += (i ? " w" : "w") + std::to_string(seed) + "_" + std::to_string(i);
+    }
+    return text;
+}
+
+static void checkHits(const sp<IBinder>& binder, size_t words) {
+    call(binder, kInvalidateCode);
+    const Stats before = stats(binder);
+    const string text = sentence(words, 0);
+    const Split first = split(binder, text);
+    check(first.status == OK && first.words.size() == words, "split");
+    for (int i = 0; i < 3; i++) {
+        check(split(binder, text) == first, "replayed reply matches the original");
+    }
+    const Stats after = stats(binder);
+    check(after.misses - before.misses == 1, "one miss");
+    check(after.hits - before.hits == 3, "three hits");
+    check(after.uncacheable == before.uncacheable, "nothing uncacheable");
+
+    const Split error = split(binder, "");
+    check(error.status == BAD_VALUE, "error reply");
+    check(split(binder, "").status == BAD_VALUE, "replayed error reply");
+    check(stats(binder).hits - after.hits == 1, "error replies are cached");
+
+    call(binder, kInvalidateCode);
+    const Split again = split(binder, text);
+    check(again.words == first.words && again.call != first.call,
+          "the method runs after invalidation");
+    check(stats(binder).entries == 1, "invalidation drops every entry");
+}
+
+static void checkTokens(const sp<IBinder>& binder, size_t words) {
+    call(binder, kInvalidateCode);
+    const string text = sentence(words, 0);
+    check(split(binder, text).status == OK, "split");
+    const Stats before = stats(binder);
+
+    check(split(binder, text, "android.hardware.tests.other@1.0::IOther").status == BAD_VALUE,
+          "a call with another token is rejected");
+    const Stats other = stats(binder);
+    check(other.hits == before.hits, "a call with another token doesn't hit");
+
+    check(split(binder, text, nullptr).status == BAD_VALUE, "a call without a token is rejected");
+    const Stats none = stats(binder);
+    check(none.hits == other.hits, "a call without a token doesn't hit");
+    check(none.uncacheable - other.uncacheable == 1, "a call without a token isn't cached");
+}
+
+static void checkEviction(const sp<IBinder>& binder, size_t words) {
+    call(binder, kInvalidateCode);
+    split(binder, sentence(words, 0));
+    // room for three or so replies of this size
+    const uint64_t bound = stats(binder).bytes * 7 / 2;
+    call(binder, kCacheSizeCode, bound);
+    const Stats before = stats(binder);
+    const int kCalls = 32;
+    for (int i = 1; i <= kCalls; i++) {
+        split(binder, sentence(words, i));
+        // keeps the first reply the most recently used
+        split(binder, sentence(words, 0));
+        check(stats(binder).bytes <= bound, "the cache stays within its bound");
+    }
+    const Stats after = stats(binder);
+    check(after.evictions > before.evictions, "replies are evicted");
+    check(after.hits - before.hits == kCalls, "the most recently used reply stays");
+    split(binder, sentence(words, 1));
+    check(stats(binder).hits == after.hits, "the least recently used reply goes");
+    call(binder, kCacheSizeCode, kCacheBytes);
+}
+
+// Average us per call that misses, and per call that hits.
+static void timeCalls(const sp<IBinder>& binder, size_t words, double* miss_us, double* hit_us) {
+    call(binder, kInvalidateCode);
+    uint64_t miss_ns = 0;
+    uint64_t hit_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        const string text = sentence(words, i);
+        Tick sta, mid, end;
+        TICK_NOW(sta);
+        split(binder, text);
+        TICK_NOW(mid);
+        split(binder, text);
+        TICK_NOW(end);
+        miss_ns += tickDiffNS(sta, mid);
+        hit_ns += tickDiffNS(mid, end);
+    }
+    *miss_us = miss_ns / 1000.0 / iterations;
+    *hit_us = hit_ns / 1000.0 / iterations;
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-words 4,64  # words per call" << endl;
+    cout << "-i 1000      # calls timed per count" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-words") {
+            word_counts = parseList(argv[++i]);
+        } else if (arg == "-i") {
+            iterations = atoi(argv[++i]);
+        } else {
+            help();
+        }
+    }
+    for (size_t words : word_counts) ASSERT(words > 0);
+    ASSERT(iterations > 0);
+
+    pid_t server;
+    Pipe server_pipe =
+        forkStubServer<ReplyCacheStub>(kServiceName, &server, [](BHwBinder* stub) {
+            stub->setReplyCacheSize(kCacheBytes);
+            stub->setReplyCacheable(kSplitCode, true);
+        });
+    server_pipe.wait();
+
+    sp<IBenchmark> service = IBenchmark::getService(kServiceName);
+    ASSERT(service != nullptr && service->isRemote());
+    sp<IBinder> binder = toBinder<IBenchmark>(service);
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"iterations\":" << iterations << "}," << endl;
+    cout << "\"words\":[" << endl;
+    bool first = true;
+    for (size_t words : word_counts) {
+        checkHits(binder, words);
+        checkTokens(binder, words);
+        checkEviction(binder, words);
+        double miss_us, hit_us;
+        timeCalls(binder, words, &miss_us, &hit_us);
+        cout << (first ? "" : ",\n") << "  { \"words\":" << words << ", \"miss_us\":" << miss_us
+             << ", \"hit_us\":" << hit_us << " }";
+        cout.flush();
+        first = false;
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    cout << "replycache: " << (pass ? "PASS" : "FAIL") << endl;
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    return pass ? 0 : 1;
+}
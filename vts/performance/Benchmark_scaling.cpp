@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Sweeps the server's binder thread pool size against the number of
+// concurrent clients and the payload size. For every cell a fresh server
+// process is started with the pool size set through
+// ProcessState::setThreadPoolConfiguration(), the clients call sendVec()
+// back to back for a fixed time, and the cell is reported with its
+// throughput, latency percentiles and the CPU time both sides used.
+//
+//  libhwbinder_scaling -servers 1,2,4,8 -clients 1,2,4,8,16 -sizes 16,4096
+//  libhwbinder_scaling -client_threads -d 5
+
+#define LOG_TAG "libhwbinder_scaling"
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlSupport.h>
+#include <hwbinder/IPCThreadState.h>
+#include <hwbinder/ProcessState.h>
+#include <log/log.h>
+
+#include "Histogram.h"
+#include "PerfTest.h"
+
+using android::sp;
+using android::hardware::hidl_vec;
+using android::hardware::IPCThreadState;
+using android::hardware::ProcessState;
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::get;
+using std::ifstream;
+using std::move;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+// What a client process sends back to the parent for one cell.
+struct ClientResult {
+    LatencyHistogram latency;  // per call, in ns
+    uint64_t cpuNs;            // CPU time of the process while measuring
+};
+
+struct Cell {
+    int serverThreads;
+    int clients;
+    size_t size;
+};
+
+// default arguments
+static vector<int> server_threads = {1, 2, 4, 8};
+static vector<int> client_counts = {1, 2, 4, 8};
+static vector<size_t> payload_sizes = {16, 4096};
+static int duration_sec = 2;
+static bool client_threads = false;
+
+static uint64_t timevalNs(const timeval& tv) {
+    return tv.tv_sec * 1000000000ull + tv.tv_usec * 1000ull;
+}
+
+static uint64_t processCpuNs() {
+    rusage usage;
+    ASSERT(getrusage(RUSAGE_SELF, &usage) == 0);
+    return timevalNs(usage.ru_utime) + timevalNs(usage.ru_stime);
+}
+
+// user + system time of another process, from /proc/<pid>/stat
+static uint64_t otherProcessCpuNs(pid_t pid) {
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    getline(stat, line);
+    // the command name may contain spaces; the fields after it don't
+    size_t pos = line.rfind(')');
+    if (pos == string::npos) return 0;
+    std::istringstream fields(line.substr(pos + 2));
+    string skip;
+    // state ... cmajflt are fields 3 to 13, utime and stime are 14 and 15
+    for (int i = 3; i <= 13; i++) fields >> skip;
+    uint64_t utime = 0, stime = 0;
+    fields >> utime >> stime;
+    return (utime + stime) * (1000000000ull / sysconf(_SC_CLK_TCK));
+}
+
+static void serverFx(const string& name, int threads, Pipe p) {
+    // The caller joins the pool below, so it is one of the |threads|.
+    ASSERT(ProcessState::self()->setThreadPoolConfiguration(threads, true) == android::OK);
+    ProcessState::self()->startThreadPool();
+
+    sp<IBenchmark> server = IBenchmark::getService(name, true);
+    ASSERT(server != nullptr);
+    if (server->registerAsService(name) != android::OK) {
+        ALOGE("Failed to register service %s", name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    p.signal();
+    // killed by the parent once the cell is done
+    IPCThreadState::self()->joinThreadPool();
+    exit(EXIT_FAILURE);
+}
+
+static void callLoop(const sp<IBenchmark>& service, size_t size, uint64_t deadline,
+                     LatencyHistogram* latency) {
+    hidl_vec<uint8_t> data;
+    data.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = i;
+    }
+    Tick sta, end;
+    do {
+        TICK_NOW(sta);
+        ASSERT(service->sendVec(data, [](const auto&) {}).isOk());
+        TICK_NOW(end);
+        latency->record(tickDiffNS(sta, end));
+    } while (uint64_t(end.time_since_epoch().count()) < deadline);
+}
+
+// One client process, calling from |threads| threads at once.
+static void clientFx(const string& name, int threads, size_t size, Pipe p) {
+    sp<IBenchmark> service = IBenchmark::getService(name);
+    ASSERT(service != nullptr && service->isRemote());
+    // tell main I'm init-ed and wait for kick-off
+    p.signal();
+    p.wait();
+
+    ClientResult result = {};
+    vector<LatencyHistogram> latencies(threads);
+    uint64_t cpu = processCpuNs();
+    uint64_t deadline = uint64_t(
+        (tickNow() + std::chrono::seconds(duration_sec)).time_since_epoch().count());
+    vector<thread> pool;
+    for (int i = 1; i < threads; i++) {
+        pool.emplace_back(callLoop, service, size, deadline, &latencies[i]);
+    }
+    callLoop(service, size, deadline, &latencies[0]);
+    for (auto& t : pool) t.join();
+    result.cpuNs = processCpuNs() - cpu;
+    for (const auto& latency : latencies) result.latency.add(latency);
+
+    ASSERT(p.send(result) >= 0);
+    // wait for kill
+    p.wait();
+    exit(EXIT_SUCCESS);
+}
+
+static void runCell(const Cell& cell, int index, bool first) {
+    string name = "hwbinderScaling" + to_string(index);
+    auto server_pipe_pair = Pipe::createPipePair();
+    pid_t server = fork();
+    ASSERT(server >= 0);
+    if (server == 0) {
+        serverFx(name, cell.serverThreads, move(get<1>(server_pipe_pair)));
+    }
+    Pipe& server_pipe = get<0>(server_pipe_pair);
+    server_pipe.wait();
+
+    int processes = client_threads ? 1 : cell.clients;
+    int threads = client_threads ? cell.clients : 1;
+    vector<Pipe> clients;
+    for (int i = 0; i < processes; i++) {
+        clients.push_back(
+            forkChild([&](Pipe p) { clientFx(name, threads, cell.size, move(p)); }));
+    }
+    for (auto& c : clients) c.wait();
+
+    uint64_t server_cpu = otherProcessCpuNs(server);
+    Tick sta, end;
+    TICK_NOW(sta);
+    for (auto& c : clients) c.signal();
+
+    ClientResult total = {};
+    for (auto& c : clients) {
+        ClientResult result;
+        ASSERT(c.recv(result) >= 0);
+        total.latency.add(result.latency);
+        total.cpuNs += result.cpuNs;
+    }
+    TICK_NOW(end);
+    server_cpu = otherProcessCpuNs(server) - server_cpu;
+    for (auto& c : clients) c.signal();
+    // only the clients have exited so far
+    for (int i = 0; i < processes; i++) {
+        wait(nullptr);
+    }
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    double wall = tickDiffNS(sta, end);
+    cout << (first ? "" : ",\n") << "  { \"server_threads\":" << cell.serverThreads
+         << ", \"clients\":" << cell.clients << ", \"size\":" << cell.size
+         << ", \"calls\":" << total.latency.count()
+         << ", \"calls_per_sec\":" << uint64_t(total.latency.count() / (wall / 1.0E9))
+         << ", \"p50_us\":" << total.latency.percentile(50) / 1.0E3
+         << ", \"p99_us\":" << total.latency.percentile(99) / 1.0E3
+         << ", \"server_cpus\":" << server_cpu / wall << ", \"client_cpus\":" << total.cpuNs / wall
+         << " }";
+}
+
+static void help() {
+    cout << "usage:" << endl;
+    cout << "-servers 1,2,4,8  # server thread pool sizes" << endl;
+    cout << "-clients 1,2,4,8  # concurrent clients" << endl;
+    cout << "-sizes 16,4096    # payload sizes in bytes" << endl;
+    cout << "-d 2              # seconds per cell" << endl;
+    cout << "-client_threads   # clients are threads of one process, not processes" << endl;
+    exit(0);
+}
+
+int main(int argc, char** argv) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-client_threads") {
+            client_threads = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            help();
+        }
+        if (arg == "-servers") {
+            server_threads.clear();
+            for (size_t n : parseList(argv[++i])) server_threads.push_back(n);
+        } else if (arg == "-clients") {
+            client_counts.clear();
+            for (size_t n : parseList(argv[++i])) client_counts.push_back(n);
+        } else if (arg == "-sizes") {
+            payload_sizes = parseList(argv[++i]);
+        } else if (arg == "-d") {
+            duration_sec = atoi(argv[++i]);
+        } else {
+            help();
+        }
+    }
+    for (int n : server_threads) ASSERT(n > 0);
+    for (int n : client_counts) ASSERT(n > 0);
+    ASSERT(duration_sec > 0);
+
+    cout << "{" << endl;
+    cout << "\"cfg\":{\"seconds_per_cell\":" << duration_sec << ",\"clients_are\":\""
+         << (client_threads ? "threads" : "processes") << "\"}," << endl;
+    cout << "\"cells\":[" << endl;
+    int index = 0;
+    for (size_t size : payload_sizes) {
+        for (int servers : server_threads) {
+            for (int clients : client_counts) {
+                runCell({servers, clients, size}, index, index == 0);
+                cout.flush();
+                index++;
+            }
+        }
+    }
+    cout << endl << "]" << endl;
+    cout << "}" << endl;
+    return 0;
+}
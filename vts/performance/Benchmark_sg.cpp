@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Scatter-gather payloads: trees of buffers written with writeBuffer()/
+// writeEmbeddedBuffer() and read back with readBuffer()/
+// readEmbeddedBuffer(), the way generated HIDL code does.
+//
+// Each shape is measured three ways:
+//   BM_write: serializing into a Parcel
+//   BM_read:  deserializing that Parcel in the same process, where the
+//             buffer pointers are still valid, so no driver is needed
+//   BM_send:  one call to a remote service carrying it, where the driver
+//             copies every buffer and fixes up the pointers. The test HAL
+//             has no method taking these types, so this is a raw
+//             transaction with a code the server rejects unread.
+//
+// With -local only the first two are run and no service is started.
+
+#define LOG_TAG "libhwbinder_sg_benchmark"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <benchmark/benchmark.h>
+#include <cutils/native_handle.h>
+#include <hidl/HidlBinderSupport.h>
+#include <hidl/HidlSupport.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/Parcel.h>
+#include <log/log.h>
+
+// libutils:
+using android::OK;
+using android::sp;
+using android::status_t;
+
+// libhidl:
+using android::hardware::hidl_handle;
+using android::hardware::hidl_string;
+using android::hardware::hidl_vec;
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::readEmbeddedFromParcel;
+using android::hardware::toBinder;
+using android::hardware::writeEmbeddedToParcel;
+
+// Standard library
+using std::string;
+using std::vector;
+
+// Generated HIDL files
+using android::hardware::tests::libhwbinder::V1_0::IBenchmark;
+
+static const char gServiceName[] = "libhwbinder_sg_benchmark";
+// not a method of IBenchmark
+static const uint32_t kRawCode = 0x00ffffff;
+
+// hidl_vec<hidl_string>: args are the count and the length of the strings.
+struct Strings {
+    hidl_vec<hidl_string> value;
+    size_t bytes = 0;
+
+    explicit Strings(const benchmark::State& state) {
+        value.resize(state.range(0));
+        for (auto& s : value) {
+            s = string(state.range(1), 's');
+            bytes += s.size();
+        }
+    }
+    status_t write(Parcel* parcel) const {
+        size_t parent, child;
+        status_t err = parcel->writeBuffer(&value, sizeof(value), &parent);
+        if (err == OK) err = writeEmbeddedToParcel(value, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < value.size(); i++) {
+            err = writeEmbeddedToParcel(value[i], parcel, child, i * sizeof(hidl_string));
+        }
+        return err;
+    }
+    static status_t read(const Parcel& parcel) {
+        const hidl_vec<hidl_string>* vec;
+        size_t parent, child;
+        status_t err = parcel.readBuffer(sizeof(*vec), &parent,
+                                         reinterpret_cast<const void**>(&vec));
+        if (err == OK) err = readEmbeddedFromParcel(*vec, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < vec->size(); i++) {
+            err = readEmbeddedFromParcel((*vec)[i], parcel, child, i * sizeof(hidl_string));
+        }
+        return err;
+    }
+};
+
+// hidl_vec<hidl_vec<uint8_t>>: args are the count and the size of the
+// inner vectors.
+struct Vectors {
+    hidl_vec<hidl_vec<uint8_t>> value;
+    size_t bytes = 0;
+
+    explicit Vectors(const benchmark::State& state) {
+        value.resize(state.range(0));
+        for (auto& v : value) {
+            v.resize(state.range(1));
+            bytes += v.size();
+        }
+    }
+    status_t write(Parcel* parcel) const {
+        size_t parent, child, grandchild;
+        status_t err = parcel->writeBuffer(&value, sizeof(value), &parent);
+        if (err == OK) err = writeEmbeddedToParcel(value, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < value.size(); i++) {
+            err = writeEmbeddedToParcel(value[i], parcel, child, i * sizeof(hidl_vec<uint8_t>),
+                                        &grandchild);
+        }
+        return err;
+    }
+    static status_t read(const Parcel& parcel) {
+        const hidl_vec<hidl_vec<uint8_t>>* vec;
+        size_t parent, child, grandchild;
+        status_t err = parcel.readBuffer(sizeof(*vec), &parent,
+                                         reinterpret_cast<const void**>(&vec));
+        if (err == OK) err = readEmbeddedFromParcel(*vec, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < vec->size(); i++) {
+            err = readEmbeddedFromParcel((*vec)[i], parcel, child, i * sizeof(hidl_vec<uint8_t>),
+                                         &grandchild);
+        }
+        return err;
+    }
+};
+
+// hidl_vec<hidl_handle>: args are the count and the fds per handle. All
+// the handles share the same fds, which the shape owns.
+struct Handles {
+    hidl_vec<hidl_handle> value;
+    vector<native_handle_t*> handles;
+    vector<int> fds;
+    size_t bytes = 0;
+
+    explicit Handles(const benchmark::State& state) {
+        for (int i = 0; i < state.range(1); i++) {
+            fds.push_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+        }
+        value.resize(state.range(0));
+        for (auto& h : value) {
+            native_handle_t* handle = native_handle_create(fds.size(), 0);
+            for (size_t i = 0; i < fds.size(); i++) handle->data[i] = fds[i];
+            handles.push_back(handle);
+            h.setTo(handle, false /* shouldOwn */);
+        }
+    }
+    ~Handles() {
+        for (native_handle_t* handle : handles) native_handle_delete(handle);
+        for (int fd : fds) close(fd);
+    }
+    status_t write(Parcel* parcel) const {
+        size_t parent, child;
+        status_t err = parcel->writeBuffer(&value, sizeof(value), &parent);
+        if (err == OK) err = writeEmbeddedToParcel(value, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < value.size(); i++) {
+            err = writeEmbeddedToParcel(value[i], parcel, child, i * sizeof(hidl_handle));
+        }
+        return err;
+    }
+    static status_t read(const Parcel& parcel) {
+        const hidl_vec<hidl_handle>* vec;
+        size_t parent, child;
+        status_t err = parcel.readBuffer(sizeof(*vec), &parent,
+                                         reinterpret_cast<const void**>(&vec));
+        if (err == OK) err = readEmbeddedFromParcel(*vec, parcel, parent, 0, &child);
+        for (size_t i = 0; err == OK && i < vec->size(); i++) {
+            err = readEmbeddedFromParcel((*vec)[i], parcel, child, i * sizeof(hidl_handle));
+        }
+        return err;
+    }
+};
+
+// A linked list, each link a buffer whose parent is the link before it:
+// the deepest parent chain a tree can have. Like HIDL references, every
+// link is first looked up with findBuffer() in case it was already sent.
+// The arg is the number of links.
+struct Chain {
+    struct Link {
+        const Link* next;
+        uint64_t value;
+    };
+    vector<Link> value;
+    size_t bytes;
+
+    explicit Chain(const benchmark::State& state) : value(state.range(0)) {
+        for (size_t i = 0; i < value.size(); i++) {
+            value[i].next = i + 1 < value.size() ? &value[i + 1] : nullptr;
+            value[i].value = i;
+        }
+        bytes = value.size() * sizeof(Link);
+    }
+    status_t write(Parcel* parcel) const {
+        size_t parent, child;
+        status_t err = parcel->writeBuffer(&value[0], sizeof(Link), &parent);
+        for (size_t i = 1; err == OK && i < value.size(); i++) {
+            bool found;
+            err = parcel->findBuffer(&value[i], sizeof(Link), &found, nullptr, nullptr);
+            if (err != OK) break;
+            if (found) return android::BAD_VALUE;  // links are never shared
+            err = parcel->writeEmbeddedBuffer(&value[i], sizeof(Link), &child, parent,
+                                              offsetof(Link, next));
+            parent = child;
+        }
+        return err;
+    }
+    static status_t read(const Parcel& parcel) {
+        const Link* link;
+        size_t parent, child;
+        status_t err = parcel.readBuffer(sizeof(Link), &parent,
+                                         reinterpret_cast<const void**>(&link));
+        while (err == OK && link->next != nullptr) {
+            err = parcel.readEmbeddedBuffer(sizeof(Link), &child, parent, offsetof(Link, next),
+                                            reinterpret_cast<const void**>(&link));
+            parent = child;
+        }
+        return err;
+    }
+};
+
+template <typename Shape>
+static void BM_write(benchmark::State& state) {
+    Shape shape(state);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        if (shape.write(&parcel) != OK) {
+            state.SkipWithError("write failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * shape.bytes);
+}
+
+template <typename Shape>
+static void BM_read(benchmark::State& state) {
+    Shape shape(state);
+    Parcel parcel;
+    if (shape.write(&parcel) != OK) {
+        state.SkipWithError("write failed");
+        return;
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        if (Shape::read(parcel) != OK) {
+            state.SkipWithError("read failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * shape.bytes);
+}
+
+template <typename Shape>
+static void BM_send(benchmark::State& state) {
+    sp<IBenchmark> service = IBenchmark::getService(gServiceName);
+    if (service == nullptr || !service->isRemote()) {
+        state.SkipWithError("Failed to retrieve remote benchmark service.");
+        return;
+    }
+    sp<IBinder> binder = toBinder<IBenchmark>(service);
+    Shape shape(state);
+    Parcel data;
+    if (shape.write(&data) != OK) {
+        state.SkipWithError("write failed");
+        return;
+    }
+    while (state.KeepRunning()) {
+        Parcel reply;
+        if (binder->transact(kRawCode, data, &reply) != android::UNKNOWN_TRANSACTION) {
+            state.SkipWithError("transact failed");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * shape.bytes);
+}
+
+#define SG_BENCHMARKS(shape, args)                 \
+    BENCHMARK_TEMPLATE(BM_write, shape)->args;     \
+    BENCHMARK_TEMPLATE(BM_read, shape)->args;      \
+    if (remote) {                                  \
+        BENCHMARK_TEMPLATE(BM_send, shape)->args;  \
+    }
+
+static void registerBenchmarks(bool remote) {
+    SG_BENCHMARKS(Strings, Args({16, 32})->Args({256, 32})->Args({16, 4096}));
+    SG_BENCHMARKS(Vectors, Args({16, 64})->Args({256, 64})->Args({16, 16384}));
+    SG_BENCHMARKS(Handles, Args({1, 1})->Args({16, 1})->Args({16, 4}));
+    SG_BENCHMARKS(Chain, Arg(1)->Arg(8)->Arg(64)->Arg(512));
+}
+
+static void startServer() {
+    sp<IBenchmark> service = IBenchmark::getService(gServiceName, true);
+    if (service->registerAsService(gServiceName) != OK) {
+        ALOGE("Failed to register service %s.", gServiceName);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    bool remote = true;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "-local") {
+            remote = false;
+        }
+    }
+    registerBenchmarks(remote);
+    ::benchmark::Initialize(&argc, argv);
+
+    if (!remote) {
+        ::benchmark::RunSpecifiedBenchmarks();
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child, start benchmarks
+        ::benchmark::RunSpecifiedBenchmarks();
+    } else {
+        startServer();
+        while (true) {
+            int stat, retval;
+            retval = wait(&stat);
+            if (retval == -1 && errno == ECHILD) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -15,12 +15,22 @@
  */
 #define LOG_TAG "HwbinderThroughputTest"
 
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -28,6 +38,12 @@
 
 #include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
 #include <hidl/HidlSupport.h>
+#include <hidl/HidlTransportSupport.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+
+#include "Histogram.h"
+#include "PerfCounters.h"
 
 using namespace std;
 using namespace android;
@@ -68,21 +84,33 @@ class Pipe {
     }
     void signal() {
         bool val = true;
-        int error = write(m_writeFd, &val, sizeof(val));
-        ASSERT_TRUE(error >= 0);
+        send(val);
     }
     void wait() {
         bool val = false;
-        int error = read(m_readFd, &val, sizeof(val));
-        ASSERT_TRUE(error >= 0);
+        recv(val);
     }
+    // Results are larger than the pipe buffer, so keep going until the
+    // whole object has been moved.
     template<typename T> void send(const T& v) {
-        int error = write(m_writeFd, &v, sizeof(T));
-        ASSERT_TRUE(error >= 0);
+        const uint8_t* cursor = reinterpret_cast<const uint8_t*>(&v);
+        for (size_t left = sizeof(T); left > 0;) {
+            ssize_t n = write(m_writeFd, cursor, left);
+            if (n < 0 && errno == EINTR) continue;
+            ASSERT_TRUE(n > 0);
+            cursor += n;
+            left -= n;
+        }
     }
     template<typename T> void recv(T& v) {
-        int error = read(m_readFd, &v, sizeof(T));
-        ASSERT_TRUE(error >= 0);
+        uint8_t* cursor = reinterpret_cast<uint8_t*>(&v);
+        for (size_t left = sizeof(T); left > 0;) {
+            ssize_t n = read(m_readFd, cursor, left);
+            if (n < 0 && errno == EINTR) continue;
+            ASSERT_TRUE(n > 0);
+            cursor += n;
+            left -= n;
+        }
     }
     static tuple<Pipe, Pipe> createPipePair() {
         int a[2];
@@ -97,79 +125,340 @@ class Pipe {
     }
 };
 
-static const uint32_t num_buckets = 128;
-static const uint64_t max_time_bucket = 50ull * 1000000;
-static const uint64_t time_per_bucket = max_time_bucket / num_buckets;
-static constexpr float time_per_bucket_ms = time_per_bucket / 1.0E6;
-
 struct ProcResults {
-    uint64_t m_best = max_time_bucket;
-    uint64_t m_worst = 0;
-    uint32_t m_buckets[num_buckets] = {0};
-    uint64_t m_transactions = 0;
-    uint64_t m_total_time = 0;
-
-    // Add a new latency data point and update the aggregation info
-    // e.g. best/worst/total_time.
+    LatencyHistogram m_histogram;
+    PerfCounterValues m_counters;
+
+    // Add a new latency data point.
     void add_time(uint64_t time) {
-        m_buckets[min(time, max_time_bucket - 1) / time_per_bucket] += 1;
-        m_best = min(time, m_best);
-        m_worst = max(time, m_worst);
-        m_transactions += 1;
-        m_total_time += time;
+        m_histogram.record(time);
     }
-    // Combine two sets of latency data points and update the aggregation info.
+    // Combine two sets of latency data points.
     static ProcResults combine(const ProcResults& a, const ProcResults& b) {
-        ProcResults ret;
-        for (uint32_t i = 0; i < num_buckets; i++) {
-            ret.m_buckets[i] = a.m_buckets[i] + b.m_buckets[i];
-        }
-        ret.m_worst = max(a.m_worst, b.m_worst);
-        ret.m_best = min(a.m_best, b.m_best);
-        ret.m_transactions = a.m_transactions + b.m_transactions;
-        ret.m_total_time = a.m_total_time + b.m_total_time;
+        ProcResults ret = a;
+        ret.m_histogram.add(b.m_histogram);
+        ret.m_counters.add(b.m_counters);
         return ret;
     }
     // Calculate and report the final aggregated results.
     void dump() {
-        double best = (double) m_best / 1.0E6;
-        double worst = (double) m_worst / 1.0E6;
-        double average = (double) m_total_time / m_transactions / 1.0E6;
         cout << "average:"
-             << average
+             << m_histogram.mean() / 1.0E6
              << "ms worst:"
-             << worst
+             << m_histogram.max() / 1.0E6
              << "ms best:"
-             << best
+             << m_histogram.min() / 1.0E6
              << "ms"
              << endl;
+        cout << "50%: " << m_histogram.percentile(50) / 1.0E6 << " "
+             << "90%: " << m_histogram.percentile(90) / 1.0E6 << " "
+             << "95%: " << m_histogram.percentile(95) / 1.0E6 << " "
+             << "99%: " << m_histogram.percentile(99) / 1.0E6 << " "
+             << "99.9%: " << m_histogram.percentile(99.9) / 1.0E6 << " "
+             << endl;
+        cout << "latency_ms: ";
+        m_histogram.dumpJson(cout, 1.0E6);
+        cout << endl;
+        if (m_counters.available) {
+            cout << "perf_per_call: ";
+            m_counters.dumpJson(cout, m_histogram.count());
+            cout << endl;
+        }
+    }
+};
 
-        uint64_t cur_total = 0;
-        for (uint32_t i = 0; i < num_buckets; i++) {
-            float cur_time = time_per_bucket_ms * i + 0.5f * time_per_bucket_ms;
-            if ((cur_total < 0.5f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.5f * m_transactions)) {
-                cout << "50%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.9f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.9f * m_transactions)) {
-                cout << "90%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.95f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.95f * m_transactions)) {
-                cout << "95%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.99f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.99f * m_transactions)) {
-                cout << "99%: " << cur_time << " ";
+// A request size in bytes, drawn from one of:
+//   fixed:N             always N
+//   uniform:MIN:MAX     uniformly in [MIN, MAX]
+//   exp:MEAN            exponentially distributed around MEAN
+//   choice:A,B,...      one of the listed sizes, each equally likely
+class SizeDistribution {
+ public:
+    // Keeps single requests well inside the receiver's binder buffer.
+    static constexpr size_t kMaxSize = 256 * 1024;
+
+    bool parse(const string& spec) {
+        m_values.clear();
+        size_t colon = spec.find(':');
+        if (colon == string::npos) return false;
+        m_kind = spec.substr(0, colon);
+        string args = spec.substr(colon + 1);
+        for (size_t pos = 0; pos <= args.size();) {
+            size_t end = args.find_first_of(":,", pos);
+            if (end == string::npos) end = args.size();
+            m_values.push_back(strtoul(args.substr(pos, end - pos).c_str(), nullptr, 0));
+            pos = end + 1;
+        }
+        for (size_t value : m_values) {
+            if (value > kMaxSize) return false;
+        }
+        if (m_kind == "fixed" || m_kind == "exp") return m_values.size() == 1;
+        if (m_kind == "uniform") return m_values.size() == 2 && m_values[0] <= m_values[1];
+        return m_kind == "choice" && !m_values.empty();
+    }
+    size_t sample(mt19937_64& rng) const {
+        if (m_kind == "uniform") {
+            return uniform_int_distribution<size_t>(m_values[0], m_values[1])(rng);
+        }
+        if (m_kind == "exp") {
+            double size = exponential_distribution<double>(1.0 / m_values[0])(rng);
+            return min(size_t(size), kMaxSize);
+        }
+        if (m_kind == "choice") {
+            return m_values[uniform_int_distribution<size_t>(0, m_values.size() - 1)(rng)];
+        }
+        return m_values[0];
+    }
+
+ private:
+    string m_kind = "fixed";
+    vector<size_t> m_values = {16};
+};
+
+// Picks the service each request goes to:
+//   uniform             every service equally likely
+//   zipf:S              service k with weight 1/(k+1)^S, so a few are hot
+//   roundrobin          in turn
+class ServiceSelector {
+ public:
+    bool parse(const string& spec) {
+        m_kind = spec.substr(0, spec.find(':'));
+        if (m_kind == "zipf") {
+            if (spec.size() <= 5) return false;
+            m_skew = atof(spec.c_str() + 5);
+            return m_skew >= 0;
+        }
+        return m_kind == "uniform" || m_kind == "roundrobin";
+    }
+    void setup(int service_count) {
+        vector<double> weights;
+        for (int i = 0; i < service_count; i++) {
+            weights.push_back(m_kind == "zipf" ? 1.0 / pow(i + 1, m_skew) : 1.0);
+        }
+        m_dist = discrete_distribution<int>(weights.begin(), weights.end());
+        m_count = service_count;
+    }
+    int next(mt19937_64& rng) {
+        if (m_kind == "roundrobin") return m_next++ % m_count;
+        return m_dist(rng);
+    }
+
+ private:
+    string m_kind = "uniform";
+    double m_skew = 0;
+    discrete_distribution<int> m_dist;
+    int m_count = 1;
+    int m_next = 0;
+};
+
+// How requests are issued. In the default closed loop a worker sends its
+// next request as soon as the previous one returns. In the open loop each
+// worker follows a schedule of intended send times at rate/workers
+// requests per second, and latency is measured from the intended send
+// time, so time spent waiting behind a slow request is counted instead of
+// hidden (coordinated omission).
+struct LoadConfig {
+    bool open_loop = false;
+    double rate = 0;             // requests per second, over all workers
+    bool poisson = false;        // exponential gaps instead of fixed ones
+    double oneway_ratio = 0;     // share of requests sent oneway
+    SizeDistribution sizes;
+    ServiceSelector selector;
+};
+
+// Not a method of IBenchmark. Oneway requests are sent with this code so
+// that they carry an arbitrary payload; the stub answers
+// UNKNOWN_TRANSACTION, which is dropped for oneway calls.
+static const uint32_t kRawOnewayCode = 0x00ffffff;
+
+// Count perf events in the workers' timed loops, set by -perf.
+static bool perf_counters = false;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ull;
+    ts.tv_nsec = deadline % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+// Soak mode, set by -soak: workers run for soak_seconds instead of a number
+// of iterations, and every process samples itself every soak_interval_s.
+static uint64_t soak_seconds = 0;
+static uint64_t soak_interval_s = 10;
+
+// What a process looks like at one point of a soak run.
+struct SoakSample {
+    uint64_t t_s;            // since the process started sampling
+    uint64_t rss_kb;
+    uint64_t threads;
+    uint64_t fds;
+    uint64_t parcel_bytes;   // Parcel::getGlobalAllocSize()
+    uint64_t parcel_allocs;  // Parcel::getGlobalAllocCount()
+    uint64_t handles;        // entries in the handle table
+    uint64_t proxies;        // of which have a BpHwBinder
+};
+
+static const struct {
+    const char* name;
+    uint64_t SoakSample::*field;
+} kSoakMetrics[] = {
+    {"rss_kb", &SoakSample::rss_kb},
+    {"threads", &SoakSample::threads},
+    {"fds", &SoakSample::fds},
+    {"parcel_bytes", &SoakSample::parcel_bytes},
+    {"parcel_allocs", &SoakSample::parcel_allocs},
+    {"handles", &SoakSample::handles},
+    {"proxies", &SoakSample::proxies},
+};
+
+// The samples of one process. Fixed size, so it can go through a Pipe;
+// when full, every other sample is dropped and from then on only every
+// other tick is kept, so a run of any length fits.
+struct SoakSeries {
+    static constexpr uint32_t kMaxSamples = 2048;
+
+    uint32_t count = 0;
+    uint32_t stride = 1;
+    uint64_t ticks = 0;
+    SoakSample samples[kMaxSamples];
+
+    void add(const SoakSample& sample) {
+        if (ticks++ % stride != 0) return;
+        if (count == kMaxSamples) {
+            for (uint32_t i = 0; i < count / 2; i++) {
+                samples[i] = samples[2 * i];
             }
-            cur_total += m_buckets[i];
+            count /= 2;
+            stride *= 2;
         }
-        cout << endl;
+        samples[count++] = sample;
+    }
+};
+
+// value of a "Key:   value" line of /proc/self/status
+static uint64_t proc_status(const string& key) {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, key.size(), key) == 0) {
+            return strtoull(line.c_str() + key.size(), nullptr, 10);
+        }
+    }
+    return 0;
+}
 
+static uint64_t count_fds() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == nullptr) return 0;
+    uint64_t count = 0;
+    while (readdir(dir) != nullptr) {
+        count++;
     }
+    closedir(dir);
+    // ".", ".." and the fd of dir itself
+    return count - 3;
+}
+
+static SoakSample take_soak_sample(uint64_t start_ns) {
+    SoakSample sample = {};
+    sample.t_s = (now_ns() - start_ns) / 1000000000ull;
+    sample.rss_kb = proc_status("VmRSS:");
+    sample.threads = proc_status("Threads:");
+    sample.fds = count_fds();
+    sample.parcel_bytes = Parcel::getGlobalAllocSize();
+    sample.parcel_allocs = Parcel::getGlobalAllocCount();
+    // don't open the driver just for this in passthrough mode
+    sp<ProcessState> process = ProcessState::selfOrNull();
+    if (process != nullptr) {
+        ProcessState::HandleTableStats stats = process->getHandleTableStats();
+        sample.handles = stats.entries;
+        sample.proxies = stats.proxies;
+    }
+    return sample;
+}
+
+// Samples the calling process from a thread of its own until stop().
+class SoakSampler {
+ public:
+    void start() {
+        m_series.reset(new SoakSeries);
+        m_thread = thread([this] { run(); });
+    }
+    const SoakSeries& stop() {
+        {
+            lock_guard<mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+        return *m_series;
+    }
+
+ private:
+    void run() {
+        uint64_t start = now_ns();
+        auto next = chrono::steady_clock::now();
+        unique_lock<mutex> lock(m_lock);
+        while (!m_stop) {
+            m_series->add(take_soak_sample(start));
+            next += chrono::seconds(soak_interval_s);
+            m_wake.wait_until(lock, next, [this] { return m_stop; });
+        }
+        // the state at the end of the run
+        m_series->add(take_soak_sample(start));
+    }
+
+    unique_ptr<SoakSeries> m_series;
+    thread m_thread;
+    mutex m_lock;
+    condition_variable m_wake;
+    bool m_stop = false;
 };
 
+// Prints the series of one process, and a growth line for each metric
+// that, past the first quarter of the run, never went down and ended
+// higher than it started. Returns whether any did.
+static bool dump_soak(const string& process, const SoakSeries& series) {
+    cout << "soak_series: { \"process\":\"" << process << "\", \"samples\":[";
+    for (uint32_t i = 0; i < series.count; i++) {
+        const SoakSample& s = series.samples[i];
+        cout << (i == 0 ? "" : ",") << "{\"t_s\":" << s.t_s;
+        for (const auto& metric : kSoakMetrics) {
+            cout << ",\"" << metric.name << "\":" << s.*metric.field;
+        }
+        cout << "}";
+    }
+    cout << "] }" << endl;
+
+    uint32_t first = series.count / 4;
+    if (series.count < first + 4) return false;
+    const SoakSample& from = series.samples[first];
+    const SoakSample& to = series.samples[series.count - 1];
+    bool growing = false;
+    for (const auto& metric : kSoakMetrics) {
+        bool monotonic = true;
+        for (uint32_t i = first + 1; i < series.count; i++) {
+            monotonic &= series.samples[i].*metric.field >= series.samples[i - 1].*metric.field;
+        }
+        if (!monotonic || to.*metric.field <= from.*metric.field) continue;
+        double hours = (to.t_s - from.t_s) / 3600.0;
+        cout << "soak_growth: { \"process\":\"" << process << "\", \"metric\":\""
+             << metric.name << "\", \"from\":" << from.*metric.field
+             << ", \"to\":" << to.*metric.field << ", \"per_hour\":"
+             << (hours > 0 ? (to.*metric.field - from.*metric.field) / hours : 0) << " }"
+             << endl;
+        growing = true;
+    }
+    return growing;
+}
+
 string generateServiceName(int num) {
     string serviceName = "hwbinderService" + to_string(num);
     return serviceName;
@@ -187,9 +476,18 @@ void service_fx(const string &serviceName, Pipe p) {
 
     ALOGD("Starting %s", serviceName.c_str());
 
+    SoakSampler sampler;
+    if (soak_seconds) {
+        sampler.start();
+    }
     // Signal service started to master and wait to exit.
     p.signal();
     p.wait();
+    if (soak_seconds) {
+        // Send the samples to master and wait for go to exit.
+        p.send(sampler.stop());
+        p.wait();
+    }
     exit(EXIT_SUCCESS);
 }
 
@@ -198,13 +496,22 @@ void worker_fx(
         int iterations,
         int service_count,
         bool get_stub,
+        int worker_count,
+        LoadConfig config,
         Pipe p) {
-    srand(num);
+    mt19937_64 rng(num);
+    config.selector.setup(service_count);
     p.signal();
     p.wait();
 
+    SoakSampler sampler;
+    if (soak_seconds) {
+        sampler.start();
+    }
+
     // Get references to test services.
     vector<sp<IBenchmark>> workers;
+    vector<sp<IBinder>> binders;
 
     for (int i = 0; i < service_count; i++) {
         sp<IBenchmark> service = IBenchmark::getService(
@@ -216,33 +523,70 @@ void worker_fx(
             ASSERT_TRUE(service->isRemote());
         }
         workers.push_back(service);
+        binders.push_back(get_stub ? nullptr : toBinder<IBenchmark>(service));
     }
 
     ProcResults results;
-    chrono::time_point<chrono::high_resolution_clock> start, end;
     // Prepare data to IPC
+    vector<uint8_t> payload(SizeDistribution::kMaxSize);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = i;
+    }
     hidl_vec<uint8_t> data_vec;
-    data_vec.resize(16);
-    for (size_t i = 0; i < data_vec.size(); i++) {
-        data_vec[i] = i;
+    bernoulli_distribution oneway(config.oneway_ratio);
+    const double worker_rate = config.open_loop ? config.rate / worker_count : 1.0;
+    exponential_distribution<double> gap(worker_rate);
+    PerfCounters counters;
+    bool counting = perf_counters && counters.open();
+    if (counting) {
+        counters.start();
     }
+    uint64_t intended = now_ns();
+    const uint64_t soak_end = intended + soak_seconds * 1000000000ull;
     // Run the benchmark.
-    for (int i = 0; i < iterations; i++) {
-        // Randomly pick a service.
-        int target = rand() % service_count;
+    for (int i = 0; soak_seconds ? now_ns() < soak_end : i < iterations; i++) {
+        int target = config.selector.next(rng);
+        size_t size = config.sizes.sample(rng);
+        bool is_oneway = oneway(rng);
+
+        uint64_t start;
+        if (config.open_loop) {
+            intended += uint64_t((config.poisson ? gap(rng) : 1.0 / worker_rate) * 1.0E9);
+            // Behind schedule, the request goes out immediately and the
+            // delay is part of its latency.
+            sleep_until_ns(intended);
+            start = intended;
+        } else {
+            start = now_ns();
+        }
 
-        start = chrono::high_resolution_clock::now();
-        Return<void> ret = workers[target]->sendVec(data_vec, [&](const auto &) {});
-        if (!ret.isOk()) {
+        status_t status = OK;
+        string description;
+        if (is_oneway && binders[target] != nullptr) {
+            Parcel data;
+            data.write(payload.data(), size);
+            status = binders[target]->transact(kRawOnewayCode, data, nullptr,
+                                               IBinder::FLAG_ONEWAY);
+            description = "transact error " + to_string(status);
+        } else {
+            data_vec.setToExternal(payload.data(), size);
+            Return<void> ret = workers[target]->sendVec(data_vec, [&](const auto &) {});
+            if (!ret.isOk()) {
+                status = UNKNOWN_ERROR;
+                description = ret.description();
+            }
+        }
+        if (status != OK) {
             cout << "thread " << num << " failed status: "
-                << ret.description() << endl;
+                << description << endl;
             exit(EXIT_FAILURE);
         }
-        end = chrono::high_resolution_clock::now();
 
-        uint64_t cur_time = uint64_t(
-               chrono::duration_cast<chrono::nanoseconds>(end - start).count());
-        results.add_time(cur_time);
+        results.add_time(now_ns() - start);
+    }
+    if (counting) {
+        counters.stop();
+        results.m_counters = counters.read();
     }
     // Signal completion to master and wait.
     p.signal();
@@ -250,6 +594,9 @@ void worker_fx(
 
     // Send results to master and wait for go to exit.
     p.send(results);
+    if (soak_seconds) {
+        p.send(sampler.stop());
+    }
     p.wait();
 
     exit (EXIT_SUCCESS);
@@ -269,7 +616,8 @@ Pipe make_service(string service_name) {
     }
 }
 
-Pipe make_worker(int num, int iterations, int service_count, bool get_stub) {
+Pipe make_worker(int num, int iterations, int service_count, bool get_stub,
+                 int worker_count, const LoadConfig& config) {
     auto pipe_pair = Pipe::createPipePair();
     pid_t pid = fork();
     if (pid) {
@@ -277,8 +625,8 @@ Pipe make_worker(int num, int iterations, int service_count, bool get_stub) {
         return move(get<0>(pipe_pair));
     } else {
         /* child */
-        worker_fx(num, iterations, service_count, get_stub,
-                  move(get<1>(pipe_pair)));
+        worker_fx(num, iterations, service_count, get_stub, worker_count,
+                  config, move(get<1>(pipe_pair)));
         /* never get here */
         return move(get<0>(pipe_pair));
     }
@@ -310,6 +658,9 @@ int main(int argc, char *argv[]) {
     // Num of services.
     int services = -1;
     int iterations = 10000;
+    LoadConfig config;
+    bool size_set = false;
+    bool oneway_set = false;
 
     vector<Pipe> worker_pipes;
     vector<Pipe> service_pipes;
@@ -338,6 +689,74 @@ int main(int argc, char *argv[]) {
             i++;
             continue;
         }
+        if (string(argv[i]) == "-perf") {
+            perf_counters = true;
+            continue;
+        }
+        if (string(argv[i]) == "-soak") {
+            soak_seconds = strtoull(argv[i + 1], nullptr, 0);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-soak_interval") {
+            soak_interval_s = strtoull(argv[i + 1], nullptr, 0);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-rate") {
+            config.open_loop = true;
+            config.rate = atof(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-arrival") {
+            config.poisson = !strcmp(argv[i + 1], "poisson");
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-oneway") {
+            config.oneway_ratio = atof(argv[i + 1]);
+            oneway_set = true;
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-size") {
+            size_set = true;
+            if (!config.sizes.parse(argv[i + 1])) {
+                cerr << "bad size distribution: " << argv[i + 1] << endl;
+                return EXIT_FAILURE;
+            }
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-select") {
+            if (!config.selector.parse(argv[i + 1])) {
+                cerr << "bad service selection: " << argv[i + 1] << endl;
+                return EXIT_FAILURE;
+            }
+            i++;
+            continue;
+        }
+    }
+    if (config.open_loop && config.rate <= 0) {
+        cerr << "-rate must be positive" << endl;
+        return EXIT_FAILURE;
+    }
+    if (config.oneway_ratio < 0 || config.oneway_ratio > 1) {
+        cerr << "-oneway must be between 0 and 1" << endl;
+        return EXIT_FAILURE;
+    }
+    if (soak_interval_s == 0) {
+        cerr << "-soak_interval must be positive" << endl;
+        return EXIT_FAILURE;
+    }
+    if (soak_seconds) {
+        // Unless told otherwise, soak with a mix of small and large,
+        // twoway and oneway requests.
+        if (!size_set) config.sizes.parse("choice:16,256,4096,65536");
+        if (!oneway_set) config.oneway_ratio = 0.2;
+        cout << "soaking for " << soak_seconds << "s, sampling every "
+             << soak_interval_s << "s" << endl;
     }
     // If service number is not provided, set it the same as the worker number.
     if (services == -1) {
@@ -358,7 +777,8 @@ int main(int argc, char *argv[]) {
     // Create workers (test clients).
     bool get_stub = mode == HwBinderMode::kBinderize ? false : true;
     for (int i = 0; i < workers; i++) {
-        worker_pipes.push_back(make_worker(i, iterations, services, get_stub));
+        worker_pipes.push_back(make_worker(i, iterations, services, get_stub,
+                                           workers, config));
     }
     // Wait untill all workers are ready.
     wait_all(worker_pipes);
@@ -372,19 +792,32 @@ int main(int argc, char *argv[]) {
     end = chrono::high_resolution_clock::now();
 
     // Calculate overall throughput.
-    double iterations_per_sec = double(iterations * workers)
-        / (chrono::duration_cast < chrono::nanoseconds
-            > (end - start).count() / 1.0E9);
-    cout << "iterations per sec: " << iterations_per_sec << endl;
+    double seconds = chrono::duration_cast < chrono::nanoseconds
+            > (end - start).count() / 1.0E9;
+    if (config.open_loop) {
+        cout << "offered per sec: " << config.rate << endl;
+    }
+    if (!soak_seconds) {
+        cout << "iterations per sec: " << iterations * workers / seconds << endl;
+    }
 
     // Collect all results from the workers.
     cout << "collecting results" << endl;
     signal_all(worker_pipes);
     ProcResults tot_results;
+    bool growing = false;
     for (int i = 0; i < workers; i++) {
         ProcResults tmp_results;
         worker_pipes[i].recv(tmp_results);
         tot_results = ProcResults::combine(tot_results, tmp_results);
+        if (soak_seconds) {
+            unique_ptr<SoakSeries> series(new SoakSeries);
+            worker_pipes[i].recv(*series);
+            growing |= dump_soak("worker" + to_string(i), *series);
+        }
+    }
+    if (soak_seconds) {
+        cout << "iterations per sec: " << tot_results.m_histogram.count() / seconds << endl;
     }
     tot_results.dump();
 
@@ -392,6 +825,14 @@ int main(int argc, char *argv[]) {
         // Kill all the services.
         cout << "killing services" << endl;
         signal_all(service_pipes);
+        if (soak_seconds) {
+            for (int i = 0; i < services; i++) {
+                unique_ptr<SoakSeries> series(new SoakSeries);
+                service_pipes[i].recv(*series);
+                growing |= dump_soak(generateServiceName(i), *series);
+            }
+            signal_all(service_pipes);
+        }
         for (int i = 0; i < services; i++) {
             int status;
             wait(&status);
@@ -410,5 +851,8 @@ int main(int argc, char *argv[]) {
             cout << "nonzero child status" << status << endl;
         }
     }
+    if (soak_seconds) {
+        cout << "soak: " << (growing ? "GROWTH" : "PASS") << endl;
+    }
     return 0;
 }
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HWBINDER_PERF_HISTOGRAM_H
+#define HWBINDER_PERF_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <type_traits>
+
+// Log-linear latency histogram, in the style of HdrHistogram.
+//
+// Values below 2^kPrecisionBits are counted exactly. Above that, every
+// power-of-two range is split into 2^(kPrecisionBits - 1) equal buckets,
+// so a value is known to within 1 / 2^(kPrecisionBits - 1) of itself
+// (0.8% with the default 8 bits) whatever its magnitude. Values of
+// 2^kMaxBits and up share the last bucket; the exact maximum is kept
+// separately.
+//
+// The histogram is trivially copyable and has a fixed size, so forked
+// workers can send it through a Pipe and the parent merges them with
+// add().
+//
+//  LatencyHistogram h;
+//  h.record(nano);
+//  ...
+//  total.add(h);
+//  total.dumpJson(cout, 1.0E6);   // in ms
+//
+template <unsigned kPrecisionBits = 8, unsigned kMaxBits = 36>
+class LogLinearHistogram {
+    static_assert(kPrecisionBits >= 2 && kPrecisionBits < kMaxBits && kMaxBits < 64,
+                  "bad histogram layout");
+
+   public:
+    static constexpr uint32_t kHalfBucketCount = 1u << (kPrecisionBits - 1);
+    static constexpr uint32_t kBucketCount = (kMaxBits - kPrecisionBits + 2) * kHalfBucketCount;
+
+    void record(uint64_t value, uint64_t count = 1) {
+        counts_[indexOf(value)] += count;
+        if (total_ == 0 || value < min_) min_ = value;
+        max_ = std::max(max_, value);
+        total_ += count;
+        sum_ += value * count;
+    }
+
+    // Merges the samples of another histogram into this one.
+    void add(const LogLinearHistogram& other) {
+        if (other.total_ == 0) return;
+        for (uint32_t i = 0; i < kBucketCount; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        min_ = total_ == 0 ? other.min_ : std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+        total_ += other.total_;
+        sum_ += other.sum_;
+    }
+
+    void reset() { *this = LogLinearHistogram(); }
+
+    uint64_t count() const { return total_; }
+    uint64_t min() const { return min_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ == 0 ? 0 : (double)sum_ / total_; }
+
+    // The value below which |percentile| percent of the samples fall: the
+    // middle of the bucket that holds that sample, kept within the exact
+    // min and max.
+    uint64_t percentile(double percentile) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = (uint64_t)(percentile / 100.0 * total_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total_));
+        if (rank == total_) return max_;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < kBucketCount; i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t middle = lowestOf(i) + (widthOf(i) - 1) / 2;
+                return std::min(std::max(middle, min_), max_);
+            }
+        }
+        return max_;
+    }
+
+    // Writes { "count", "avg", "min", "p50", "p90", "p99", "p99.9", "max" }
+    // with every value divided by |unit|.
+    void dumpJson(std::ostream& out, double unit = 1.0) const {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(unit >= 1.0E6 ? 4 : unit >= 1.0E3 ? 3 : 0);
+        out << "{ \"count\":" << total_ << ", \"avg\":" << mean() / unit
+            << ", \"min\":" << min_ / unit << ", \"p50\":" << percentile(50) / unit
+            << ", \"p90\":" << percentile(90) / unit << ", \"p99\":" << percentile(99) / unit
+            << ", \"p99.9\":" << percentile(99.9) / unit << ", \"max\":" << max_ / unit << " }";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+   private:
+    static uint32_t indexOf(uint64_t value) {
+        if (value >= (1ull << kMaxBits)) return kBucketCount - 1;
+        if (value < (1ull << kPrecisionBits)) return value;
+        unsigned shift = 64 - __builtin_clzll(value) - kPrecisionBits;
+        return (shift << (kPrecisionBits - 1)) + (value >> shift);
+    }
+    static unsigned shiftOf(uint32_t index) {
+        return index < 2 * kHalfBucketCount ? 0 : index / kHalfBucketCount - 1;
+    }
+    static uint64_t lowestOf(uint32_t index) {
+        unsigned shift = shiftOf(index);
+        return (uint64_t)(index - (shift << (kPrecisionBits - 1))) << shift;
+    }
+    static uint64_t widthOf(uint32_t index) { return 1ull << shiftOf(index); }
+
+    uint64_t counts_[kBucketCount] = {};
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Nanosecond latencies up to about a minute, to within 0.8%.
+typedef LogLinearHistogram<> LatencyHistogram;
+
+static_assert(std::is_trivially_copyable<LatencyHistogram>::value,
+              "LatencyHistogram is sent between processes as raw bytes");
+
+#endif
@@ -15,31 +15,31 @@
  */
 #include <android/hardware/tests/libhwbinder/1.0/IScheduleTest.h>
 #include <hidl/LegacySupport.h>
+#include <hwbinder/Binder.h>
+#include <hwbinder/ProcessState.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include "PerfCounters.h"
 #include "PerfTest.h"
 
-#ifdef ASSERT
-#undef ASSERT
-#endif
-#define ASSERT(cond)                                                                              \
-    do {                                                                                          \
-        if (!(cond)) {                                                                            \
-            cerr << __func__ << ":" << __LINE__ << " condition:" << #cond << " failed\n" << endl; \
-            exit(EXIT_FAILURE);                                                                   \
-        }                                                                                         \
-    } while (0)
-
 #define REQUIRE(stat)      \
     do {                   \
         int cond = (stat); \
         ASSERT(cond);      \
     } while (0)
 
+using android::hardware::BHwBinder;
+using android::hardware::ProcessState;
 using android::hardware::registerPassthroughServiceImplementation;
 using android::hardware::tests::libhwbinder::V1_0::IScheduleTest;
 using android::sp;
@@ -61,6 +61,9 @@ static vector<sp<IScheduleTest> > services;
 
 // default arguments
 static bool dump_raw_data = false;
+static bool perf_counters = false;
+static string raw_file;
+static size_t raw_capacity = 0;
 static int no_pair = 1;
 static int iterations = 100;
 static int verbose = 0;
@@ -68,6 +71,26 @@ static int is_tracing;
 static bool pass_through = false;
 // the deadline latency that we are interested in
 static uint64_t deadline_us = 2500;
+// create a fifo thread per call, as the first version of this test did
+static bool fifo_per_call = false;
+// per pair: the cpu of the callers and of the service, -1 for any
+static vector<std::pair<int, int> > pair_cpus;
+static string cpus_arg = "any";
+// interference to run the test under, one run each; "+" combines them
+static vector<string> scenarios = {"none"};
+static int hogs_per_kind = 0;
+static string current_scenario;
+
+// What the service nodes are published with, see parsePolicies().
+struct NodePolicy {
+    string name;
+    int policy;
+    int priority;
+    bool inheritRt;
+};
+// one run of all the scenarios each; none for the process defaults
+static vector<NodePolicy> policies;
+static string current_policy;
 
 static bool traceIsOn() {
     fstream file;
@@ -108,10 +131,17 @@ struct ThreadArg {
     int target;    ///< the terget service number
 };
 
-static void* threadStart(void* p) {
-    ThreadArg* priv = (ThreadArg*)p;
-    int target = priv->target;
-    PResults* presults = (PResults*)priv->result;
+static void pinToCpu(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    REQUIRE(!sched_setaffinity(0, sizeof(set), &set));
+}
+
+static void fifoTransaction(int target, PResults* presults) {
     Tick sta, end;
 
     threadDumpPri("fifo-caller");
@@ -124,27 +154,108 @@ static void* threadStart(void* p) {
 
     presults->nNotInherent += (ret >> 16) & 0xffff;
     presults->nNotSync += ret & 0xffff;
+}
+
+static void* threadStart(void* p) {
+    ThreadArg* priv = (ThreadArg*)p;
+    fifoTransaction(priv->target, (PResults*)priv->result);
     return 0;
 }
 
+static void fifoThreadAttr(pthread_attr_t* attr) {
+    sched_param param;
+    REQUIRE(!pthread_attr_init(attr));
+    REQUIRE(!pthread_attr_setschedpolicy(attr, SCHED_FIFO));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    REQUIRE(!pthread_attr_setschedparam(attr, &param));
+}
+
 // create a fifo thread to transact and wait it to finished
 static void threadTransaction(int target, PResults* presults) {
     ThreadArg thread_arg;
     void* dummy;
     pthread_t thread;
     pthread_attr_t attr;
-    sched_param param;
     thread_arg.target = target;
     thread_arg.result = presults;
-    REQUIRE(!pthread_attr_init(&attr));
-    REQUIRE(!pthread_attr_setschedpolicy(&attr, SCHED_FIFO));
-    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
-    REQUIRE(!pthread_attr_setschedparam(&attr, &param));
+    fifoThreadAttr(&attr);
     REQUIRE(!pthread_create(&thread, &attr, threadStart, &thread_arg));
     REQUIRE(!pthread_join(thread, &dummy));
 }
 
-static void serviceFx(const string& serviceName, Pipe p) {
+// A fifo thread that stays up for the whole run and makes one transaction
+// each time it is kicked, so that creating threads doesn't disturb the
+// calls. It inherits the cpu affinity of the client.
+struct FifoCaller {
+    ThreadArg arg;
+    pthread_t thread;
+    sem_t kick;
+    sem_t done;
+    bool stop;
+};
+
+static void semWait(sem_t* sem) {
+    while (sem_wait(sem) != 0) {
+        ASSERT(errno == EINTR);
+    }
+}
+
+static void* fifoCallerLoop(void* p) {
+    FifoCaller* caller = (FifoCaller*)p;
+    while (true) {
+        semWait(&caller->kick);
+        if (caller->stop) {
+            break;
+        }
+        fifoTransaction(caller->arg.target, (PResults*)caller->arg.result);
+        REQUIRE(!sem_post(&caller->done));
+    }
+    return 0;
+}
+
+static void startFifoCaller(FifoCaller* caller, int target, PResults* presults) {
+    pthread_attr_t attr;
+    caller->arg.target = target;
+    caller->arg.result = presults;
+    caller->stop = false;
+    REQUIRE(!sem_init(&caller->kick, 0, 0));
+    REQUIRE(!sem_init(&caller->done, 0, 0));
+    fifoThreadAttr(&attr);
+    REQUIRE(!pthread_create(&caller->thread, &attr, fifoCallerLoop, caller));
+}
+
+// make one transaction on the fifo thread and wait it to finished
+static void fifoCallerTransaction(FifoCaller* caller) {
+    REQUIRE(!sem_post(&caller->kick));
+    semWait(&caller->done);
+}
+
+static void stopFifoCaller(FifoCaller* caller) {
+    void* dummy;
+    caller->stop = true;
+    REQUIRE(!sem_post(&caller->kick));
+    REQUIRE(!pthread_join(caller->thread, &dummy));
+    sem_destroy(&caller->kick);
+    sem_destroy(&caller->done);
+}
+
+static std::pair<int, int> cpusOfPair(int num) {
+    if (pair_cpus.empty()) {
+        return {-1, -1};
+    }
+    return pair_cpus[num % pair_cpus.size()];
+}
+
+static void serviceFx(const string& serviceName, int cpu, const NodePolicy* policy, Pipe p) {
+    // the binder threads started later inherit this
+    pinToCpu(cpu);
+    if (policy != nullptr) {
+        // the node of the service is first sent below and picks these up
+        sp<ProcessState> proc = ProcessState::self();
+        REQUIRE(proc->setDefaultSchedulerPolicy(policy->policy, policy->priority) ==
+                ::android::OK);
+        proc->setDefaultInheritRt(policy->inheritRt);
+    }
     // Start service.
     if (registerPassthroughServiceImplementation<IScheduleTest>(serviceName) != ::android::OK) {
         cerr << "Failed to register service " << serviceName.c_str() << endl;
@@ -157,16 +268,19 @@ static void serviceFx(const string& serviceName, Pipe p) {
     exit(0);
 }
 
-static Pipe makeServiceProces(string service_name) {
+static Pipe makeServiceProces(string service_name, int cpu, const NodePolicy* policy,
+                              pid_t* service) {
     auto pipe_pair = Pipe::createPipePair();
     pid_t pid = fork();
+    ASSERT(pid >= 0);
     if (pid) {
+        *service = pid;
         // parent
         return move(get<0>(pipe_pair));
     } else {
         threadDumpPri("service");
         // child
-        serviceFx(service_name, move(get<1>(pipe_pair)));
+        serviceFx(service_name, cpu, policy, move(get<1>(pipe_pair)));
         // never get here
         ASSERT(0);
         return move(get<0>(pipe_pair));
@@ -176,9 +290,22 @@ static Pipe makeServiceProces(string service_name) {
 static void clientFx(int num, int server_count, int iterations, Pipe p) {
     PResults presults;
 
+    // both callers, and the fifo threads started below, run there
+    pinToCpu(cpusOfPair(num).first);
+
     presults.fifo.setTracingMode(is_tracing, deadline_us);
-    if (dump_raw_data) {
-        presults.fifo.setupRawData();
+    if (dump_raw_data || !raw_file.empty()) {
+        // out.<policy>.<scenario>.fifo_<pair> when there is more than one
+        string path = raw_file;
+        if (!path.empty() && policies.size() > 1) {
+            path += "." + current_policy;
+        }
+        if (!path.empty() && scenarios.size() > 1) {
+            path += "." + current_scenario;
+        }
+        // one fifo sample per iteration, so by default nothing is dropped
+        presults.fifo.setupRawData(raw_capacity ? raw_capacity : iterations,
+                                   path.empty() ? "" : path + ".fifo_" + to_string(num));
     }
 
     for (int i = 0; i < server_count; i++) {
@@ -197,6 +324,16 @@ static void clientFx(int num, int server_count, int iterations, Pipe p) {
     // wait for kick-off
     p.wait();
 
+    PerfCounters counters;
+    bool counting = perf_counters && counters.open();
+    // started after open() so that the counters follow it too
+    FifoCaller fifo_caller;
+    if (!fifo_per_call) {
+        startFifoCaller(&fifo_caller, num, &presults);
+    }
+    if (counting) {
+        counters.start();
+    }
     // Client for each pair iterates here
     // each iterations contains exactly 2 transactions
     for (int i = 0; i < iterations; i++) {
@@ -205,7 +342,11 @@ static void clientFx(int num, int server_count, int iterations, Pipe p) {
         int target = num;
 
         // 1. transaction by fifo thread
-        threadTransaction(target, &presults);
+        if (fifo_per_call) {
+            threadTransaction(target, &presults);
+        } else {
+            fifoCallerTransaction(&fifo_caller);
+        }
         threadDumpPri("other-caller");
 
         uint32_t call_sta = (threadGetPri() << 16) | sched_getcpu();
@@ -218,6 +359,13 @@ static void clientFx(int num, int server_count, int iterations, Pipe p) {
         presults.nNotInherent += (ret >> 16) & 0xffff;
         presults.nNotSync += ret & 0xffff;
     }
+    if (counting) {
+        counters.stop();
+        presults.counters = counters.read();
+    }
+    if (!fifo_per_call) {
+        stopFifoCaller(&fifo_caller);
+    }
     // tell main i'm done
     p.signal();
 
@@ -225,8 +373,8 @@ static void clientFx(int num, int server_count, int iterations, Pipe p) {
     p.wait();
     if (dump_raw_data) {
         cout << "\"fifo_" + to_string(num) + "_data\": ";
-        presults.flushRawData();
     }
+    presults.flushRawData(dump_raw_data);
     cout.flush();
     int sent = p.send(presults);
     ASSERT(sent >= 0);
@@ -236,10 +384,12 @@ static void clientFx(int num, int server_count, int iterations, Pipe p) {
     exit(0);
 }
 
-static Pipe makeClientProcess(int num, int iterations, int no_pair) {
+static Pipe makeClientProcess(int num, int iterations, int no_pair, pid_t* client) {
     auto pipe_pair = Pipe::createPipePair();
     pid_t pid = fork();
+    ASSERT(pid >= 0);
     if (pid) {
+        *client = pid;
         // parent
         return move(get<0>(pipe_pair));
     } else {
@@ -264,6 +414,233 @@ static void signalAll(vector<Pipe>& v) {
     }
 }
 
+// Interference generators. Each is a SCHED_OTHER process that runs until
+// it is killed.
+static void cpuHog() {
+    volatile uint64_t n = 0;
+    while (true) {
+        n++;
+    }
+}
+
+// keeps the copies of memoryHog() from being optimized out
+static volatile char hog_sink;
+
+// streams through buffers well beyond the caches
+static void memoryHog() {
+    const size_t size = 64 << 20;
+    vector<char> a(size), b(size);
+    while (true) {
+        memcpy(a.data(), b.data(), size);
+        memcpy(b.data(), a.data(), size);
+        hog_sink = a[size - 1];
+    }
+}
+
+// creates and reaps processes as fast as it can
+static void forkHog() {
+    while (true) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(0);
+        }
+        if (pid > 0) {
+            waitpid(pid, nullptr, 0);
+        }
+    }
+}
+
+static bool isHogKind(const string& kind) {
+    return kind == "cpu" || kind == "mem" || kind == "fork";
+}
+
+static vector<string> splitList(const string& arg, char separator) {
+    vector<string> items;
+    std::istringstream in(arg);
+    string item;
+    while (getline(in, item, separator)) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+// start hogs_per_kind hogs of every kind in |scenario|, e.g. "cpu+fork"
+static vector<pid_t> startHogs(const string& scenario) {
+    vector<pid_t> hogs;
+    for (const string& kind : splitList(scenario, '+')) {
+        if (kind == "none") {
+            continue;
+        }
+        for (int i = 0; i < hogs_per_kind; i++) {
+            pid_t pid = fork();
+            ASSERT(pid >= 0);
+            if (pid == 0) {
+                if (kind == "cpu") cpuHog();
+                if (kind == "mem") memoryHog();
+                if (kind == "fork") forkHog();
+                exit(EXIT_FAILURE);
+            }
+            hogs.push_back(pid);
+        }
+    }
+    return hogs;
+}
+
+static void stopHogs(const vector<pid_t>& hogs) {
+    for (pid_t pid : hogs) {
+        kill(pid, SIGKILL);
+    }
+    for (pid_t pid : hogs) {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+// -cpus 0:1,2:3 pins the callers of pair 0 to cpu 0 and its service to
+// cpu 1, and so on; pairs beyond the list start over from its beginning.
+// "-" leaves a side unpinned.
+static void parseCpus(const string& arg) {
+    auto cpu = [](const string& s) { return s == "-" ? -1 : atoi(s.c_str()); };
+    pair_cpus.clear();
+    for (const string& item : splitList(arg, ',')) {
+        vector<string> sides = splitList(item, ':');
+        ASSERT(sides.size() == 2);
+        pair_cpus.push_back({cpu(sides[0]), cpu(sides[1])});
+    }
+    cpus_arg = arg;
+}
+
+// -policies default,noinherit,nice:-10,fifo:10+noinherit: "default" is
+// SCHED_NORMAL at nice 0 with RT inheritance, as nodes are published
+// unless told otherwise; "nice:N", "fifo:N" and "rr:N" set the minimum
+// policy, "noinherit" turns RT inheritance off.
+static void parsePolicies(const string& arg) {
+    policies.clear();
+    for (const string& name : splitList(arg, ',')) {
+        NodePolicy policy = {name, SCHED_NORMAL, 0, true};
+        for (const string& item : splitList(name, '+')) {
+            vector<string> parts = splitList(item, ':');
+            int value = parts.size() == 2 ? atoi(parts[1].c_str()) : 0;
+            if (item == "noinherit") {
+                policy.inheritRt = false;
+            } else if (parts[0] == "nice" && parts.size() == 2) {
+                policy.policy = SCHED_NORMAL;
+                policy.priority = value;
+            } else if (parts[0] == "fifo" && parts.size() == 2) {
+                policy.policy = SCHED_FIFO;
+                policy.priority = value;
+            } else if (parts[0] == "rr" && parts.size() == 2) {
+                policy.policy = SCHED_RR;
+                policy.priority = value;
+            } else {
+                ASSERT(item == "default");
+            }
+        }
+        ASSERT(BHwBinder::isValidSchedulerPolicy(policy.policy, policy.priority));
+        policies.push_back(policy);
+    }
+    ASSERT(!policies.empty());
+}
+
+// Whether the calls to a node with |policy| are expected to run at the
+// priority of their caller, which the service checks.
+static bool checksInheritance(const NodePolicy& policy) {
+    return policy.inheritRt && policy.policy == SCHED_NORMAL;
+}
+
+static void parseScenarios(const string& arg) {
+    scenarios = splitList(arg, ',');
+    ASSERT(!scenarios.empty());
+    for (const string& scenario : scenarios) {
+        for (const string& kind : splitList(scenario, '+')) {
+            ASSERT(kind == "none" || isHogKind(kind));
+        }
+    }
+}
+
+// Runs all the pairs once with the interference of |scenario| and dumps
+// their results. Returns the number of calls without priority inheritance.
+static int runScenario(const string& scenario, bool last) {
+    vector<Pipe> client_pipes;
+    vector<pid_t> clients(no_pair);
+    vector<pid_t> hogs = startHogs(scenario);
+    current_scenario = scenario;
+
+    // the main process fork 2 processes for each pairs
+    // 1 server + 1 client
+    // each has a pipe to communicate with
+    for (int i = 0; i < no_pair; i++) {
+        client_pipes.push_back(makeClientProcess(i, iterations, no_pair, &clients[i]));
+    }
+    // wait client to init
+    waitAll(client_pipes);
+
+    // kick off clients
+    signalAll(client_pipes);
+
+    // wait client to finished
+    waitAll(client_pipes);
+    stopHogs(hogs);
+
+    // collect all results
+    PResults total;
+    vector<PResults> presults(no_pair);
+    for (int i = 0; i < no_pair; i++) {
+        client_pipes[i].signal();
+        int recvd = client_pipes[i].recv(presults[i]);
+        ASSERT(recvd >= 0);
+        total = PResults::combine(total, presults[i]);
+    }
+    cout << "\"" << scenario << "\":{" << endl;
+    cout << "\"ALL\":";
+    total.dump();
+    for (int i = 0; i < no_pair; i++) {
+        cout << "\"P" << i << "\":";
+        presults[i].dump();
+    }
+    cout << "\"nNotInherent\":" << total.nNotInherent << "," << endl;
+    cout << "\"inheritance\": " << (total.nNotInherent == 0 ? "\"PASS\"" : "\"FAIL\"") << endl;
+    cout << (last ? "}" : "},") << endl;
+
+    // kill all
+    signalAll(client_pipes);
+    for (pid_t pid : clients) {
+        waitpid(pid, nullptr, 0);
+    }
+    return total.nNotInherent;
+}
+
+// Starts a service per pair, published with |policy| unless it is null.
+static vector<Pipe> startServices(const NodePolicy* policy, vector<pid_t>* pids) {
+    vector<Pipe> service_pipes;
+    pids->resize(no_pair);
+    for (int i = 0; i < no_pair; i++) {
+        service_pipes.push_back(makeServiceProces("hwbinderService" + to_string(i),
+                                                  cpusOfPair(i).second, policy, &(*pids)[i]));
+    }
+    // Wait until all services are up.
+    waitAll(service_pipes);
+    return service_pipes;
+}
+
+static void stopServices(vector<Pipe>& service_pipes, const vector<pid_t>& pids) {
+    signalAll(service_pipes);
+    for (pid_t pid : pids) {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+// Runs every scenario and dumps them. Returns the number of calls without
+// priority inheritance.
+static int runScenarios() {
+    int nNotInherent = 0;
+    cout << "\"interference\":{" << endl;
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        nNotInherent += runScenario(scenarios[i], i + 1 == scenarios.size());
+    }
+    cout << "}," << endl;
+    return nNotInherent;
+}
+
 static void help() {
     cout << "usage:" << endl;
     cout << "-i 1              # number of iterations" << endl;
@@ -271,7 +648,17 @@ static void help() {
     cout << "-deadline_us 2500 # deadline in us" << endl;
     cout << "-v                # debug" << endl;
     cout << "-raw_data         # dump raw data" << endl;
+    cout << "-raw_file out     # raw data into out.fifo_<pair>, binary" << endl;
+    cout << "-raw_capacity N   # keep at most N raw samples, default -i" << endl;
     cout << "-trace            # halt the trace on a dealine hit" << endl;
+    cout << "-perf             # count perf events per transaction" << endl;
+    cout << "-cpus 0:1,2:3     # per pair, pin the callers:the service, - for any" << endl;
+    cout << "-fifo_per_call    # create a fifo thread per call, not one per client" << endl;
+    cout << "-interference none,cpu,mem,fork,cpu+mem" << endl;
+    cout << "                  # run once under each, default none" << endl;
+    cout << "-hogs N           # processes per interference kind, default #cpus" << endl;
+    cout << "-policies default,noinherit,nice:-10,fifo:10+noinherit" << endl;
+    cout << "                  # publish the services with each, run all of the above" << endl;
     exit(0);
 }
 
@@ -279,13 +666,15 @@ static void help() {
 //
 //  libhwbinder_latency -i 1 -v
 //  libhwbinder_latency -i 10000 -pair 4
+//  libhwbinder_latency -i 10000 -pair 2 -cpus 0:0,1:2 -interference none,cpu,mem,fork
+//  libhwbinder_latency -i 10000 -pair 2 -policies default,noinherit,fifo:10 -interference cpu
 //  atrace --async_start -c sched idle workq binder_driver freq && \
 //    libhwbinder_latency -i 10000 -pair 4 -trace
 int main(int argc, char** argv) {
     setenv("TREBLE_TESTING_OVERRIDE", "true", true);
 
-    vector<Pipe> client_pipes;
     vector<Pipe> service_pipes;
+    vector<pid_t> service_pids;
 
     for (int i = 1; i < argc; i++) {
         if (string(argv[i]) == "-h") {
@@ -319,6 +708,42 @@ int main(int argc, char** argv) {
         if (string(argv[i]) == "-raw_data") {
             dump_raw_data = true;
         }
+        if (string(argv[i]) == "-perf") {
+            perf_counters = true;
+        }
+        if (string(argv[i]) == "-raw_file") {
+            raw_file = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-raw_capacity") {
+            raw_capacity = atoll(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-cpus") {
+            parseCpus(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-fifo_per_call") {
+            fifo_per_call = true;
+        }
+        if (string(argv[i]) == "-interference") {
+            parseScenarios(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-hogs") {
+            hogs_per_kind = atoi(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (string(argv[i]) == "-policies") {
+            parsePolicies(argv[i + 1]);
+            i++;
+            continue;
+        }
         // The -trace argument is used like that:
         //
         // First start trace with atrace command as usual
@@ -335,13 +760,13 @@ int main(int argc, char** argv) {
             is_tracing = 1;
         }
     }
-    if (!pass_through) {
-        // Create services.
-        for (int i = 0; i < no_pair; i++) {
-            service_pipes.push_back(makeServiceProces("hwbinderService" + to_string(i)));
-        }
-        // Wait until all services are up.
-        waitAll(service_pipes);
+    if (hogs_per_kind <= 0) {
+        hogs_per_kind = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // a passthrough service has no node to publish
+    ASSERT(!pass_through || policies.empty());
+    if (!pass_through && policies.empty()) {
+        service_pipes = startServices(nullptr, &service_pids);
     }
     if (is_tracing && !traceIsOn()) {
         cerr << "trace is not running" << endl;
@@ -352,49 +777,39 @@ int main(int argc, char** argv) {
     threadDumpPri("main");
     cout << "{" << endl;
     cout << "\"cfg\":{\"pair\":" << (no_pair) << ",\"iterations\":" << iterations
-         << ",\"deadline_us\":" << deadline_us << ",\"passthrough\":" << pass_through << "},"
-         << endl;
-
-    // the main process fork 2 processes for each pairs
-    // 1 server + 1 client
-    // each has a pipe to communicate with
-    for (int i = 0; i < no_pair; i++) {
-        client_pipes.push_back(makeClientProcess(i, iterations, no_pair));
-    }
-    // wait client to init
-    waitAll(client_pipes);
-
-    // kick off clients
-    signalAll(client_pipes);
+         << ",\"deadline_us\":" << deadline_us << ",\"passthrough\":" << pass_through
+         << ",\"fifo_caller\":\"" << (fifo_per_call ? "per_call" : "persistent") << "\""
+         << ",\"cpus\":\"" << cpus_arg << "\",\"hogs\":" << hogs_per_kind << "}," << endl;
 
-    // wait client to finished
-    waitAll(client_pipes);
-
-    // collect all results
-    PResults total, presults[no_pair];
-    for (int i = 0; i < no_pair; i++) {
-        client_pipes[i].signal();
-        int recvd = client_pipes[i].recv(presults[i]);
-        ASSERT(recvd >= 0);
-        total = PResults::combine(total, presults[i]);
-    }
-    cout << "\"ALL\":";
-    total.dump();
-    for (int i = 0; i < no_pair; i++) {
-        cout << "\"P" << i << "\":";
-        presults[i].dump();
-    }
-
-    if (!pass_through) {
-        signalAll(service_pipes);
-    }
     int nNotInherent = 0;
-    for (int i = 0; i < no_pair; i++) {
-        nNotInherent += presults[i].nNotInherent;
+    if (policies.empty()) {
+        nNotInherent = runScenarios();
+        if (!pass_through) {
+            stopServices(service_pipes, service_pids);
+        }
+    } else {
+        cout << "\"policies\":{" << endl;
+        for (size_t i = 0; i < policies.size(); i++) {
+            const NodePolicy& policy = policies[i];
+            current_policy = policy.name;
+            service_pipes = startServices(&policy, &service_pids);
+            cout << "\"" << policy.name << "\":{" << endl;
+            cout << "\"policy\":" << policy.policy << ",\"priority\":" << policy.priority
+                 << ",\"inherit_rt\":" << policy.inheritRt << "," << endl;
+            int n = runScenarios();
+            stopServices(service_pipes, service_pids);
+            // Calls that may run above or below their caller don't count.
+            const char* verdict = "\"SKIP\"";
+            if (checksInheritance(policy)) {
+                nNotInherent += n;
+                verdict = n == 0 ? "\"PASS\"" : "\"FAIL\"";
+            }
+            cout << "\"inheritance\": " << verdict << endl;
+            cout << (i + 1 == policies.size() ? "}" : "},") << endl;
+        }
+        cout << "}," << endl;
     }
     cout << "\"inheritance\": " << (nNotInherent == 0 ? "\"PASS\"" : "\"FAIL\"") << endl;
     cout << "}" << endl;
-    // kill all
-    signalAll(client_pipes);
     return -nNotInherent;
 }
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures what loading libhwbinder costs a process, and what the first use
+// of one of its lazily created text streams costs. Every sample is taken in
+// a freshly forked child that dlopen()s the library itself; this binary
+// doesn't link against it, so nothing is loaded before the measurement.
+
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <hwbinder/TextOutput.h>
+
+#include "PerfTest.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using android::hardware::TextOutput;
+
+// The streams are references; the symbol holds a pointer to the stream.
+#define AOUT_SYMBOL "_ZN7android8hardware4aoutE"
+
+struct LoadSample {
+    bool ok;
+    uint64_t loadNs;         // dlopen() with RTLD_NOW
+    uint64_t firstUseNs;     // first print to aout, which creates it
+    uint64_t nextUseNs;      // second print to aout
+};
+
+static LoadSample measure(const string& lib) {
+    LoadSample sample = {};
+    Tick sta, end;
+
+    TICK_NOW(sta);
+    void* handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+    TICK_NOW(end);
+    if (handle == nullptr) {
+        cerr << "dlopen(" << lib << ") failed: " << dlerror() << endl;
+        return sample;
+    }
+    sample.loadNs = tickDiffNS(sta, end);
+
+    void* sym = dlsym(handle, AOUT_SYMBOL);
+    if (sym == nullptr) {
+        cerr << lib << " has no " AOUT_SYMBOL << endl;
+        return sample;
+    }
+    TextOutput& out = **static_cast<TextOutput**>(sym);
+
+    // Empty prints still create the stream and this thread's buffer, but
+    // keep the output clean.
+    TICK_NOW(sta);
+    out.print("", 0);
+    TICK_NOW(end);
+    sample.firstUseNs = tickDiffNS(sta, end);
+
+    TICK_NOW(sta);
+    out.print("", 0);
+    TICK_NOW(end);
+    sample.nextUseNs = tickDiffNS(sta, end);
+
+    sample.ok = true;
+    return sample;
+}
+
+static void dumpStats(const char* name, vector<uint64_t> values) {
+    std::sort(values.begin(), values.end());
+    uint64_t total = 0;
+    for (uint64_t v : values) total += v;
+    cout << "  \"" << name << "\": { \"min\":" << values.front() / 1000.0
+         << ", \"p50\":" << values[values.size() / 2] / 1000.0
+         << ", \"avg\":" << total / values.size() / 1000.0
+         << ", \"max\":" << values.back() / 1000.0 << " }";
+}
+
+int main(int argc, char** argv) {
+    string lib = "libhidlbase.so";
+    int iterations = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "-l" && i + 1 < argc) {
+            lib = argv[++i];
+        } else if (string(argv[i]) == "-i" && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            cout << "usage: " << argv[0] << " [-l library] [-i iterations]" << endl;
+            return argv[i] == string("-h") ? 0 : 1;
+        }
+    }
+    if (iterations <= 0) iterations = 1;
+
+    vector<uint64_t> load, firstUse, nextUse;
+    for (int i = 0; i < iterations; i++) {
+        auto pipePair = Pipe::createPipePair();
+        pid_t pid = fork();
+        if (pid == 0) {
+            Pipe& p = std::get<1>(pipePair);
+            p.send(measure(lib));
+            _exit(0);
+        }
+        Pipe& p = std::get<0>(pipePair);
+        LoadSample sample = {};
+        p.recv(sample);
+        waitpid(pid, nullptr, 0);
+        if (!sample.ok) return 1;
+        load.push_back(sample.loadNs);
+        firstUse.push_back(sample.firstUseNs);
+        nextUse.push_back(sample.nextUseNs);
+    }
+
+    cout << "{" << endl;
+    cout << "  \"library\": \"" << lib << "\", \"iterations\": " << iterations << "," << endl;
+    dumpStats("load_us", load);
+    cout << "," << endl;
+    dumpStats("first_use_us", firstUse);
+    cout << "," << endl;
+    dumpStats("next_use_us", nextUse);
+    cout << endl << "}" << endl;
+    return 0;
+}
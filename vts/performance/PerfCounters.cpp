@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PerfCounters.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+} kEvents[PerfCounterValues::kEventCount] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu_migrations"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults"},
+};
+
+const char* PerfCounterValues::name(Event event) {
+    return kEvents[event].name;
+}
+
+void PerfCounterValues::add(const PerfCounterValues& other) {
+    for (int i = 0; i < kEventCount; i++) {
+        counts[i] += other.counts[i];
+    }
+    available |= other.available;
+}
+
+void PerfCounterValues::dumpJson(std::ostream& out, uint64_t transactions) const {
+    bool first = true;
+    out << "{";
+    for (int i = 0; i < kEventCount; i++) {
+        if (!has(Event(i))) continue;
+        out << (first ? " \"" : ", \"") << kEvents[i].name
+            << "\":" << (transactions ? (double)counts[i] / transactions : 0.0);
+        first = false;
+    }
+    out << " }";
+}
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds_) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+bool PerfCounters::open() {
+    bool any = false;
+    for (int i = 0; i < PerfCounterValues::kEventCount; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = kEvents[i].type;
+        attr.config = kEvents[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // this process, on any cpu
+        fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        any |= fds_[i] >= 0;
+    }
+    return any;
+}
+
+void PerfCounters::start() {
+    for (int fd : fds_) {
+        if (fd < 0) continue;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void PerfCounters::stop() {
+    for (int fd : fds_) {
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+PerfCounterValues PerfCounters::read() const {
+    PerfCounterValues values;
+    for (int i = 0; i < PerfCounterValues::kEventCount; i++) {
+        uint64_t data[3];  // value, time enabled, time running
+        if (fds_[i] < 0 || ::read(fds_[i], data, sizeof(data)) != sizeof(data)) continue;
+        values.counts[i] = data[2] == 0 ? 0 : data[0] * ((double)data[1] / data[2]);
+        values.available |= 1u << i;
+    }
+    return values;
+}
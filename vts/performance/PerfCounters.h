@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HWBINDER_PERF_COUNTERS_H
+#define HWBINDER_PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#include <ostream>
+
+// Counts of the perf events a PerfCounters measured. Trivially copyable,
+// so forked workers can send it through a Pipe; add() merges them.
+struct PerfCounterValues {
+    enum Event {
+        kInstructions,
+        kCycles,
+        kCacheMisses,
+        kBranchMisses,
+        kTaskClock,  // ns on a CPU; always there, even without a PMU
+        kContextSwitches,
+        kCpuMigrations,
+        kPageFaults,
+        kEventCount,
+    };
+    static const char* name(Event event);
+
+    uint64_t counts[kEventCount] = {};
+    uint32_t available = 0;  // bit per Event that could be counted
+
+    inline bool has(Event event) const { return available & (1u << event); }
+    void add(const PerfCounterValues& other);
+    // write { "<event>": <count per transaction>, ... } for the available
+    // events
+    void dumpJson(std::ostream& out, uint64_t transactions) const;
+};
+
+// Hardware and software counters of the calling process and of the
+// threads it starts afterwards, from perf_event_open(). Events the
+// kernel can't count, such as the hardware ones in most VMs, are left
+// out; the software events work everywhere perf events do.
+//
+//  PerfCounters counters;
+//  counters.open();
+//  counters.start();
+//    ... timed loop ...
+//  counters.stop();
+//  counters.read().dumpJson(cout, iterations);
+//
+class PerfCounters {
+   public:
+    PerfCounters() = default;
+    ~PerfCounters();
+    // open every event that can be counted; false if none could
+    bool open();
+    // reset the counts and start counting
+    void start();
+    // stop counting
+    void stop();
+    // the counts, scaled up when the kernel had to multiplex the events
+    PerfCounterValues read() const;
+
+   private:
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    int fds_[PerfCounterValues::kEventCount] = {-1, -1, -1, -1, -1, -1, -1, -1};
+};
+
+#endif
@@ -15,22 +15,16 @@
  */
 
 #include "PerfTest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
 
-#ifdef ASSERT
-#undef ASSERT
-#endif
-#define ASSERT(cond)                                                                              \
-    do {                                                                                          \
-        if (!(cond)) {                                                                            \
-            cerr << __func__ << ":" << __LINE__ << " condition:" << #cond << " failed\n" << endl; \
-            exit(EXIT_FAILURE);                                                                   \
-        }                                                                                         \
-    } while (0)
-
 // the ratio that the service is synced on the same cpu beyond
 // GOOD_SYNC_MIN is considered as good
 #define GOOD_SYNC_MIN (0.6)
@@ -79,16 +73,72 @@ Pipe::~Pipe() {
     }
 }
 
+Pipe forkChild(const std::function<void(Pipe)>& child, pid_t* pid) {
+    auto pipe_pair = Pipe::createPipePair();
+    pid_t child_pid = fork();
+    ASSERT(child_pid >= 0);
+    if (child_pid == 0) {
+        child(std::move(std::get<1>(pipe_pair)));
+        exit(EXIT_FAILURE);
+    }
+    if (pid != nullptr) *pid = child_pid;
+    return std::move(std::get<0>(pipe_pair));
+}
+
+int Pipe::transfer(int fd, void* data, size_t size, bool out) {
+    uint8_t* cursor = static_cast<uint8_t*>(data);
+    size_t left = size;
+    while (left > 0) {
+        ssize_t n = out ? write(fd, cursor, left) : read(fd, cursor, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        cursor += n;
+        left -= n;
+    }
+    return size;
+}
+
+SampleBuffer::~SampleBuffer() {
+    if (header_ != nullptr) {
+        munmap(header_, mapped_);
+    }
+}
+
+bool SampleBuffer::init(size_t capacity, const string& path) {
+    size_t size = sizeof(Header) + capacity * sizeof(uint64_t);
+    int fd = -1;
+    if (!path.empty()) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            cerr << "cannot create " << path << ": " << strerror(errno) << endl;
+            if (fd >= 0) close(fd);
+            return false;
+        }
+    }
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     (fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED) | MAP_POPULATE, fd, 0);
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "cannot map " << capacity << " samples: " << strerror(errno) << endl;
+        return false;
+    }
+    // MAP_POPULATE is only a hint; touch every page so that add() can't fault.
+    memset(map, 0, size);
+
+    header_ = static_cast<Header*>(map);
+    samples_ = reinterpret_cast<uint64_t*>(header_ + 1);
+    mapped_ = size;
+    memcpy(header_->magic, "HWBLAT\0\0", sizeof(header_->magic));
+    header_->version = kVersion;
+    header_->capacity = capacity;
+    return true;
+}
+
 Results Results::combine(const Results& a, const Results& b) {
     Results ret;
-    for (uint32_t i = 0; i < kNumBuckets; i++) {
-        ret.buckets_[i] = a.buckets_[i] + b.buckets_[i];
-    }
-    ret.worst_ = max(a.worst_, b.worst_);
-    ret.best_ = min(a.best_, b.best_);
-    ret.transactions_ = a.transactions_ + b.transactions_;
+    ret.histogram_ = a.histogram_;
+    ret.histogram_.add(b.histogram_);
     ret.miss_ = a.miss_ + b.miss_;
-    ret.total_time_ = a.total_time_ + b.total_time_;
     return ret;
 }
 
@@ -100,14 +150,10 @@ static void traceStop() {
 }
 
 void Results::addTime(uint64_t nano) {
-    buckets_[min(nano, kMaxTimeBucket - 1) / kTimePerBucket] += 1;
-    best_ = min(nano, best_);
-    worst_ = max(nano, worst_);
+    histogram_.record(nano);
     if (raw_dump_) {
-        raw_data_->push_back(nano);
+        raw_data_->add(nano);
     }
-    transactions_ += 1;
-    total_time_ += nano;
     if (missDeadline(nano)) {
         miss_++;
         if (tracing_) {
@@ -124,62 +170,47 @@ void Results::addTime(uint64_t nano) {
     }
 }
 
-void Results::setupRawData() {
+void Results::setupRawData(size_t capacity, const string& path) {
+    delete raw_data_;
+    raw_data_ = new SampleBuffer;
+    ASSERT(raw_data_->init(capacity, path));
     raw_dump_ = true;
-    if (raw_data_ == nullptr) {
-        raw_data_ = new list<uint64_t>;
-    } else {
-        raw_data_->clear();
-    }
 }
 
-void Results::flushRawData() {
+void Results::flushRawData(bool json) {
     if (raw_dump_) {
-        bool first = true;
-        cout << "[";
-        for (auto nano : *raw_data_) {
-            cout << (first ? "" : ",") << to_string(nano);
-            first = false;
+        if (json) {
+            cout << "[";
+            for (size_t i = 0; i < raw_data_->size(); i++) {
+                cout << (i == 0 ? "" : ",") << to_string(raw_data_->data()[i]);
+            }
+            cout << "]," << endl;
         }
-        cout << "]," << endl;
         delete raw_data_;
         raw_data_ = nullptr;
+        raw_dump_ = false;
     }
 }
 
 void Results::dump() const {
-    double best = (double)best_ / 1.0E6;
-    double worst = (double)worst_ / 1.0E6;
-    double average = (double)total_time_ / transactions_ / 1.0E6;
+    double best = (double)histogram_.min() / 1.0E6;
+    double worst = (double)histogram_.max() / 1.0E6;
+    double average = histogram_.mean() / 1.0E6;
     int W = DUMP_PRICISION + 2;
     cout << std::setprecision(DUMP_PRICISION) << "{ \"avg\":" << setw(W) << left << average
          << ", \"wst\":" << setw(W) << left << worst << ", \"bst\":" << setw(W) << left << best
          << ", \"miss\":" << left << miss_ << ", \"meetR\":" << setprecision(DUMP_PRICISION + 3)
-         << left << (1.0 - (double)miss_ / transactions_) << "}";
+         << left << (1.0 - (double)miss_ / histogram_.count()) << "}";
 }
 
 void Results::dumpDistribution() const {
-    uint64_t cur_total = 0;
-    cout << "{ ";
     cout << std::setprecision(DUMP_PRICISION + 3);
-    for (uint32_t i = 0; i < kNumBuckets; i++) {
-        float cur_time = kTimePerBucketMS * i + 0.5f * kTimePerBucketMS;
-        float accumulation = cur_total + buckets_[i];
-        if ((cur_total < 0.5f * transactions_) && (accumulation >= 0.5f * transactions_)) {
-            cout << "\"p50\":" << cur_time << ", ";
-        }
-        if ((cur_total < 0.9f * transactions_) && (accumulation >= 0.9f * transactions_)) {
-            cout << "\"p90\":" << cur_time << ", ";
-        }
-        if ((cur_total < 0.95f * transactions_) && (accumulation >= 0.95f * transactions_)) {
-            cout << "\"p95\":" << cur_time << ", ";
-        }
-        if ((cur_total < 0.99f * transactions_) && (accumulation >= 0.99f * transactions_)) {
-            cout << "\"p99\": " << cur_time;
-        }
-        cur_total += buckets_[i];
-    }
-    cout << "}";
+    cout << "{ \"p50\":" << histogram_.percentile(50) / 1.0E6
+         << ", \"p90\":" << histogram_.percentile(90) / 1.0E6
+         << ", \"p95\":" << histogram_.percentile(95) / 1.0E6
+         << ", \"p99\":" << histogram_.percentile(99) / 1.0E6
+         << ", \"p99.9\":" << histogram_.percentile(99.9) / 1.0E6
+         << ", \"max\":" << histogram_.max() / 1.0E6 << "}";
 }
 
 PResults PResults::combine(const PResults& a, const PResults& b) {
@@ -188,6 +219,8 @@ PResults PResults::combine(const PResults& a, const PResults& b) {
     ret.nNotSync = a.nNotSync + b.nNotSync;
     ret.other = Results::combine(a.other, b.other);
     ret.fifo = Results::combine(a.fifo, b.fifo);
+    ret.counters = a.counters;
+    ret.counters.add(b.counters);
     return ret;
 }
 
@@ -208,6 +241,21 @@ void PResults::dump() const {
     cout << "," << endl;
     cout << "  \"fifodis\": ";
     fifo.dumpDistribution();
+    if (counters.available) {
+        cout << "," << endl;
+        cout << "  \"perf\":   ";
+        counters.dumpJson(cout, no_trans);
+    }
     cout << endl;
     cout << "}," << endl;
 }
+
+std::vector<size_t> parseList(const char* arg) {
+    std::vector<size_t> values;
+    std::istringstream in(arg);
+    string item;
+    while (getline(in, item, ',')) {
+        values.push_back(strtoul(item.c_str(), nullptr, 0));
+    }
+    return values;
+}
@@ -16,14 +16,36 @@
 #ifndef HWBINDER_PERF_TEST_H
 #define HWBINDER_PERF_TEST_H
 
+#include <stdlib.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include <chrono>
-#include <list>
+#include <functional>
+#include <iostream>
+#include <string>
 #include <tuple>
+#include <vector>
+
+#include "Histogram.h"
+#include "PerfCounters.h"
 
 #define TRACE_PATH "/sys/kernel/debug/tracing"
 
-using std::list;
+// exits the test with the failed condition, e.g. ASSERT(fd >= 0);
+#ifdef ASSERT
+#undef ASSERT
+#endif
+#define ASSERT(cond)                                                                    \
+    do {                                                                                \
+        if (!(cond)) {                                                                  \
+            std::cerr << __func__ << ":" << __LINE__ << " condition:" << #cond           \
+                      << " failed\n"                                                    \
+                      << std::endl;                                                     \
+            exit(EXIT_FAILURE);                                                         \
+        }                                                                               \
+    } while (0)
+
+using std::string;
 using std::tuple;
 
 // Pipe is a object used for IPC between parent process and child process.
@@ -48,15 +70,19 @@ class Pipe {
     // write a data struct
     template <typename T>
     int send(const T& v) {
-        return write(fd_write_, &v, sizeof(T));
+        return transfer(fd_write_, const_cast<T*>(&v), sizeof(T), true);
     }
     // read a data struct
     template <typename T>
     int recv(T& v) {
-        return read(fd_read_, &v, sizeof(T));
+        return transfer(fd_read_, &v, sizeof(T), false);
     }
 
    private:
+    // Moves all |size| bytes, however the pipe splits them. Returns the
+    // size, or -1 on error or a closed pipe.
+    static int transfer(int fd, void* data, size_t size, bool out);
+
     int fd_read_;   // file descriptor to read
     int fd_write_;  // file descriptor to write
     Pipe(int read_fd, int write_fd) : fd_read_{read_fd}, fd_write_{write_fd} {}
@@ -65,6 +91,109 @@ class Pipe {
     Pipe& operator=(const Pipe&&) = delete;
 };
 
+// Forks a child that runs |child| with its end of a new Pipe pair, and
+// exits if that returns. Returns the parent's end.
+Pipe forkChild(const std::function<void(Pipe)>& child, pid_t* pid = nullptr);
+
+// Harnesses built without libhidl, such as libhwbinder_load_time, go
+// without forkStubServer().
+#if __has_include(<hidl/HidlTransportSupport.h>)
+#include <hidl/HidlTransportSupport.h>
+#include <hidl/Static.h>
+#include <hwbinder/IPCThreadState.h>
+
+// Forks a server that registers the HAL of |Stub|, a BnHw class, as
+// |name|, with |Stub| in place of the stub the generated code registered
+// for the interface. |setup| is called in the server with the new stub
+// before it is registered, e.g. to turn features of BHwBinder on. The
+// parent's end of the pipe is signaled once the service is registered;
+// the server then serves until the parent kills it.
+template <typename Stub, typename Setup>
+Pipe forkStubServer(const char* name, pid_t* pid, Setup setup) {
+    using Interface = typename Stub::Pure;
+    return forkChild(
+        [name, &setup](Pipe p) {
+            android::hardware::details::getBnConstructorMap().set(
+                Interface::descriptor,
+                [](void* iIntf) -> android::sp<android::hardware::IBinder> {
+                    return new Stub(static_cast<Interface*>(iIntf));
+                });
+
+            android::sp<Interface> service = Interface::getService(name, true);
+            ASSERT(service != nullptr);
+            android::sp<android::hardware::IBinder> stub =
+                android::hardware::toBinder<Interface>(service);
+            ASSERT(stub->localBinder() != nullptr);
+            setup(stub->localBinder());
+            ASSERT(service->registerAsService(name) == android::OK);
+            p.signal();
+            android::hardware::IPCThreadState::self()->joinThreadPool();
+        },
+        pid);
+}
+
+template <typename Stub>
+Pipe forkStubServer(const char* name, pid_t* pid) {
+    return forkStubServer<Stub>(name, pid, [](android::hardware::BHwBinder*) {});
+}
+#endif
+
+// Fixed-capacity buffer of raw latency samples. All the memory is mapped
+// and faulted in by init(), so add() never allocates or page-faults inside
+// a timed loop. Once more samples arrive than fit, it keeps a uniform
+// random subset of all of them (reservoir sampling), so long runs still get
+// a fair picture of the tail.
+//
+// With a path the buffer is a shared mapping of that file, which then is
+// the binary dump; otherwise it is anonymous memory. The file is a Header
+// followed by |count| little-endian uint64_t samples in ns, e.g. in python:
+//
+//   h = numpy.fromfile(path, dtype='<u8', count=5)   # magic, version, ...
+//   samples = numpy.fromfile(path, dtype='<u8', offset=40, count=h[3])
+//
+class SampleBuffer {
+   public:
+    struct Header {
+        char magic[8];      // "HWBLAT\0\0"
+        uint64_t version;   // kVersion
+        uint64_t capacity;  // number of sample slots
+        uint64_t count;     // slots in use, min(seen, capacity)
+        uint64_t seen;      // samples offered to add()
+    };
+    static const uint64_t kVersion = 1;
+
+    SampleBuffer() = default;
+    ~SampleBuffer();
+    // map room for |capacity| samples, backed by |path| unless it is empty
+    bool init(size_t capacity, const string& path);
+    inline void add(uint64_t nano) {
+        uint64_t seen = header_->seen++;
+        if (seen < header_->capacity) {
+            samples_[header_->count++] = nano;
+            return;
+        }
+        // xorshift64: cheap and allocation-free
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 7;
+        rng_ ^= rng_ << 17;
+        uint64_t slot = rng_ % (seen + 1);
+        if (slot < header_->capacity) {
+            samples_[slot] = nano;
+        }
+    }
+    inline size_t size() const { return header_->count; }
+    inline uint64_t seen() const { return header_->seen; }
+    inline const uint64_t* data() const { return samples_; }
+
+   private:
+    SampleBuffer(const SampleBuffer&) = delete;
+    SampleBuffer& operator=(const SampleBuffer&) = delete;
+    Header* header_ = nullptr;
+    uint64_t* samples_ = nullptr;
+    size_t mapped_ = 0;
+    uint64_t rng_ = 0x9e3779b97f4a7c15ULL;
+};
+
 // statistics of latency
 // common usage:
 //
@@ -86,34 +215,27 @@ class Results {
         tracing_ = tracing;
         deadline_us_ = deadline_us;
     }
-    inline uint64_t getTransactions() const { return transactions_; }
+    inline uint64_t getTransactions() const { return histogram_.count(); }
     inline bool missDeadline(uint64_t nano) const { return nano > deadline_us_ * 1000; }
     // Combine two sets of latency data points and update the aggregation info.
     static Results combine(const Results& a, const Results& b);
     // add a new transaction latency record
     void addTime(uint64_t nano);
-    // prepare for raw data recording, it may allocate resources which requires
-    // a flushRawData() to release
-    void setupRawData();
-    // dump the raw data and release the resource
-    void flushRawData();
+    // prepare for raw data recording of up to |capacity| samples, into the
+    // file |path| if given. It allocates resources which require a
+    // flushRawData() to release
+    void setupRawData(size_t capacity, const string& path = "");
+    // dump the raw data in json if |json| and release the resource
+    void flushRawData(bool json = true);
     // dump average, best, worst latency in json
     void dump() const;
     // dump latency distribution in json
     void dumpDistribution() const;
 
    private:
-    static const uint32_t kNumBuckets = 128;
-    static const uint64_t kMaxTimeBucket = 50ull * 1000000;
-    static const uint64_t kTimePerBucket = kMaxTimeBucket / kNumBuckets;
-    static constexpr float kTimePerBucketMS = kTimePerBucket / 1.0E6;
-    uint64_t best_ = 0xffffffffffffffffULL;  // best transaction latency in ns.
-    uint64_t worst_ = 0;                     // worst transaction latency in ns.
-    uint64_t transactions_ = 0;              // number of transactions
-    uint64_t total_time_ = 0;                // total transaction time
+    LatencyHistogram histogram_;             // latencies in ns.
     uint64_t miss_ = 0;                      // number of transactions whose latency > deadline
-    uint32_t buckets_[kNumBuckets] = {0};    // statistics for the distribution
-    list<uint64_t>* raw_data_ = nullptr;     // list for raw-data
+    SampleBuffer* raw_data_ = nullptr;       // buffer for raw-data
     bool tracing_ = false;                   // halt the trace log on a deadline miss
     bool raw_dump_ = false;                  // record the raw data for the dump after
     uint64_t deadline_us_ = 2500;            // latency deadline in us.
@@ -127,12 +249,16 @@ class PResults {
     int nNotSync = 0;      ///< #transactions that are not synced
     Results other;         ///< statistics of CFS-other transactions
     Results fifo;          ///< statistics of RT-fifo transactions
+    PerfCounterValues counters;  ///< perf events over both kinds of transactions
     // dump and flush the raw data
-    inline void flushRawData() { fifo.flushRawData(); }
+    inline void flushRawData(bool json = true) { fifo.flushRawData(json); }
     // dump in json
     void dump() const;
 };
 
+// numbers of a comma separated list argument, e.g. "-sizes 16,4096"
+std::vector<size_t> parseList(const char* arg);
+
 // Tick keeps timestamp
 typedef std::chrono::time_point<std::chrono::high_resolution_clock> Tick;
 